@@ -16,12 +16,63 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "ap_mpm.h"
+#include "apr_atomic.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
+#include "http_connection.h"
+#include "mod_status.h"
+#include "util_cookies.h"
+#include "util_filter.h"
+
 #include "mod_pgconn.h"
+#include "pgconn_index.h"
+#include "pgconn_trace.h"
+
+/* zstd compression of 'TraceFormat Binary' trace files.  It is only compiled
+   in if PGCONN_ZSTD is defined (see the Makefile) */
+#ifdef PGCONN_ZSTD
+#include <zstd.h>
+#endif
+
+/* 'TraceMode Ring' (and so 'TraceFormat Binary') copies PQtrace()'s output
+   into the ring buffer through a fopencookie() stream, which is a glibc
+   extension.  Elsewhere (e.g. musl) only 'TraceMode PerConnection' works */
+#if defined(__GLIBC__)
+#define PGCONN_HAVE_FOPENCOOKIE
+#endif
+
+/* USDT probes (provider "pgconn"), for tracing with e.g. bpftrace.  They are
+   only compiled in if PGCONN_USDT is defined (see the Makefile), and are a
+   single NOP each until a tracer attaches */
+#ifdef PGCONN_USDT
+#include <sys/sdt.h>
+#define PGCONN_PROBE2(n, a, b)		DTRACE_PROBE2(pgconn, n, a, b)
+#define PGCONN_PROBE3(n, a, b, c)	DTRACE_PROBE3(pgconn, n, a, b, c)
+#else
+#define PGCONN_PROBE2(n, a, b)
+#define PGCONN_PROBE3(n, a, b, c)
+#endif
+
+
+/* Every <PGconn> container (in every Virtual Host), indexed by handle */
+static apr_array_header_t* g_PGconnContainers;
+
+/* The statistics shared memory segment, and this child's slot in it */
+static tPGconnScoreboard g_scoreboard;
+static int g_scoreboardSlot = -1;
+
+/* The number of striped counter sets per <PGconn> container (see
+   PGCONN_STATS_STRIPES) */
+static int g_statsStripes = 1;
 
 
 /******************************************************************************
@@ -40,10 +91,21 @@ static tPGconnContainer* getPGconnContainerByName(
 	const char* v_connectionName
 )
 {
+	tPGconnContainer* t_PGconnContainer;
+	apr_size_t t_length;
+
 	if ((!v_PGconnServerConfig) || (!v_connectionName))
 		return NULL;
 
-	tPGconnContainer* t_PGconnContainer;
+	/* Look the case-folded name up in the index.  Names that are too long
+	   to fold on the stack (there shouldn't be any) are searched for */
+	t_length = strlen(v_connectionName);
+	if (t_length < PGCONN_INDEX_MAX_NAME)
+		return (tPGconnContainer*)getPGconnIndexEntry(
+			v_PGconnServerConfig->m_index, v_connectionName,
+			t_length
+		);
+
 	for (t_PGconnContainer = v_PGconnServerConfig->m_first_PGconnContainer;
 			t_PGconnContainer;
 			t_PGconnContainer = t_PGconnContainer->m_next)
@@ -55,569 +117,6045 @@ static tPGconnContainer* getPGconnContainerByName(
 
 
 /******************************************************************************
- * openPGconn()                                                               *
- *   Opens a new PostgreSQL connection.  This function should only be called  *
- * as the PGconn* resource list constructor.                                  *
+ * getPGconnContainerHandle()                                                 *
+ *   Resolves a connection name to a handle, which consumer modules can cache *
+ * (e.g. in their per-directory configuration) and pass to                    *
+ * getPGconnContainerByHandle() instead of looking the name up every time.    *
+ * Handles are valid until the configuration is next read.                    *
  *                                                                            *
- * IN:	v_PGconnContainer - connection container details.                     *
- * 	v_pool - pool to use for memory allocation.                           *
- *                                                                            *
- * OUT:	v_PGconn - connection record pointer.                                 *
+ * IN:	v_PGconnServerConfig - the server config that points to the start of  *
+ * 				the <PGconn> container list to search.        *
+ * 	v_connectionName - the connection name to search for.                 *
  *                                                                            *
- * Returns:	APR_SUCCESS - if the connection was opened successfully.      *
- * 		APR_EGENERAL - if the connection could not be opened.         *
+ * Returns:	the handle (>= 0), or...                                      *
+ * 		-1, if the connection name was not found.                     *
  ******************************************************************************/
-static apr_status_t openPGconn(
-	void** v_PGconn,
-	void* v_PGconnContainer,
-	apr_pool_t* v_pool_unused
+static int getPGconnContainerHandle(
+	const tPGconnServerConfig* v_PGconnServerConfig,
+	const char* v_connectionName
 )
 {
-	/* Check and initialize the connection pointer */
-	if ((!v_PGconn) || (!v_PGconnContainer))
-		return APR_EGENERAL;
-	*v_PGconn = NULL;
-
-	/* Open a PostgreSQL connection */
-	PGconn* t_PGconn = PQconnectdb(
-		((tPGconnContainer*)v_PGconnContainer)->m_connInfo
+	tPGconnContainer* t_PGconnContainer = getPGconnContainerByName(
+		v_PGconnServerConfig, v_connectionName
 	);
-	if (!t_PGconn)
-		return APR_EGENERAL;	/* Out of memory! */
 
-	/* Check that the connection was opened successfully */
-	if (PQstatus(t_PGconn) != CONNECTION_OK) {
-		ap_log_error(
-			APLOG_MARK, APLOG_ERR, 0, NULL,
-			"PQconnectdb() error: %s", PQerrorMessage(t_PGconn)
-		);
-		PQfinish(t_PGconn);
-		return APR_EGENERAL;
-	}
-	else {
-		(*(PGconn**)v_PGconn) = t_PGconn;
-		return APR_SUCCESS;
-	}
+	return t_PGconnContainer ? t_PGconnContainer->m_handle : -1;
 }
 
 
 /******************************************************************************
- * openPGconn_tracing()                                                       *
- *   Opens a new PostgreSQL connection, outputting connection tracing         *
- * information to a file.  This function should only be called as the PGconn* *
- * resource list constructor.                                                 *
+ * getPGconnContainerByHandle()                                               *
+ *   Finds the <PGconn> container that a handle refers to.                    *
  *                                                                            *
- * IN:	v_PGconnContainer - connection container details.                     *
- * 	v_pool - pool to use for memory allocation.                           *
+ * IN:	v_handle - the handle, from getPGconnContainerHandle().               *
  *                                                                            *
- * OUT:	v_PGconn - connection record pointer.                                 *
- *                                                                            *
- * Returns:	APR_SUCCESS - if the connection was opened successfully.      *
- * 		APR_EGENERAL - if the connection could not be opened.         *
+ * Returns:	pointer to the <PGconn> container, or...                      *
+ * 		NULL, if the handle is not valid.                             *
  ******************************************************************************/
-static apr_status_t openPGconn_tracing(
-	void** v_PGconn,
-	void* v_PGconnContainer,
-	apr_pool_t* v_pool
+static tPGconnContainer* getPGconnContainerByHandle(
+	int v_handle
 )
 {
-	/* Check and initialize the connection pointer */
-	if ((!v_PGconn) || (!v_PGconnContainer) || (!v_pool))
-		return APR_EGENERAL;
-	*v_PGconn = NULL;
-
-	/* Open a PostgreSQL connection */
-	#define d_PGconnContainer	((tPGconnContainer*)v_PGconnContainer)
-	PGconn* t_PGconn = PQconnectdb(d_PGconnContainer->m_connInfo);
-	if (!t_PGconn)
-		return APR_EGENERAL;	/* Out of memory! */
-
-	/* Check that the connection was opened successfully */
-	if (PQstatus(t_PGconn) != CONNECTION_OK) {
-		ap_log_error(
-			APLOG_MARK, APLOG_ERR, 0, NULL,
-			"PQconnectdb() error: %s", PQerrorMessage(t_PGconn)
-		);
-		PQfinish(t_PGconn);
-		return APR_EGENERAL;
-	}
-
-	/* Open a new trace file */
-	FILE* t_traceFile = fopen(
-		apr_psprintf(
-			v_pool, "%s/%d_%d.trc", d_PGconnContainer->m_traceDir,
-			getpid(), PQbackendPID(t_PGconn)
-		),
-		"w"
+	return (tPGconnContainer*)getPGconnHandleEntry(
+		g_PGconnContainers, v_handle
 	);
-	if (!t_traceFile) {
-		/* Failed to open trace file */
-		/* Close PostgreSQL connection */
-		PQfinish(t_PGconn);
-		return APR_EGENERAL;
-	}
+}
 
-	/* Register a cleanup handler to close the trace file when the memory
-	   pool is destroyed */
-	apr_pool_cleanup_register(
-		v_pool, t_traceFile, (void*)fclose, apr_pool_cleanup_null
-	);
 
-	/* Start tracing */
-	PQtrace(t_PGconn, t_traceFile);
+/******************************************************************************
+ * getSharedPGconnContainer()                                                 *
+ *   Gets the <PGconn> container whose PGconn* resource lists (and runtime    *
+ * state) a container uses.  This is the container itself, unless it has been *
+ * merged into an identical container (or one with the same 'SharedPool'      *
+ * name) by PGconn_postConfig().                                              *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	the container that owns the resource lists.                   *
+ ******************************************************************************/
+static const tPGconnContainer* getSharedPGconnContainer(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return v_PGconnContainer->m_shared ? v_PGconnContainer->m_shared
+						: v_PGconnContainer;
+}
 
-	(*(PGconn**)v_PGconn) = t_PGconn;
-	return APR_SUCCESS;
 
-	#undef d_PGconnContainer
+/******************************************************************************
+ * updateHostLatency()                                                        *
+ *   Folds a latency sample into a host's exponentially weighted moving       *
+ * average (alpha = 1/8).                                                     *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ * 	v_latency - the latency sample.                                       *
+ ******************************************************************************/
+static void updateHostLatency(
+	tPGconnHost* v_PGconnHost,
+	apr_interval_time_t v_latency
+)
+{
+	apr_uint32_t t_old;
+	apr_uint32_t t_new;
+	apr_int64_t t_step;
+	apr_uint32_t t_sample = (v_latency <= 0) ? 1
+				: (v_latency > 0x7FFFFFFF) ? 0x7FFFFFFF
+				: (apr_uint32_t)v_latency;
+
+	/* Concurrent updates are rare, but don't lose them */
+	do {
+		t_old = apr_atomic_read32(&(v_PGconnHost->m_latency));
+		if (!t_old)
+			t_new = t_sample;
+		else {
+			/* Always move at least 1us towards the sample, so that
+			   the average can't get stuck when the difference is
+			   less than 8us */
+			t_step = ((apr_int64_t)t_sample - t_old) / 8;
+			if ((!t_step) && (t_sample != t_old))
+				t_step = (t_sample > t_old) ? 1 : -1;
+			t_new = (apr_uint32_t)(t_old + t_step);
+		}
+		if (t_new == t_old)
+			return;
+	} while (apr_atomic_cas32(&(v_PGconnHost->m_latency), t_new, t_old)
+								!= t_old);
 }
 
 
 /******************************************************************************
- * closePGconn()                                                              *
- *   Closes a PostgreSQL connection.  This function should only be called as  *
- * the PGconn* resource list destructor.                                      *
+ * readLSN()                                                                  *
+ *   Converts a textual PostgreSQL LSN (e.g. "16/B374D848") to a number.      *
  *                                                                            *
- * IN:	v_PGconn - connection record pointer.                                 *
+ * IN:	v_LSN - the textual LSN (or NULL).                                    *
  *                                                                            *
- * Returns:	APR_SUCCESS - if the connection was closed successfully.      *
- * 		APR_EGENERAL - if there was no connection to close.           *
+ * Returns:	the LSN, or...                                                *
+ * 		0, if v_LSN is NULL or not a valid LSN.                       *
  ******************************************************************************/
-static apr_status_t closePGconn(
-	void* v_PGconn,
-	void* v_PGconnContainer_unused,
-	apr_pool_t* v_pool_unused
+static apr_uint64_t readLSN(
+	const char* v_LSN
 )
 {
-	if (!v_PGconn)
-		return APR_EGENERAL;
-	else {
-		/* Close the PostgreSQL connection */
-		PQfinish((PGconn*)v_PGconn);
-		return APR_SUCCESS;
-	}
+	char* t_endPtr;
+	apr_uint64_t t_high;
+
+	if (!v_LSN)
+		return 0;
+	t_high = strtoul(v_LSN, &t_endPtr, 16);
+	if (*t_endPtr != '/')
+		return 0;
+	return (t_high << 32) | strtoul(t_endPtr + 1, NULL, 16);
 }
 
 
 /******************************************************************************
- * closePGconn_tracing()                                                      *
- *   Disabled connection tracing and closes a PostgreSQL connection.  This    *
- * function should only be called as the PGconn* resource list destructor.    *
+ * getHistogramBucket()                                                       *
+ *   Finds the latency histogram bucket that a value should be counted in.    *
+ * See PGCONN_HISTOGRAM_BUCKETS.                                              *
  *                                                                            *
- * IN:	v_PGconn - connection record pointer.                                 *
+ * IN:	v_value - the value, in microseconds.                                 *
  *                                                                            *
- * Returns:	APR_SUCCESS - if the connection was closed successfully.      *
- * 		APR_EGENERAL - if there was no connection to close.           *
+ * Returns:	0..(PGCONN_HISTOGRAM_BUCKETS - 1).                            *
  ******************************************************************************/
-static apr_status_t closePGconn_tracing(
-	void* v_PGconn,
-	void* v_PGconnContainer_unused,
-	apr_pool_t* v_pool_unused
+static int getHistogramBucket(
+	apr_interval_time_t v_value
 )
 {
-	if (!v_PGconn)
-		return APR_EGENERAL;
-	else {
-		/* Disable connection tracing and close the PostgreSQL
-		  connection */
-		PQuntrace((PGconn*)v_PGconn);
-		PQfinish((PGconn*)v_PGconn);
-		return APR_SUCCESS;
-	}
+	int t_power = 2;
+
+	if (v_value < PGCONN_HISTOGRAM_SUBBUCKETS)
+		return (v_value < 0) ? 0 : (int)v_value;
+
+	/* Find the power of two, and then the sub-bucket within it */
+	while ((v_value >> (t_power + 1)) && (t_power < 31))
+		t_power++;
+	if (v_value >> (t_power + 1))
+		return PGCONN_HISTOGRAM_BUCKETS - 1;
+	return ((t_power - 1) * PGCONN_HISTOGRAM_SUBBUCKETS)
+		+ (int)((v_value >> (t_power - 2))
+					& (PGCONN_HISTOGRAM_SUBBUCKETS - 1));
 }
 
 
 /******************************************************************************
- * acquirePGconn()                                                            *
- *   Acquires a PostgreSQL connection from the PGconn* resource list.         *
- * The resource list takes care of closing/reusing/timing-out connections as  *
- * required.                                                                  *
- *                                                                            *
- * IN:	v_PGconnContainer - connection container details.                     *
- * 	v_PGconn - should be NULL.                                            *
+ * getHistogramBound()                                                        *
+ *   Gets the upper bound of a latency histogram bucket.                      *
  *                                                                            *
- * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ * IN:	v_bucket - 0..(PGCONN_HISTOGRAM_BUCKETS - 1).                         *
  *                                                                            *
- * Returns:	PGCONN_ACQUIRED - if everything was OK.                       *
- * 		PGCONN_ALREADYACQUIRED - if a connection was already          *
- * 					acquired.                             *
- * 		PGCONN_UNAVAILABLE - if all the connections in the pool are   *
- * 					already in use.                       *
- * 		PGCONN_BAD - if the connection could not be opened/reset.     *
+ * Returns:	the smallest value (in microseconds) that is counted in a     *
+ * 		later bucket.                                                 *
  ******************************************************************************/
-static ePGconnStatus acquirePGconn(
-	const tPGconnContainer* v_PGconnContainer,
-	PGconn** v_PGconn
+static apr_interval_time_t getHistogramBound(
+	int v_bucket
 )
 {
-	if ((!v_PGconnContainer) || (!v_PGconn))
-		return PGCONN_BAD;
-	/* Don't allow acquirePGconn() to be called twice without a call to
-	   releasePGconn() inbetween */
-	else if (*v_PGconn)
-		return PGCONN_ALREADYACQUIRED;
-	/* Check that the PGconn* resource list was created successfully */
-	else if (!(v_PGconnContainer->m_PGconnPool))
-		return PGCONN_UNAVAILABLE;
+	if (v_bucket < PGCONN_HISTOGRAM_SUBBUCKETS)
+		return v_bucket + 1;
 
-	/* Acquire a connection from the PGconn* resource list */
-	apr_status_t t_status = apr_reslist_acquire(
-		v_PGconnContainer->m_PGconnPool, (void**)v_PGconn
-	);
-	if (t_status != APR_SUCCESS)
-		return PGCONN_UNAVAILABLE;
+	/* Bucket (N - 1) * 4 + S counts 2^N + S * 2^(N-2) up to the next
+	   quarter */
+	return (apr_interval_time_t)(PGCONN_HISTOGRAM_SUBBUCKETS + 1
+				+ (v_bucket % PGCONN_HISTOGRAM_SUBBUCKETS))
+		<< ((v_bucket / PGCONN_HISTOGRAM_SUBBUCKETS) - 1);
+}
 
-	/* Check the connection status */
-	if (PQstatus(*v_PGconn) != CONNECTION_OK) {
-		/* Problem with connection. Try resetting it */
-		PQreset(*v_PGconn);
-		/* Check the connection status again */
-		if (PQstatus(*v_PGconn) != CONNECTION_OK) {
-			/* Connection still doesn't work, so release the
-			   resource straight away */
-			apr_reslist_release(
-				v_PGconnContainer->m_PGconnPool, *v_PGconn
-			);
-			*v_PGconn = NULL;
-			return PGCONN_BAD;
-		}
-	}
 
-	/* Connection acquired successfully */
-	return PGCONN_ACQUIRED;
+/******************************************************************************
+ * recordHistogram()                                                          *
+ *   Counts a value in a latency histogram.                                   *
+ *                                                                            *
+ * IN:	v_histogram - the histogram.                                          *
+ * 	v_value - the value, in microseconds.                                 *
+ ******************************************************************************/
+static void recordHistogram(
+	tPGconnHistogram* v_histogram,
+	apr_interval_time_t v_value
+)
+{
+	apr_atomic_inc64(
+		&(v_histogram->m_bucket[getHistogramBucket(v_value)])
+	);
 }
 
 
 /******************************************************************************
- * releasePGconn()                                                            *
- *   Releases a PostgreSQL connection back to the PGconn* resource list.      *
- * The resource list takes care of closing/reusing/timing-out connections as  *
- * required.                                                                  *
- *                                                                            *
- * IN:	v_PGconnContainer - connection container details.                     *
- * 	v_PGconn - connection record pointer (should be non-NULL).            *
+ * addHistogram()                                                             *
+ *   Adds a latency histogram to a set of bucket counts.                      *
  *                                                                            *
- * OUT:	v_PGconn - NULL (if the connection has been released successfully).   *
+ * IN:	v_histogram - the histogram.                                          *
+ * 	v_bucket - PGCONN_HISTOGRAM_BUCKETS counts.                           *
  *                                                                            *
- * Returns:	PGCONN_RELEASED - if everything was OK.                       *
- * 		PGCONN_BAD - if there was no acquired connection to release.  *
+ * OUT:	v_bucket - the updated counts.                                        *
  ******************************************************************************/
-static ePGconnStatus releasePGconn(
-	const tPGconnContainer* v_PGconnContainer,
-	PGconn** v_PGconn
+static void addHistogram(
+	tPGconnHistogram* v_histogram,
+	apr_uint64_t* v_bucket
 )
 {
-	/* If there is a currently acquired connection, release the resource */
-	if ((!v_PGconnContainer) || (!v_PGconn))
-		return PGCONN_BAD;
-	else if (*v_PGconn)
-		if (apr_reslist_release(v_PGconnContainer->m_PGconnPool,
-					*v_PGconn) == APR_SUCCESS) {
-			*v_PGconn = NULL;
-			return PGCONN_RELEASED;
-		}
+	int i;
 
-	return PGCONN_BAD;	/* No acquired connection to release! */
+	for (i = 0; i < PGCONN_HISTOGRAM_BUCKETS; i++)
+		v_bucket[i] += apr_atomic_read64(&(v_histogram->m_bucket[i]));
 }
 
 
 /******************************************************************************
- * measurePGconnAvailability()                                                *
- *   Check how many PGconn resources aren't currently in use.                 *
+ * getPGconnCounters()                                                        *
+ *   Gets the set of a <PGconn> container's pool statistics counters that the *
+ * calling thread should update (see PGCONN_STATS_STRIPES).                   *
  *                                                                            *
- * IN:	v_PGconnContainer - connection container details.                     *
+ * IN:	v_PGconnContainer - connection container details (not merged into     *
+ * 			another).                                             *
  *                                                                            *
- * Returns:	0..100 - % of the total PGconn resources not currently in use.*
+ * Returns:	the counters.                                                 *
  ******************************************************************************/
-static int measurePGconnAvailability(
+static tPGconnCounters* getPGconnCounters(
 	const tPGconnContainer* v_PGconnContainer
 )
 {
-	if (!v_PGconnContainer)
-		return 0;
+	apr_uint32_t t_hash;
 
-	return ((v_PGconnContainer->m_poolMaxHard
-			- apr_reslist_acquired_count(
-				v_PGconnContainer->m_PGconnPool
-			)
-		) * 100) / v_PGconnContainer->m_poolMaxHard;
+	if (g_statsStripes < 2)
+		return v_PGconnContainer->m_stats;
+
+	/* Thread IDs are often addresses that differ only in their higher
+	   bits, so mix them (with the same hash as selectReplica()) */
+	t_hash = (apr_uint32_t)(apr_uintptr_t)apr_os_thread_current();
+	t_hash = ((t_hash >> 16) ^ t_hash) * 0x45D9F3B;
+	t_hash = ((t_hash >> 16) ^ t_hash) * 0x45D9F3B;
+	t_hash = (t_hash >> 16) ^ t_hash;
+	return &(v_PGconnContainer->m_stats[t_hash % g_statsStripes]);
 }
 
 
 /******************************************************************************
- * PGconn_serverConfig_create()                                               *
- *   Creates the per-server configuration structure.                          *
+ * mayHaveWritten()                                                           *
+ *   Determines whether a command may have written to the database, from its  *
+ * result.  SELECT counts, because it may call functions that write; a read   *
+ * that follows one that didn't write only costs the replica one extra round  *
+ * trip (see hasReplayedLSN()), rather than being sent to the primary.        *
  *                                                                            *
- * IN:	v_pool - pool to use for memory allocation.                           *
+ * IN:	v_PGresult - the command's result.                                    *
  *                                                                            *
- * Returns:	pointer to per-server config structure.                       *
+ * Returns:	1 - if the command may have written.                          *
+ * 		0 - if it didn't.                                             *
  ******************************************************************************/
-static void* PGconn_serverConfig_create(
-	apr_pool_t* v_pool,
-	server_rec* v_server_unused
+static int mayHaveWritten(
+	const PGresult* v_PGresult
 )
 {
-	tPGconnServerConfig* t_PGconnServerConfig;
+	static const char* const t_readOnlyCommands[] = {
+		"SHOW", "SET", "RESET", "BEGIN", "START TRANSACTION", "COMMIT",
+		"ROLLBACK", "DISCARD", "DEALLOCATE", "DECLARE", "FETCH",
+		"MOVE", "CLOSE", "LISTEN", "UNLISTEN", NULL
+	};
+	const char* t_commandStatus;
+	size_t t_length;
+	int i;
 
-	/* Allocate memory for per-server config structure */
-	t_PGconnServerConfig = (tPGconnServerConfig*)apr_pcalloc(
-		v_pool, sizeof(*t_PGconnServerConfig)
-	);
+	switch (PQresultStatus(v_PGresult)) {
+		case PGRES_EMPTY_QUERY:
+		case PGRES_BAD_RESPONSE:
+		case PGRES_FATAL_ERROR:
+			return 0;
+		default:
+			break;
+	}
 
-	/* No connections setup to start with. 'm_first_PGconnContainer' will
-	   have already been NULLified by memset() */
+	t_commandStatus = PQcmdStatus((PGresult*)v_PGresult);
+	for (i = 0; t_readOnlyCommands[i]; i++) {
+		t_length = strlen(t_readOnlyCommands[i]);
+		if ((!strncmp(t_commandStatus, t_readOnlyCommands[i],
+							t_length))
+				&& ((t_commandStatus[t_length] == '\0')
+					|| (t_commandStatus[t_length] == ' ')))
+			return 0;
+	}
 
-	return (void*)t_PGconnServerConfig;
+	return 1;
 }
 
 
 /******************************************************************************
- * PGconn_dirConfig_create()                                                  *
- *   Creates the per-directory configuration structure.                       *
+ * PGconn_eventProc()                                                         *
+ *   libpq event procedure.  It is registered on every pooled connection so   *
+ * that the connection's tPGconnResource can be found from its PGconn*.       *
+ * When a connection is reset, it recreates the connection's PGcancel object, *
+ * because the new backend has a different PID and cancel key, and notes      *
+ * that the new session has no statement_timeout set.  When the first result  *
+ * of a checkout is created, it feeds the time since the connection was       *
+ * acquired into the host's latency average (see getReplicaLoad()).  Every    *
+ * result notes whether the checkout may have written (see mayHaveWritten()). *
  *                                                                            *
- * IN:	v_pool - pool to use for memory allocation.                           *
+ * IN:	v_eventId - the event.                                                *
+ * 	v_eventInfo - the event's details.                                    *
  *                                                                            *
- * Returns:	pointer to per-directory config structure.                    *
+ * Returns:	1 (i.e. success), for every event.                            *
  ******************************************************************************/
-static void* PGconn_dirConfig_create(
-	apr_pool_t* v_pool,
-	char* v_directory_unused
+static int PGconn_eventProc(
+	PGEventId v_eventId,
+	void* v_eventInfo,
+	void* v_passThrough_unused
 )
 {
-	tPGconnDirConfig* t_PGconnDirConfig;
-
-	/* Allocate memory for per-directory config structure, zeroising it with
-	   memset() */
-	t_PGconnDirConfig = (tPGconnDirConfig*)apr_pcalloc(
-		v_pool, sizeof(*t_PGconnDirConfig)
-	);
+	tPGconnResource* t_resource;
 
-	/* There is no default default <PGconn> container.
-	   'm_defaultPGconnContainer' will have already been NULLified by
-	   memset() */
+	if (v_eventId == PGEVT_RESULTCREATE) {
+		#define d_eventInfo	((PGEventResultCreate*)v_eventInfo)
+		t_resource = (tPGconnResource*)PQinstanceData(
+			d_eventInfo->conn, PGconn_eventProc
+		);
+		if (t_resource && t_resource->m_firstResultPending
+				&& t_resource->m_acquireTime) {
+			t_resource->m_firstResultPending = 0;
+			updateHostLatency(
+				t_resource->m_PGconnHost,
+				apr_time_now() - t_resource->m_acquireTime
+			);
+		}
+		if (t_resource && (!t_resource->m_wrote))
+			t_resource->m_wrote = mayHaveWritten(
+				d_eventInfo->result
+			);
+		#undef d_eventInfo
+	}
+	else if (v_eventId == PGEVT_CONNRESET) {
+		#define d_PGconn	(((PGEventConnReset*)v_eventInfo)->conn)
+		t_resource = (tPGconnResource*)PQinstanceData(
+			d_PGconn, PGconn_eventProc
+		);
+		/* Connections are only reset by acquireHostPGconn(), before
+		   the watchdog can see them, so the watchdog can't be using
+		   the old PGcancel object */
+		if (t_resource) {
+			if (t_resource->m_PGcancel)
+				PQfreeCancel(t_resource->m_PGcancel);
+			t_resource->m_PGcancel = PQgetCancel(d_PGconn);
+			t_resource->m_statementTimeoutSet = 0;
+			t_resource->m_resetPending = 0;
+		}
+		#undef d_PGconn
+	}
 
-	return (void*)t_PGconnDirConfig;
+	return 1;
 }
 
 
 /******************************************************************************
- * PGconn_containerCommand()                                                  *
- *   Process the "<PGconn>" container directive.                              *
+ * getPGconnResource()                                                        *
+ *   Finds the resource list entry that owns a PostgreSQL connection.         *
+ *                                                                            *
+ * IN:	v_PGconn - connection record pointer.                                 *
+ *                                                                            *
+ * Returns:	pointer to the resource, or...                                *
+ * 		NULL, if the connection was not opened by this module.        *
+ ******************************************************************************/
+static tPGconnResource* getPGconnResource(
+	const PGconn* v_PGconn
+)
+{
+	return (tPGconnResource*)PQinstanceData(v_PGconn, PGconn_eventProc);
+}
+
+
+/******************************************************************************
+ * openPGconn()                                                               *
+ *   Opens a new PostgreSQL connection.  This function should only be called  *
+ * as the PGconn* resource list constructor.                                  *
+ *                                                                            *
+ * IN:	v_PGconnHost - details of the host to connect to.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * OUT:	v_resource - resource record pointer.                                 *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the connection was opened successfully.      *
+ * 		APR_EGENERAL - if the connection could not be opened.         *
+ ******************************************************************************/
+static apr_status_t openPGconn(
+	void** v_resource,
+	void* v_PGconnHost,
+	apr_pool_t* v_pool_unused
+)
+{
+	/* Check and initialize the resource pointer */
+	if ((!v_resource) || (!v_PGconnHost))
+		return APR_EGENERAL;
+	*v_resource = NULL;
+
+	/* Allocate the resource record.  This isn't allocated from the
+	   resource list's pool, because connections come and go for the
+	   lifetime of the resource list */
+	tPGconnResource* t_resource = (tPGconnResource*)calloc(
+		1, sizeof(*t_resource)
+	);
+	if (!t_resource)
+		return APR_EGENERAL;	/* Out of memory! */
+
+	#define d_stats	getPGconnCounters(	\
+		((tPGconnHost*)v_PGconnHost)->m_PGconnContainer)
+
+	/* Open a PostgreSQL connection */
+	#define d_PGconnHost	((tPGconnHost*)v_PGconnHost)
+	PGCONN_PROBE2(
+		connect__start, d_PGconnHost->m_PGconnContainer->m_name,
+		d_PGconnHost->m_hostName
+	);
+	apr_time_t t_startTime = apr_time_now();
+	PGconn* t_PGconn = PQconnectdb(d_PGconnHost->m_connInfo);
+	PGCONN_PROBE3(
+		connect__done, d_PGconnHost->m_PGconnContainer->m_name,
+		PQstatus(t_PGconn),
+		apr_time_now() - t_startTime
+	);
+	#undef d_PGconnHost
+	if (!t_PGconn) {
+		free(t_resource);
+		apr_atomic_inc64(&(d_stats->m_connectFailures));
+		return APR_EGENERAL;	/* Out of memory! */
+	}
+
+	/* Check that the connection was opened successfully */
+	if (PQstatus(t_PGconn) != CONNECTION_OK) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, NULL,
+			"PQconnectdb() error: %s", PQerrorMessage(t_PGconn)
+		);
+		PQfinish(t_PGconn);
+		free(t_resource);
+		apr_atomic_inc64(&(d_stats->m_connectFailures));
+		return APR_EGENERAL;
+	}
+
+	/* Attach the resource record to the connection */
+	if ((!PQregisterEventProc(t_PGconn, PGconn_eventProc, "mod_pgconn",
+					NULL))
+			|| (!PQsetInstanceData(t_PGconn, PGconn_eventProc,
+						t_resource))) {
+		PQfinish(t_PGconn);
+		free(t_resource);
+		apr_atomic_inc64(&(d_stats->m_connectFailures));
+		return APR_EGENERAL;
+	}
+
+	apr_atomic_inc64(&(d_stats->m_connects));
+	apr_atomic_inc32(&(d_stats->m_open));
+	recordHistogram(
+		&(d_stats->m_connectHistogram), apr_time_now() - t_startTime
+	);
+	#undef d_stats
+
+	/* Precreate the PGcancel object, so that the connection's running
+	   query can be cancelled from another thread without touching the
+	   PGconn* */
+	t_resource->m_PGcancel = PQgetCancel(t_PGconn);
+
+	t_resource->m_PGconn = t_PGconn;
+	t_resource->m_PGconnHost = (tPGconnHost*)v_PGconnHost;
+	(*(tPGconnResource**)v_resource) = t_resource;
+	return APR_SUCCESS;
+}
+
+
+#ifdef PGCONN_HAVE_FOPENCOOKIE
+/******************************************************************************
+ * pushTraceRing()                                                            *
+ *   Copies connection tracing output into a ring buffer, without taking any  *
+ * locks.  Output that doesn't fit in one slot is split across consecutive    *
+ * slots, so that it isn't interleaved with other connections' output.        *
+ *                                                                            *
+ * IN:	v_traceRing - the ring buffer.                                        *
+ * 	v_backendPID - the backend PID of the connection.                     *
+ * 	v_continued - 1 if the output continues a line started previously.    *
+ * 	v_data - the output.                                                  *
+ * 	v_length - the length of the output.                                  *
+ *                                                                            *
+ * Returns:	1 - if the output was copied.                                 *
+ * 		0 - if the ring buffer was full, so the output was dropped.   *
+ ******************************************************************************/
+static int pushTraceRing(
+	tPGconnTraceRing* v_traceRing,
+	int v_backendPID,
+	int v_continued,
+	const char* v_data,
+	apr_size_t v_length
+)
+{
+	tPGconnTraceSlot* t_slot;
+	apr_time_t t_time = apr_time_now();
+	apr_uint32_t t_position;
+	apr_uint32_t t_last;
+	apr_uint32_t t_numSlots;
+	apr_int32_t t_difference;
+	apr_uint32_t i;
+
+	t_numSlots = (v_length + PGCONN_TRACE_DATA - 1) / PGCONN_TRACE_DATA;
+	if (!t_numSlots)
+		return 1;
+	else if (t_numSlots > PGCONN_TRACE_SLOTS / 2) {
+		apr_atomic_inc32(&(v_traceRing->m_dropped));
+		return 0;
+	}
+
+	/* Claim the slots.  The writer frees slots in order, so if the last
+	   one is free then so are the others */
+	for (;;) {
+		t_position = apr_atomic_read32(&(v_traceRing->m_head));
+		t_last = t_position + t_numSlots - 1;
+		t_difference = (apr_int32_t)(apr_atomic_read32(
+			&(v_traceRing->m_slot[t_last
+					& (PGCONN_TRACE_SLOTS - 1)].m_sequence)
+		) - t_last);
+		if (t_difference < 0) {
+			apr_atomic_inc32(&(v_traceRing->m_dropped));
+			return 0;	/* Full */
+		}
+		else if ((t_difference == 0)
+				&& (apr_atomic_cas32(&(v_traceRing->m_head),
+							t_position + t_numSlots,
+							t_position)
+								== t_position))
+			break;
+		/* Otherwise another connection claimed them first */
+	}
+
+	/* Fill them, and hand each one to the writer */
+	for (i = 0; i < t_numSlots; i++) {
+		t_slot = &(v_traceRing->m_slot[(t_position + i)
+						& (PGCONN_TRACE_SLOTS - 1)]);
+		t_slot->m_backendPID = v_backendPID;
+		t_slot->m_time = t_time;
+		t_slot->m_continued = (i > 0) || v_continued;
+		t_slot->m_length = (v_length > PGCONN_TRACE_DATA)
+					? PGCONN_TRACE_DATA : v_length;
+		memcpy(t_slot->m_data, v_data, t_slot->m_length);
+		v_data += t_slot->m_length;
+		v_length -= t_slot->m_length;
+		apr_atomic_xchg32(&(t_slot->m_sequence), t_position + i + 1);
+	}
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * writeTraceRing()                                                           *
+ *   stdio write function for a connection's 'TraceMode Ring' trace stream    *
+ * (see fopencookie()), which PQtrace() writes to.                            *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ * 	v_data - the output.                                                  *
+ * 	v_length - the length of the output.                                  *
+ *                                                                            *
+ * Returns:	v_length, because dropped output is not an error.             *
+ ******************************************************************************/
+static ssize_t writeTraceRing(
+	void* v_resource,
+	const char* v_data,
+	size_t v_length
+)
+{
+	#define d_resource	((tPGconnResource*)v_resource)
+	if (v_length > 0) {
+		(void)pushTraceRing(
+			d_resource->m_PGconnHost->m_PGconnContainer
+								->m_traceRing,
+			PQbackendPID(d_resource->m_PGconn),
+			d_resource->m_traceMidLine, v_data, v_length
+		);
+		d_resource->m_traceMidLine = (v_data[v_length - 1] != '\n');
+	}
+	#undef d_resource
+
+	return v_length;
+}
+#endif
+
+
+/******************************************************************************
+ * openTraceFile()                                                            *
+ *   Opens the stream that a connection's tracing output will be written to:  *
+ * either a trace file of its own, or (for 'TraceMode Ring') a stream that    *
+ * copies into its <PGconn> container's ring buffer.  Either way, PQtrace()   *
+ * formats every message with stdio on the thread that sends or receives it;  *
+ * the ring buffer only saves that thread the file I/O.                       *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ * 	v_mode - the fopen() mode for a trace file.                           *
+ *                                                                            *
+ * Returns:	the stream, or...                                             *
+ * 		NULL, if it could not be opened.                              *
+ ******************************************************************************/
+static FILE* openTraceFile(
+	tPGconnResource* v_resource,
+	const char* v_mode
+)
+{
+	#define d_PGconnContainer	\
+		(v_resource->m_PGconnHost->m_PGconnContainer)
+	char t_fileName[APR_PATH_MAX];
+
+#ifdef PGCONN_HAVE_FOPENCOOKIE
+	if (d_PGconnContainer->m_traceRing) {
+		cookie_io_functions_t t_functions = {
+			NULL, writeTraceRing, NULL, NULL
+		};
+		FILE* t_traceFile = fopencookie(v_resource, "w", t_functions);
+		if (t_traceFile)
+			setvbuf(t_traceFile, NULL, _IOLBF, BUFSIZ);
+		return t_traceFile;
+	}
+#endif
+
+	apr_snprintf(
+		t_fileName, sizeof(t_fileName), "%s/%d_%d.trc",
+		d_PGconnContainer->m_traceDir, getpid(),
+		PQbackendPID(v_resource->m_PGconn)
+	);
+	return fopen(t_fileName, v_mode);
+	#undef d_PGconnContainer
+}
+
+
+/******************************************************************************
+ * tracePGconn()                                                              *
+ *   Starts tracing a connection.                                             *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ * 	v_traceFile - the stream to write the tracing output to.              *
+ ******************************************************************************/
+static void tracePGconn(
+	tPGconnResource* v_resource,
+	FILE* v_traceFile
+)
+{
+	PQtrace(v_resource->m_PGconn, v_traceFile);
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+	/* 'TraceFormat Binary' records are timestamped by pushTraceRing(), so
+	   there's no need for libpq to format a timestamp for every line */
+	if (v_resource->m_PGconnHost->m_PGconnContainer->m_traceFormat
+							== TRACEBINARY)
+		PQsetTraceFlags(
+			v_resource->m_PGconn, PQTRACE_SUPPRESS_TIMESTAMPS
+		);
+#endif
+}
+
+
+/******************************************************************************
+ * isTracedPerCheckout()                                                      *
+ *   Checks whether a <PGconn> container traces particular checkouts (because *
+ * 'TraceSample' or 'TraceEnv' is set), rather than every connection for its  *
+ * whole lifetime.                                                            *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	1 - if it does.                                               *
+ * 		0 - if it doesn't.                                            *
+ ******************************************************************************/
+static int isTracedPerCheckout(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return (v_PGconnContainer->m_traceSample > 0)
+		|| (v_PGconnContainer->m_traceEnv != NULL);
+}
+
+
+/******************************************************************************
+ * startCheckoutTrace()                                                       *
+ *   Starts tracing an acquired connection until it is released, if its       *
+ * <PGconn> container traces particular checkouts and this one is chosen:     *
+ * either because the request has the 'TraceEnv' environment variable set     *
+ * (e.g. by a RewriteRule, or by SetEnvIf from a trusted header), or because  *
+ * it falls in the 'TraceSample' percentage.  Sampling is deterministic, so   *
+ * that e.g. 'TraceSample 5' traces exactly 1 in every 20 checkouts.          *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_resource - resource record pointer.                                 *
+ * 	v_request - the request record (or NULL, if unknown).                 *
+ ******************************************************************************/
+static void startCheckoutTrace(
+	tPGconnContainer* v_PGconnContainer,
+	tPGconnResource* v_resource,
+	const request_rec* v_request
+)
+{
+	apr_uint64_t t_count;
+
+	if ((!v_PGconnContainer->m_traceDir)
+			|| (!isTracedPerCheckout(v_PGconnContainer)))
+		return;
+	else if ((!v_PGconnContainer->m_traceEnv) || (!v_request)
+			|| (!apr_table_get(
+				v_request->subprocess_env,
+				v_PGconnContainer->m_traceEnv
+			))) {
+		/* Not requested, so sample it */
+		if (v_PGconnContainer->m_traceSample <= 0)
+			return;
+		t_count = apr_atomic_inc32(
+			&(v_PGconnContainer->m_traceCount)
+		);
+		if (((t_count + 1) * v_PGconnContainer->m_traceSample / 100)
+				== (t_count * v_PGconnContainer->m_traceSample
+									/ 100))
+			return;
+	}
+
+	/* The stream stays open until the connection is closed, so that
+	   each checkout that is traced appends to it */
+	if ((!v_resource->m_traceFile) && (!(v_resource->m_traceFile
+				= openTraceFile(v_resource, "a"))))
+		return;
+	v_resource->m_traced = 1;
+	tracePGconn(v_resource, v_resource->m_traceFile);
+}
+
+
+/******************************************************************************
+ * stopCheckoutTrace()                                                        *
+ *   Stops tracing a connection that is being released, if it was traced by   *
+ * startCheckoutTrace().                                                      *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ ******************************************************************************/
+static void stopCheckoutTrace(
+	tPGconnResource* v_resource
+)
+{
+	if (v_resource->m_traced) {
+		PQuntrace(v_resource->m_PGconn);
+		fflush(v_resource->m_traceFile);
+		v_resource->m_traced = 0;
+	}
+}
+
+
+/******************************************************************************
+ * openPGconn_tracing()                                                       *
+ *   Opens a new PostgreSQL connection, outputting connection tracing         *
+ * information to a file.  This function should only be called as the PGconn* *
+ * resource list constructor.                                                 *
+ *                                                                            *
+ * IN:	v_PGconnHost - details of the host to connect to.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * OUT:	v_resource - resource record pointer.                                 *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the connection was opened successfully.      *
+ * 		APR_EGENERAL - if the connection could not be opened.         *
+ ******************************************************************************/
+static apr_status_t openPGconn_tracing(
+	void** v_resource,
+	void* v_PGconnHost,
+	apr_pool_t* v_pool
+)
+{
+	/* Open a PostgreSQL connection */
+	if (!v_pool)
+		return APR_EGENERAL;
+	apr_status_t t_status = openPGconn(v_resource, v_PGconnHost, v_pool);
+	if (t_status != APR_SUCCESS)
+		return t_status;
+
+	#define d_PGconnContainer	\
+		(((tPGconnHost*)v_PGconnHost)->m_PGconnContainer)
+	#define d_resource		(*(tPGconnResource**)v_resource)
+	/* Open a new trace file, or a stream that copies into the ring buffer
+	   (which closePGconn() closes) */
+	FILE* t_traceFile = openTraceFile(d_resource, "w");
+	if (t_traceFile && d_PGconnContainer->m_traceRing) {
+		d_resource->m_traceFile = t_traceFile;
+		tracePGconn(d_resource, t_traceFile);
+		return APR_SUCCESS;
+	}
+	else if (!t_traceFile) {
+		/* Failed to open trace file */
+		/* Close PostgreSQL connection, and count it as a failure to
+		   connect rather than a connection */
+		if (d_resource->m_PGcancel)
+			PQfreeCancel(d_resource->m_PGcancel);
+		PQfinish(d_resource->m_PGconn);
+		free(d_resource);
+		*v_resource = NULL;
+		#define d_stats	getPGconnCounters(d_PGconnContainer)
+		apr_atomic_dec32(&(d_stats->m_open));
+		apr_atomic_dec64(&(d_stats->m_connects));
+		apr_atomic_inc64(&(d_stats->m_connectFailures));
+		#undef d_stats
+		return APR_EGENERAL;
+	}
+
+	/* Register a cleanup handler to close the trace file when the memory
+	   pool is destroyed */
+	apr_pool_cleanup_register(
+		v_pool, t_traceFile, (void*)fclose, apr_pool_cleanup_null
+	);
+
+	/* Start tracing */
+	tracePGconn(d_resource, t_traceFile);
+
+	return APR_SUCCESS;
+
+	#undef d_resource
+	#undef d_PGconnContainer
+}
+
+
+/******************************************************************************
+ * closePGconn()                                                              *
+ *   Closes a PostgreSQL connection.  This function should only be called as  *
+ * the PGconn* resource list destructor.                                      *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ * 	v_PGconnHost - details of the host it is connected to.                *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the connection was closed successfully.      *
+ * 		APR_EGENERAL - if there was no connection to close.           *
+ ******************************************************************************/
+static apr_status_t closePGconn(
+	void* v_resource,
+	void* v_PGconnHost,
+	apr_pool_t* v_pool_unused
+)
+{
+	if ((!v_resource) || (!v_PGconnHost))
+		return APR_EGENERAL;
+	else {
+		/* Close the PostgreSQL connection */
+		#define d_resource	((tPGconnResource*)v_resource)
+		PGCONN_PROBE2(
+			evict, ((tPGconnHost*)v_PGconnHost)->m_PGconnContainer
+								->m_name,
+			PQbackendPID(d_resource->m_PGconn)
+		);
+		if (d_resource->m_PGcancel)
+			PQfreeCancel(d_resource->m_PGcancel);
+		if (d_resource->m_traceFile) {
+			PQuntrace(d_resource->m_PGconn);
+			fclose(d_resource->m_traceFile);
+		}
+		PQfinish(d_resource->m_PGconn);
+		free(d_resource);
+		#undef d_resource
+
+		/* The resource list only destroys connections that have
+		   expired, that are surplus to 'PoolMaxSoft', or when the
+		   resource list itself is destroyed (e.g. on shutdown, or
+		   once drained), which isn't counted as an eviction */
+		#define d_PGconnHost	((tPGconnHost*)v_PGconnHost)
+		#define d_stats	\
+			getPGconnCounters(d_PGconnHost->m_PGconnContainer)
+		apr_atomic_dec32(&(d_stats->m_open));
+		if (!d_PGconnHost->m_destroying)
+			apr_atomic_inc64(&(d_stats->m_evictions));
+		#undef d_stats
+		#undef d_PGconnHost
+		return APR_SUCCESS;
+	}
+}
+
+
+/******************************************************************************
+ * closePGconn_tracing()                                                      *
+ *   Disabled connection tracing and closes a PostgreSQL connection.  This    *
+ * function should only be called as the PGconn* resource list destructor.    *
+ *                                                                            *
+ * IN:	v_resource - resource record pointer.                                 *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the connection was closed successfully.      *
+ * 		APR_EGENERAL - if there was no connection to close.           *
+ ******************************************************************************/
+static apr_status_t closePGconn_tracing(
+	void* v_resource,
+	void* v_PGconnHost,
+	apr_pool_t* v_pool
+)
+{
+	if (!v_resource)
+		return APR_EGENERAL;
+	else {
+		/* Disable connection tracing and close the PostgreSQL
+		  connection */
+		PQuntrace(((tPGconnResource*)v_resource)->m_PGconn);
+		return closePGconn(v_resource, v_PGconnHost, v_pool);
+	}
+}
+
+
+/******************************************************************************
+ * getClientSocket()                                                          *
+ *   Gets the OS socket of the client connection that a request arrived on.   *
+ *                                                                            *
+ * IN:	v_request - the request record (or NULL, if unknown).                 *
+ *                                                                            *
+ * Returns:	the socket, or...                                             *
+ * 		-1, if there is no request or no client socket.               *
+ ******************************************************************************/
+static apr_os_sock_t getClientSocket(
+	const request_rec* v_request
+)
+{
+	apr_socket_t* t_socket;
+	apr_os_sock_t t_osSocket;
+
+	if ((!v_request)
+			|| (!(t_socket = ap_get_conn_socket(
+						v_request->connection)))
+			|| (apr_os_sock_get(&t_osSocket, t_socket)
+							!= APR_SUCCESS))
+		return -1;
+
+	return t_osSocket;
+}
+
+
+/******************************************************************************
+ * isClientGone()                                                             *
+ *   Checks, without consuming any data, whether the client's connection has  *
+ * been reset or hung up.  A half-close (the client shutting down its sending *
+ * side once it has sent its request, which is legal) doesn't count, because  *
+ * the client may still be waiting for the response; so a client that closes  *
+ * its connection normally is only noticed once a write to it has failed.     *
+ *   The socket belongs to the thread that is handling the request; polling   *
+ * and peeking at it here doesn't change its state.  A single HTTP/2 stream   *
+ * that the client resets is never detected, because the socket carries the   *
+ * whole connection.                                                          *
+ *                                                                            *
+ * IN:	v_osSocket - the client's OS socket.                                  *
+ *                                                                            *
+ * Returns:	1 - if the client has gone away.                              *
+ * 		0 - if the client is (as far as we can tell) still there.     *
+ ******************************************************************************/
+static int isClientGone(
+	apr_os_sock_t v_osSocket
+)
+{
+	struct pollfd t_pollFD;
+	char t_byte;
+
+	t_pollFD.fd = v_osSocket;
+	t_pollFD.events = POLLIN;
+	t_pollFD.revents = 0;
+	if (poll(&t_pollFD, 1, 0) <= 0)
+		return 0;
+	else if (t_pollFD.revents & (POLLHUP | POLLERR))
+		return 1;
+	/* Readable, but is it data (e.g. a pipelined request), EOF (which may
+	   only be a half-close) or a reset? */
+	else
+		return (recv(v_osSocket, &t_byte, 1,
+					MSG_PEEK | MSG_DONTWAIT) < 0)
+			&& (errno == ECONNRESET);
+}
+
+
+/******************************************************************************
+ * wantsHeldPGconnChecks()                                                    *
+ *   Checks whether the held-connection watchdog should check a <PGconn>      *
+ * container: for connections held for too long, for connections whose        *
+ * client has gone away, and for pinned connections whose idle window has     *
+ * expired.                                                                   *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	1 - if it should.                                             *
+ * 		0 - if it shouldn't.                                          *
+ ******************************************************************************/
+static int wantsHeldPGconnChecks(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return (v_PGconnContainer->m_holdWarn > 0)
+			|| (v_PGconnContainer->m_cancelOnAbort)
+			|| (v_PGconnContainer->m_keepAlivePin > 0);
+}
+
+
+/******************************************************************************
+ * markPGconnHeld()                                                           *
+ *   Records who is holding a PostgreSQL connection, for the benefit of the   *
+ * held-connection watchdog.  The held list is only kept (and its mutex only  *
+ * taken) if the watchdog checks the <PGconn> container.                      *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_resource - the resource record of the connection.                   *
+ * 	v_request - the request that is holding the connection (or NULL, if   *
+ * 			unknown).                                             *
+ ******************************************************************************/
+static void markPGconnHeld(
+	const tPGconnContainer* v_PGconnContainer,
+	tPGconnResource* v_resource,
+	const request_rec* v_request
+)
+{
+	#define d_PGconnContainer	((tPGconnContainer*)v_PGconnContainer)
+	int t_watched = wantsHeldPGconnChecks(v_PGconnContainer);
+	if (t_watched)
+		apr_thread_mutex_lock(d_PGconnContainer->m_heldMutex);
+
+	if (!v_resource->m_acquireTime)
+		apr_atomic_inc32(&(v_resource->m_PGconnHost->m_inFlight));
+	v_resource->m_acquireTime = apr_time_now();
+	v_resource->m_thread = apr_os_thread_current();
+	apr_cpystrn(
+		v_resource->m_uri,
+		(v_request && v_request->uri) ? v_request->uri : "",
+		sizeof(v_resource->m_uri)
+	);
+	v_resource->m_warned = 0;
+	v_resource->m_cancelled = 0;
+	v_resource->m_pin = NULL;
+	v_resource->m_firstResultPending = 1;
+	v_resource->m_wrote = 0;
+	v_resource->m_clientSocket = getClientSocket(v_request);
+
+	/* Add the resource to the start of the held list, unless it's there
+	   already (e.g. because it was pinned to a keep-alive connection) */
+	if (t_watched && (!v_resource->m_held)) {
+		v_resource->m_held = 1;
+		v_resource->m_prevHeld = NULL;
+		v_resource->m_nextHeld = d_PGconnContainer->m_first_held;
+		if (v_resource->m_nextHeld)
+			v_resource->m_nextHeld->m_prevHeld = v_resource;
+		d_PGconnContainer->m_first_held = v_resource;
+	}
+
+	if (t_watched)
+		apr_thread_mutex_unlock(d_PGconnContainer->m_heldMutex);
+	#undef d_PGconnContainer
+}
+
+
+/******************************************************************************
+ * markPGconnIdle()                                                           *
+ *   Records that a PostgreSQL connection is not being used by any request,   *
+ * even though it hasn't been released to the PGconn* resource list yet.      *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_resource - the resource record of the connection.                   *
+ * 	v_pin - the pin record that it is now pinned to.                      *
+ ******************************************************************************/
+static void markPGconnIdle(
+	const tPGconnContainer* v_PGconnContainer,
+	tPGconnResource* v_resource,
+	tPGconnPin* v_pin
+)
+{
+	int t_watched = wantsHeldPGconnChecks(v_PGconnContainer);
+	if (t_watched)
+		apr_thread_mutex_lock(v_PGconnContainer->m_heldMutex);
+	if (v_resource->m_acquireTime)
+		apr_atomic_dec32(&(v_resource->m_PGconnHost->m_inFlight));
+	v_resource->m_acquireTime = 0;
+	v_resource->m_firstResultPending = 0;
+	v_resource->m_pin = v_pin;
+	if (t_watched)
+		apr_thread_mutex_unlock(v_PGconnContainer->m_heldMutex);
+}
+
+
+/******************************************************************************
+ * markPGconnReleased()                                                       *
+ *   Removes a PostgreSQL connection from the held list, prior to releasing   *
+ * it to the PGconn* resource list.                                           *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_resource - the resource record of the connection.                   *
+ ******************************************************************************/
+static void markPGconnReleased(
+	const tPGconnContainer* v_PGconnContainer,
+	tPGconnResource* v_resource
+)
+{
+	#define d_PGconnContainer	((tPGconnContainer*)v_PGconnContainer)
+	int t_watched = wantsHeldPGconnChecks(v_PGconnContainer);
+	if (t_watched)
+		apr_thread_mutex_lock(d_PGconnContainer->m_heldMutex);
+
+	if (v_resource->m_held) {
+		if (v_resource->m_prevHeld)
+			v_resource->m_prevHeld->m_nextHeld
+						= v_resource->m_nextHeld;
+		else
+			d_PGconnContainer->m_first_held
+						= v_resource->m_nextHeld;
+		if (v_resource->m_nextHeld)
+			v_resource->m_nextHeld->m_prevHeld
+						= v_resource->m_prevHeld;
+		v_resource->m_held = 0;
+	}
+	v_resource->m_pin = NULL;
+	if (v_resource->m_acquireTime)
+		apr_atomic_dec32(&(v_resource->m_PGconnHost->m_inFlight));
+	v_resource->m_acquireTime = 0;
+	v_resource->m_firstResultPending = 0;
+
+	/* If the watchdog is cancelling the connection's query, hand it the
+	   PGcancel object to free, since the resource list may destroy the
+	   connection as soon as it's released.  acquireHostPGconn() creates
+	   another one */
+	if (v_resource->m_cancel) {
+		v_resource->m_cancel->m_resource = NULL;
+		v_resource->m_cancel = NULL;
+		v_resource->m_PGcancel = NULL;
+	}
+
+	if (t_watched)
+		apr_thread_mutex_unlock(d_PGconnContainer->m_heldMutex);
+	#undef d_PGconnContainer
+}
+
+
+/******************************************************************************
+ * setStatementTimeout()                                                      *
+ *   Makes a PostgreSQL connection's statement_timeout match a deadline, so   *
+ * that the backend stops working when nobody is waiting for the result any   *
+ * more.  This costs one round trip when there is a deadline.  A previously   *
+ * set statement_timeout is RESET when the connection is released, without    *
+ * waiting for the reply (see resetStatementTimeout()), so it only needs to   *
+ * be RESET here if that couldn't be done (e.g. for a pinned connection, or   *
+ * one that was released in a transaction).                                   *
+ *                                                                            *
+ * IN:	v_resource - the resource record of the connection.                   *
+ * 	v_deadline - the deadline (or 0, if there is none).                   *
+ *                                                                            *
+ * Returns:	1 - if the connection can be used.                            *
+ * 		0 - if the deadline has already passed.                       *
+ ******************************************************************************/
+static int setStatementTimeout(
+	tPGconnResource* v_resource,
+	apr_time_t v_deadline
+)
+{
+	char t_command[64];
+	PGresult* t_PGresult;
+	apr_int64_t t_timeout;
+
+	if (v_deadline) {
+		t_timeout = apr_time_as_msec(v_deadline - apr_time_now());
+		if (t_timeout <= 0)
+			return 0;
+		apr_snprintf(
+			t_command, sizeof(t_command),
+			"SET statement_timeout = %" APR_INT64_T_FMT, t_timeout
+		);
+	}
+	else if (v_resource->m_statementTimeoutSet)
+		apr_cpystrn(
+			t_command, "RESET statement_timeout", sizeof(t_command)
+		);
+	else
+		return 1;
+
+	/* Only believe the command if it worked.  A failure (e.g. because
+	   the connection was left in an aborted transaction) is logged, and
+	   the caller's own first query is left to report it.  A failed SET
+	   leaves the flag set, so that it is RESET (or retried) later */
+	t_PGresult = PQexec(v_resource->m_PGconn, t_command);
+	if (PQresultStatus(t_PGresult) == PGRES_COMMAND_OK)
+		v_resource->m_statementTimeoutSet = (v_deadline != 0);
+	else {
+		if (v_deadline)
+			v_resource->m_statementTimeoutSet = 1;
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, NULL,
+			"PGconn '%s': '%s' failed: %s",
+			v_resource->m_PGconnHost->m_PGconnContainer->m_name,
+			t_command, PQerrorMessage(v_resource->m_PGconn)
+		);
+	}
+	PQclear(t_PGresult);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * resetStatementTimeout()                                                    *
+ *   Sends a RESET of the statement_timeout that setStatementTimeout() set on *
+ * a PostgreSQL connection that is being released, without waiting for the    *
+ * reply.  The reply is read when the connection is next acquired (see        *
+ * readResetReply()), by which time it has normally arrived, so neither the   *
+ * release nor the next acquire waits for a round trip.                       *
+ *                                                                            *
+ * IN:	v_resource - the resource record of the connection.                   *
+ ******************************************************************************/
+static void resetStatementTimeout(
+	tPGconnResource* v_resource
+)
+{
+	/* A connection that is still in a transaction (or broken) is left
+	   for setStatementTimeout() to RESET when it's next acquired */
+	if ((!v_resource->m_statementTimeoutSet)
+			|| (PQtransactionStatus(v_resource->m_PGconn)
+							!= PQTRANS_IDLE)
+			|| (!PQsendQuery(v_resource->m_PGconn,
+					"RESET statement_timeout")))
+		return;
+
+	v_resource->m_statementTimeoutSet = 0;
+	v_resource->m_resetPending = 1;
+}
+
+
+/******************************************************************************
+ * readResetReply()                                                           *
+ *   Reads the reply to the RESET that resetStatementTimeout() sent, if there *
+ * is one, when a PostgreSQL connection is acquired.  If the RESET failed,    *
+ * setStatementTimeout() tries again.                                         *
+ *                                                                            *
+ * IN:	v_resource - the resource record of the connection.                   *
+ ******************************************************************************/
+static void readResetReply(
+	tPGconnResource* v_resource
+)
+{
+	PGresult* t_PGresult;
+
+	if (!v_resource->m_resetPending)
+		return;
+
+	v_resource->m_resetPending = 0;
+	while ((t_PGresult = PQgetResult(v_resource->m_PGconn))) {
+		if (PQresultStatus(t_PGresult) != PGRES_COMMAND_OK)
+			v_resource->m_statementTimeoutSet = 1;
+		PQclear(t_PGresult);
+	}
+}
+
+
+/******************************************************************************
+ * useHostPGconnPool()                                                        *
+ *   Registers the caller as a user of a host's PGconn* resource list, unless *
+ * the host has been replaced (e.g. by a reload).  The resource list of a     *
+ * replaced host is only destroyed once it has no users and no acquired       *
+ * connections (see drainPGconnHosts()), so the caller can use it until it    *
+ * calls apr_atomic_dec32(&(v_PGconnHost->m_users)).                          *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ *                                                                            *
+ * Returns:	1 - if the caller is now a user of the resource list.         *
+ * 		0 - if it isn't (and mustn't use the resource list).          *
+ ******************************************************************************/
+static int useHostPGconnPool(
+	tPGconnHost* v_PGconnHost
+)
+{
+	/* The drainer retires the host before it looks at m_users, so either
+	   it sees this user or this user sees that the host is retired */
+	apr_atomic_inc32(&(v_PGconnHost->m_users));
+	if ((!apr_atomic_read32(&(v_PGconnHost->m_retired)))
+			&& (v_PGconnHost->m_PGconnPool))
+		return 1;
+
+	apr_atomic_dec32(&(v_PGconnHost->m_users));
+	return 0;
+}
+
+
+/******************************************************************************
+ * hasReplayedLSN()                                                           *
+ *   Checks whether the replica that a PostgreSQL connection is connected to  *
+ * has replayed the WAL up to a read-your-writes LSN.  The replica monitor's  *
+ * last sample is used if it is recent enough; otherwise the replica is asked *
+ * over the connection (which costs one round trip), since the sample may be  *
+ * up to 'ReplicaCheckInterval' old.                                          *
+ *                                                                            *
+ * IN:	v_resource - the resource record of the connection.                   *
+ * 	v_minLSN - the LSN that the replica must have replayed (or 0).        *
+ *                                                                            *
+ * Returns:	1 - if it has.                                                *
+ * 		0 - if it hasn't (or the replica couldn't be asked).          *
+ ******************************************************************************/
+static int hasReplayedLSN(
+	tPGconnResource* v_resource,
+	apr_uint64_t v_minLSN
+)
+{
+	#define d_replayLSN	(v_resource->m_PGconnHost->m_replayLSN)
+	PGresult* t_PGresult;
+	apr_uint64_t t_LSN = 0;
+
+	if ((!v_minLSN) || (apr_atomic_read64(&d_replayLSN) >= v_minLSN))
+		return 1;
+
+	t_PGresult = PQexec(
+		v_resource->m_PGconn, "SELECT pg_last_wal_replay_lsn()"
+	);
+	if ((PQresultStatus(t_PGresult) == PGRES_TUPLES_OK)
+			&& (PQntuples(t_PGresult) == 1)
+			&& (!PQgetisnull(t_PGresult, 0, 0)))
+		t_LSN = readLSN(PQgetvalue(t_PGresult, 0, 0));
+	PQclear(t_PGresult);
+
+	/* Share the newer sample with other threads (racing the replica
+	   monitor, which is harmless) */
+	if (t_LSN > apr_atomic_read64(&d_replayLSN))
+		apr_atomic_set64(&d_replayLSN, t_LSN);
+	#undef d_replayLSN
+
+	return t_LSN >= v_minLSN;
+}
+
+
+/******************************************************************************
+ * acquireFromPGconnPool()                                                    *
+ *   Acquires a PostgreSQL connection from one host's PGconn* resource list,  *
+ * on behalf of a particular request.  The caller must be a user of the       *
+ * resource list (see useHostPGconnPool()).                                   *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host whose resource list should be used.           *
+ * 	v_request - the request record (or NULL, if unknown).                 *
+ * 	v_deadline - when the caller will stop waiting for results (or 0, if  *
+ * 			there is no deadline).                                *
+ * 	v_minLSN - for a replica, the LSN that it must have replayed (or 0).  *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for acquirePGconnEx().  PGCONN_UNAVAILABLE is also         *
+ * 		returned if the replica hasn't replayed v_minLSN.             *
+ ******************************************************************************/
+static ePGconnStatus acquireFromPGconnPool(
+	tPGconnHost* v_PGconnHost,
+	const request_rec* v_request,
+	apr_time_t v_deadline,
+	apr_uint64_t v_minLSN,
+	PGconn** v_PGconn
+)
+{
+	tPGconnResource* t_resource;
+	tPGconnCounters* t_stats = getPGconnCounters(
+		v_PGconnHost->m_PGconnContainer
+	);
+	apr_interval_time_t t_waitTime;
+
+	/* Acquire a connection from the PGconn* resource list, recording how
+	   long we had to wait for it */
+	apr_atomic_inc32(&(t_stats->m_waiting));
+	t_waitTime = apr_time_now();
+	apr_status_t t_status = apr_reslist_acquire(
+		v_PGconnHost->m_PGconnPool, (void**)&t_resource
+	);
+	t_waitTime = apr_time_now() - t_waitTime;
+	PGCONN_PROBE3(
+		acquire__wait, v_PGconnHost->m_PGconnContainer->m_name,
+		v_PGconnHost->m_hostName, t_waitTime
+	);
+	apr_atomic_add64(&(t_stats->m_waitTime), t_waitTime);
+	recordHistogram(&(t_stats->m_waitHistogram), t_waitTime);
+	apr_atomic_dec32(&(t_stats->m_waiting));
+	if (t_status != APR_SUCCESS) {
+		/* Only replicas' resource lists have a timeout (see
+		   createHostPGconnPools()) */
+		if (APR_STATUS_IS_TIMEUP(t_status)
+				|| APR_STATUS_IS_EAGAIN(t_status))
+			apr_atomic_inc64(&(t_stats->m_timeouts));
+		return PGCONN_UNAVAILABLE;
+	}
+
+	/* Check the connection status */
+	if (PQstatus(t_resource->m_PGconn) != CONNECTION_OK) {
+		/* Problem with connection. Try resetting it */
+		apr_atomic_inc64(&(t_stats->m_resets));
+		PQreset(t_resource->m_PGconn);
+		PGCONN_PROBE2(
+			reset, v_PGconnHost->m_PGconnContainer->m_name,
+			PQstatus(t_resource->m_PGconn)
+		);
+		/* Check the connection status again */
+		if (PQstatus(t_resource->m_PGconn) != CONNECTION_OK) {
+			/* Connection still doesn't work, so release the
+			   resource straight away */
+			apr_reslist_release(
+				v_PGconnHost->m_PGconnPool, t_resource
+			);
+			return PGCONN_BAD;
+		}
+	}
+
+	/* Recreate the PGcancel object, if the watchdog took it over */
+	if (!t_resource->m_PGcancel)
+		t_resource->m_PGcancel = PQgetCancel(t_resource->m_PGconn);
+
+	readResetReply(t_resource);
+
+	/* A replica must have replayed the caller's last write */
+	if (!hasReplayedLSN(t_resource, v_minLSN)) {
+		apr_reslist_release(v_PGconnHost->m_PGconnPool, t_resource);
+		return PGCONN_UNAVAILABLE;
+	}
+
+	/* Apply the deadline, if there is one */
+	if (!setStatementTimeout(t_resource, v_deadline)) {
+		apr_reslist_release(v_PGconnHost->m_PGconnPool, t_resource);
+		apr_atomic_inc64(&(t_stats->m_deadlineMisses));
+		return PGCONN_TIMEDOUT;
+	}
+
+	/* Connection acquired successfully */
+	apr_atomic_inc64(&(t_stats->m_acquires));
+	apr_atomic_inc32(&(t_stats->m_inUse));
+	t_resource->m_heldSince = apr_time_now();
+	t_resource->m_waitTime = t_waitTime;
+	markPGconnHeld(
+		v_PGconnHost->m_PGconnContainer, t_resource, v_request
+	);
+	startCheckoutTrace(
+		v_PGconnHost->m_PGconnContainer, t_resource, v_request
+	);
+	*v_PGconn = t_resource->m_PGconn;
+	return PGCONN_ACQUIRED;
+}
+
+
+/******************************************************************************
+ * acquireHostPGconn()                                                        *
+ *   Acquires a PostgreSQL connection from one host's PGconn* resource list,  *
+ * on behalf of a particular request (see acquireFromPGconnPool()), as a user *
+ * of the resource list (see useHostPGconnPool()).                            *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host whose resource list should be used.           *
+ * 	v_request - the request record (or NULL, if unknown).                 *
+ * 	v_deadline - when the caller will stop waiting for results (or 0, if  *
+ * 			there is no deadline).                                *
+ * 	v_minLSN - as for acquireFromPGconnPool().                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for acquireFromPGconnPool().  PGCONN_UNAVAILABLE is also   *
+ * 		returned if the host has been replaced.                       *
+ ******************************************************************************/
+static ePGconnStatus acquireHostPGconn(
+	tPGconnHost* v_PGconnHost,
+	const request_rec* v_request,
+	apr_time_t v_deadline,
+	apr_uint64_t v_minLSN,
+	PGconn** v_PGconn
+)
+{
+	ePGconnStatus t_PGconnStatus;
+
+	/* Check that the PGconn* resource list was created successfully, and
+	   that it won't be destroyed while we're using it */
+	if (!useHostPGconnPool(v_PGconnHost))
+		return PGCONN_UNAVAILABLE;
+
+	t_PGconnStatus = acquireFromPGconnPool(
+		v_PGconnHost, v_request, v_deadline, v_minLSN, v_PGconn
+	);
+	apr_atomic_dec32(&(v_PGconnHost->m_users));
+
+	return t_PGconnStatus;
+}
+
+
+/******************************************************************************
+ * isReplicaUsable()                                                          *
+ *   Checks whether a replica can serve read-only acquires: it must have a    *
+ * PGconn* resource list, and the replica monitor must not have taken it out  *
+ * of rotation (e.g. for lagging more than 'MaxReplicaLag' behind), and it    *
+ * must have replayed the WAL up to the caller's read-your-writes LSN.        *
+ *                                                                            *
+ * IN:	v_PGconnHost - the replica's host record.                             *
+ * 	v_minLSN - the LSN that the replica must have replayed (or 0).        *
+ *                                                                            *
+ * Returns:	1 - if it is usable.                                          *
+ * 		0 - if it isn't.                                              *
+ ******************************************************************************/
+static int isReplicaUsable(
+	tPGconnHost* v_PGconnHost,
+	apr_uint64_t v_minLSN
+)
+{
+	return (v_PGconnHost->m_PGconnPool)
+		&& (!apr_atomic_read32(&(v_PGconnHost->m_outOfRotation)))
+		&& ((!v_minLSN) || (apr_atomic_read64(
+					&(v_PGconnHost->m_replayLSN))
+							>= v_minLSN));
+}
+
+
+/******************************************************************************
+ * getReplicaLoad()                                                           *
+ *   Estimates how long a new checkout from a replica would take to get its   *
+ * first result: the replica's latency EWMA, scaled by the number of its      *
+ * connections already in use.                                                *
+ *                                                                            *
+ * IN:	v_PGconnHost - the replica's host record.                             *
+ * 	v_minLSN - as for isReplicaUsable().                                  *
+ *                                                                            *
+ * Returns:	the load estimate (lower is better), or...                    *
+ * 		~0, if the replica is not usable.                             *
+ ******************************************************************************/
+static apr_uint64_t getReplicaLoad(
+	tPGconnHost* v_PGconnHost,
+	apr_uint64_t v_minLSN
+)
+{
+	apr_uint32_t t_latency;
+
+	if (!isReplicaUsable(v_PGconnHost, v_minLSN))
+		return ~(apr_uint64_t)0;
+
+	/* A replica with no samples yet is treated as being very fast, so
+	   that it gets some traffic */
+	t_latency = apr_atomic_read32(&(v_PGconnHost->m_latency));
+	return (apr_uint64_t)(t_latency ? t_latency : 1)
+		* (apr_atomic_read32(&(v_PGconnHost->m_inFlight)) + 1);
+}
+
+
+/******************************************************************************
+ * selectReplica()                                                            *
+ *   Chooses which of a <PGconn> container's replicas should serve the next   *
+ * read-only acquire, according to its 'ReplicaBalance' policy:               *
+ *   PowerOfTwo - the less loaded of two randomly chosen replicas.            *
+ *   LeastOutstanding - the least loaded replica.                             *
+ *   RoundRobin - each replica in turn.                                       *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_minLSN - the LSN that the replica must have replayed (or 0).        *
+ *                                                                            *
+ * Returns:	pointer to the replica's host record, or...                   *
+ * 		NULL, if the container has no usable replicas.                *
+ ******************************************************************************/
+static tPGconnHost* selectReplica(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_uint64_t v_minLSN
+)
+{
+	#define d_replica(i)	\
+		APR_ARRAY_IDX(v_PGconnContainer->m_replicas, (i), tPGconnHost*)
+	int t_count = v_PGconnContainer->m_replicas->nelts;
+	tPGconnHost* t_best = NULL;
+	apr_uint64_t t_bestLoad = ~(apr_uint64_t)0;
+	apr_uint64_t t_load;
+	apr_uint32_t t_random;
+	int i, j;
+
+	if (t_count == 0)
+		return NULL;
+
+	/* Get the next cursor value.  For PowerOfTwo, scramble it (with a
+	   32-bit integer hash) so that it can be used as a random number */
+	t_random = apr_atomic_inc32(
+		&(((tPGconnContainer*)v_PGconnContainer)->m_replicaCursor)
+	);
+	if (v_PGconnContainer->m_replicaBalance == POWEROFTWO) {
+		t_random = ((t_random >> 16) ^ t_random) * 0x45D9F3B;
+		t_random = ((t_random >> 16) ^ t_random) * 0x45D9F3B;
+		t_random = (t_random >> 16) ^ t_random;
+	}
+
+	if ((v_PGconnContainer->m_replicaBalance == POWEROFTWO)
+			&& (t_count >= 2)) {
+		/* Pick two different replicas */
+		i = t_random % t_count;
+		j = (i + 1 + ((t_random >> 8) % (t_count - 1))) % t_count;
+		if (getReplicaLoad(d_replica(j), v_minLSN)
+				< getReplicaLoad(d_replica(i), v_minLSN))
+			i = j;
+		if (isReplicaUsable(d_replica(i), v_minLSN))
+			return d_replica(i);
+		/* Neither is usable, so consider them all */
+	}
+	else if (v_PGconnContainer->m_replicaBalance == ROUNDROBIN) {
+		/* Skip any replica that isn't usable */
+		for (i = 0; i < t_count; i++)
+			if (isReplicaUsable(d_replica((t_random + i)
+								% t_count),
+						v_minLSN))
+				return d_replica((t_random + i) % t_count);
+		return NULL;
+	}
+
+	for (i = 0; i < t_count; i++) {
+		t_load = getReplicaLoad(d_replica(i), v_minLSN);
+		if (t_load < t_bestLoad) {
+			t_best = d_replica(i);
+			t_bestLoad = t_load;
+		}
+	}
+
+	return t_best;
+	#undef d_replica
+}
+
+
+/******************************************************************************
+ * destroyHostPGconnPool()                                                    *
+ *   Destroys the PGconn* resource list of one of a <PGconn> container's      *
+ * hosts (closing its connections), if it hasn't been destroyed already.      *
+ *                                                                            *
+ * IN:	v_PGconnHost - details of the host.                                   *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t destroyHostPGconnPool(
+	void* v_PGconnHost
+)
+{
+	#define d_PGconnHost	((tPGconnHost*)v_PGconnHost)
+	apr_pool_t* t_pool = d_PGconnHost->m_pool;
+
+	/* The child pool's cleanup may call this again for a host that
+	   drainPGconnHosts() has already destroyed, so only do it once */
+	if (t_pool) {
+		d_PGconnHost->m_pool = NULL;
+		d_PGconnHost->m_destroying = 1;
+		apr_pool_destroy(t_pool);
+	}
+	#undef d_PGconnHost
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * createHostPGconnPool()                                                     *
+ *   Creates the PGconn* resource list for one of a <PGconn> container's      *
+ * hosts in this process.  The resource list is allocated from the host's own *
+ * pool, so that a host that is replaced by a reload can be destroyed from    *
+ * the reloader thread without touching the child's pool.  Unless the host's  *
+ * pool has already been created, it is created as a child of the global      *
+ * pool, which is thread-safe.                                                *
+ *                                                                            *
+ * IN:	v_PGconnHost - details of the host.                                   *
+ * 	v_pool - the child's pool, which destroys the resource list when the  *
+ * 			server shuts down (or NULL, if the caller will).      *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the PGconn* resource list was created.       *
+ * 		otherwise - if it could not be created.                       *
+ ******************************************************************************/
+static apr_status_t createHostPGconnPool(
+	tPGconnHost* v_PGconnHost,
+	apr_pool_t* v_pool
+)
+{
+	#define d_PGconnContainer	(v_PGconnHost->m_PGconnContainer)
+	apr_status_t t_status = APR_SUCCESS;
+
+	v_PGconnHost->m_destroying = 0;
+	if (!v_PGconnHost->m_pool)
+		t_status = apr_pool_create(&(v_PGconnHost->m_pool), NULL);
+
+	/* Create the pool that the replica monitor uses for scratch memory */
+	if (t_status == APR_SUCCESS)
+		t_status = apr_pool_create(
+			&(v_PGconnHost->m_monitorPool), v_PGconnHost->m_pool
+		);
+
+	if (t_status == APR_SUCCESS)
+		t_status = apr_reslist_create(
+			&(v_PGconnHost->m_PGconnPool),
+			v_PGconnHost->m_poolMin,
+			v_PGconnHost->m_poolMaxSoft,
+			v_PGconnHost->m_poolMaxHard,
+			v_PGconnHost->m_poolTTL,
+			(d_PGconnContainer->m_traceDir
+				&& !isTracedPerCheckout(d_PGconnContainer))
+					? openPGconn_tracing : openPGconn,
+			(d_PGconnContainer->m_traceDir
+				&& !isTracedPerCheckout(d_PGconnContainer))
+					? closePGconn_tracing : closePGconn,
+			v_PGconnHost, v_PGconnHost->m_pool
+		);
+	#undef d_PGconnContainer
+	/* Destroying the host's pool also destroys anything that was created
+	   before the failure, so that a retry (e.g. with 'PoolCreate lazy')
+	   starts afresh */
+	if (t_status != APR_SUCCESS) {
+		v_PGconnHost->m_PGconnPool = NULL;
+		destroyHostPGconnPool(v_PGconnHost);
+		return t_status;
+	}
+
+	/* Register a cleanup function to destroy the PGconn* resource list
+	   when its pool is destroyed */
+	apr_pool_cleanup_register(
+		v_PGconnHost->m_pool, v_PGconnHost->m_PGconnPool,
+		(void*)apr_reslist_destroy, apr_pool_cleanup_null
+	);
+
+	/* Register a cleanup function to destroy the host's pool when the
+	   server shuts down */
+	if (v_pool)
+		apr_pool_cleanup_register(
+			v_pool, v_PGconnHost, destroyHostPGconnPool,
+			apr_pool_cleanup_null
+		);
+
+	return APR_SUCCESS;
+}
+
+
+/* How long a read-only acquire waits for a connection from a replica whose
+   resource list is exhausted, before falling back to the primary */
+#define PGCONN_REPLICA_WAIT	apr_time_from_msec(10)
+
+
+/******************************************************************************
+ * createHostPGconnPools()                                                    *
+ *   Creates the PGconn* resource lists for a <PGconn> container in this      *
+ * process: one for the primary, one for each replica, and one for the        *
+ * standby (if there is one).  The container's m_PGconnPool is set last, so   *
+ * that a non-NULL m_PGconnPool means that all of them have been created.     *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - the child's pool, which destroys the resource lists when the *
+ * 			server shuts down (or NULL, if cleanups have already  *
+ * 			been registered).                                     *
+ * 	v_server - the server record to log against.                          *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if the primary's PGconn* resource list was      *
+ * 				created.                                      *
+ * 		otherwise - if it could not be created.                       *
+ ******************************************************************************/
+static apr_status_t createHostPGconnPools(
+	tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool,
+	server_rec* v_server
+)
+{
+	tPGconnHost* t_PGconnHost;
+	apr_status_t t_status;
+	int i;
+
+	/* Create the primary's PGconn* resource list */
+	t_status = createHostPGconnPool(v_PGconnContainer->m_primary, v_pool);
+	if (t_status != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"Failed to create PGconn* resource list!"
+		);
+		return t_status;
+	}
+
+	/* Create each replica's PGconn* resource list.  A replica whose
+	   resource list can't be created is skipped by selectReplica(), and
+	   read-only traffic goes to the primary instead.  Acquires from a
+	   saturated replica give up after PGCONN_REPLICA_WAIT, and go to the
+	   primary too */
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++) {
+		t_PGconnHost = APR_ARRAY_IDX(
+			v_PGconnContainer->m_replicas, i, tPGconnHost*
+		);
+		if (createHostPGconnPool(t_PGconnHost, v_pool) != APR_SUCCESS)
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, v_server,
+				"Failed to create replica PGconn* resource"
+				" list!"
+			);
+		else
+			apr_reslist_timeout_set(
+				t_PGconnHost->m_PGconnPool, PGCONN_REPLICA_WAIT
+			);
+	}
+
+	/* Create the standby's PGconn* resource list, if there is one */
+	if ((v_PGconnContainer->m_standby)
+			&& (createHostPGconnPool(v_PGconnContainer->m_standby,
+							v_pool) != APR_SUCCESS))
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"Failed to create standby PGconn* resource list!"
+		);
+
+	apr_atomic_xchgptr(
+		(volatile void**)&(v_PGconnContainer->m_PGconnPool),
+		v_PGconnContainer->m_primary->m_PGconnPool
+	);
+	return APR_SUCCESS;
+}
+
+
+/* How long, after 'PoolCreate lazy' has failed to create a <PGconn>
+   container's PGconn* resource lists, before trying again */
+#define PGCONN_CREATE_RETRY	apr_time_from_sec(1)
+
+/******************************************************************************
+ * ensurePGconnPool()                                                         *
+ *   Makes sure that a <PGconn> container's PGconn* resource lists have been  *
+ * created in this process.  With 'PoolCreate lazy', this creates them the    *
+ * first time that a connection is acquired.  If that fails (e.g. because the *
+ * database is down), acquires fail straight away until PGCONN_CREATE_RETRY   *
+ * has passed, and then only one thread tries again while the others carry on *
+ * failing, rather than every acquire queueing for its own attempt.           *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_request - the request record (or NULL, if unknown).                 *
+ *                                                                            *
+ * Returns:	1 - if the resource lists have been created.                  *
+ * 		0 - if they haven't (and couldn't be).                        *
+ ******************************************************************************/
+static int ensurePGconnPool(
+	const tPGconnContainer* v_PGconnContainer,
+	const request_rec* v_request
+)
+{
+	#define d_PGconnContainer	((tPGconnContainer*)v_PGconnContainer)
+	if (v_PGconnContainer->m_PGconnPool)
+		return 1;
+	else if ((!v_PGconnContainer->m_poolCreateLazy)
+			|| (!v_PGconnContainer->m_createMutex))
+		return 0;
+	else if (!v_PGconnContainer->m_createRetry)
+		apr_thread_mutex_lock(v_PGconnContainer->m_createMutex);
+	else if ((apr_time_now() < v_PGconnContainer->m_createRetry)
+			|| (apr_thread_mutex_trylock(
+					v_PGconnContainer->m_createMutex)
+							!= APR_SUCCESS))
+		return 0;
+
+	/* Check again once the mutex is held, in case another thread has just
+	   created them (or just failed to) */
+	if ((!v_PGconnContainer->m_PGconnPool)
+			&& (apr_time_now() >= v_PGconnContainer->m_createRetry)
+			&& (createHostPGconnPools(
+					d_PGconnContainer, NULL,
+					v_request ? v_request->server : NULL
+				) != APR_SUCCESS))
+		d_PGconnContainer->m_createRetry
+				= apr_time_now() + PGCONN_CREATE_RETRY;
+	apr_thread_mutex_unlock(v_PGconnContainer->m_createMutex);
+	#undef d_PGconnContainer
+
+	return v_PGconnContainer->m_PGconnPool != NULL;
+}
+
+
+/******************************************************************************
+ * acquirePGconn_request()                                                    *
+ *   Acquires a PostgreSQL connection on behalf of a particular request.      *
+ * Read-only acquires are routed to a replica, if the <PGconn> container has  *
+ * any; the primary is used if it has none, if the chosen one hasn't replayed *
+ * the WAL up to v_minLSN, or if it has no connection available within        *
+ * PGCONN_REPLICA_WAIT (because its resource list is exhausted).              *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_access - whether the connection will be used for writing.           *
+ * 	v_request - the request record (or NULL, if unknown).                 *
+ * 	v_deadline - when the caller will stop waiting for results (or 0, if  *
+ * 			there is no deadline).                                *
+ * 	v_minLSN - the LSN of the caller's last write (or 0, if unknown).     *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for acquirePGconnEx().                                     *
+ ******************************************************************************/
+static ePGconnStatus acquirePGconn_request(
+	const tPGconnContainer* v_PGconnContainer,
+	ePGconnAccess v_access,
+	const request_rec* v_request,
+	apr_time_t v_deadline,
+	apr_uint64_t v_minLSN,
+	PGconn** v_PGconn
+)
+{
+	tPGconnHost* t_PGconnHost;
+	ePGconnStatus t_PGconnStatus;
+
+	if ((!v_PGconnContainer) || (!v_PGconn))
+		return PGCONN_BAD;
+	/* Don't allow acquirePGconn() to be called twice without a call to
+	   releasePGconn() inbetween */
+	else if (*v_PGconn)
+		return PGCONN_ALREADYACQUIRED;
+	v_PGconnContainer = getSharedPGconnContainer(v_PGconnContainer);
+	PGCONN_PROBE2(acquire__entry, v_PGconnContainer->m_name, v_access);
+	t_PGconnStatus = PGCONN_UNAVAILABLE;
+	if (ensurePGconnPool(v_PGconnContainer, v_request)) {
+		/* Try a replica first, for read-only access.  If the replica
+		   monitor hasn't seen any of them replay the caller's last
+		   write yet, ask one of them (see hasReplayedLSN()) */
+		if (v_access == PGCONN_READONLY) {
+			t_PGconnHost = selectReplica(
+				v_PGconnContainer, v_minLSN
+			);
+			if ((!t_PGconnHost) && v_minLSN)
+				t_PGconnHost = selectReplica(
+					v_PGconnContainer, 0
+				);
+			if (t_PGconnHost)
+				t_PGconnStatus = acquireHostPGconn(
+					t_PGconnHost, v_request, v_deadline,
+					v_minLSN, v_PGconn
+				);
+		}
+		/* Otherwise, use the primary (trying again if it is replaced
+		   while we are trying it) */
+		if ((t_PGconnStatus != PGCONN_ACQUIRED)
+				&& (t_PGconnStatus != PGCONN_TIMEDOUT))
+			do {
+				t_PGconnHost = v_PGconnContainer->m_primary;
+				t_PGconnStatus = acquireHostPGconn(
+					t_PGconnHost, v_request, v_deadline, 0,
+					v_PGconn
+				);
+			} while ((t_PGconnStatus == PGCONN_UNAVAILABLE)
+				&& (t_PGconnHost
+					!= v_PGconnContainer->m_primary));
+	}
+
+	PGCONN_PROBE2(
+		acquire__return, v_PGconnContainer->m_name, t_PGconnStatus
+	);
+	return t_PGconnStatus;
+}
+
+
+/******************************************************************************
+ * acquirePGconn()                                                            *
+ *   Acquires a PostgreSQL connection from the PGconn* resource list.         *
+ * The resource list takes care of closing/reusing/timing-out connections as  *
+ * required.                                                                  *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	PGCONN_ACQUIRED - if everything was OK.                       *
+ * 		PGCONN_ALREADYACQUIRED - if a connection was already          *
+ * 					acquired.                             *
+ * 		PGCONN_UNAVAILABLE - if all the connections in the pool are   *
+ * 					already in use.                       *
+ * 		PGCONN_BAD - if the connection could not be opened/reset.     *
+ ******************************************************************************/
+static ePGconnStatus acquirePGconn(
+	const tPGconnContainer* v_PGconnContainer,
+	PGconn** v_PGconn
+)
+{
+	return acquirePGconn_request(
+		v_PGconnContainer, PGCONN_READWRITE, NULL, 0, 0, v_PGconn
+	);
+}
+
+
+/******************************************************************************
+ * acquirePGconnWithDeadline()                                                *
+ *   Acquires a PostgreSQL connection from the PGconn* resource list, and     *
+ * sets its statement_timeout so that no query runs beyond a deadline.        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_deadline - when the caller will stop waiting for results.           *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for acquirePGconn(), or...                                 *
+ * 		PGCONN_TIMEDOUT - if the deadline has already passed.         *
+ ******************************************************************************/
+static ePGconnStatus acquirePGconnWithDeadline(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_time_t v_deadline,
+	PGconn** v_PGconn
+)
+{
+	return acquirePGconn_request(
+		v_PGconnContainer, PGCONN_READWRITE, NULL, v_deadline, 0,
+		v_PGconn
+	);
+}
+
+
+/******************************************************************************
+ * acquirePGconnEx()                                                          *
+ *   Acquires a PostgreSQL connection, either for read-write access (from the *
+ * primary's PGconn* resource list) or for read-only access (from a replica's *
+ * PGconn* resource list, if the <PGconn> container has any replicas).        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_access - PGCONN_READWRITE or PGCONN_READONLY.                       *
+ * 	v_deadline - when the caller will stop waiting for results (or 0, if  *
+ * 			there is no deadline).                                *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for acquirePGconnWithDeadline().                           *
+ ******************************************************************************/
+static ePGconnStatus acquirePGconnEx(
+	const tPGconnContainer* v_PGconnContainer,
+	ePGconnAccess v_access,
+	apr_time_t v_deadline,
+	PGconn** v_PGconn
+)
+{
+	return acquirePGconn_request(
+		v_PGconnContainer, v_access, NULL, v_deadline, 0, v_PGconn
+	);
+}
+
+
+/******************************************************************************
+ * releasePGconn()                                                            *
+ *   Releases a PostgreSQL connection back to the PGconn* resource list.      *
+ * The resource list takes care of closing/reusing/timing-out connections as  *
+ * required.                                                                  *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_PGconn - connection record pointer (should be non-NULL).            *
+ *                                                                            *
+ * OUT:	v_PGconn - NULL (if the connection has been released successfully).   *
+ *                                                                            *
+ * Returns:	PGCONN_RELEASED - if everything was OK.                       *
+ * 		PGCONN_BAD - if there was no acquired connection to release.  *
+ ******************************************************************************/
+static ePGconnStatus releasePGconn(
+	const tPGconnContainer* v_PGconnContainer,
+	PGconn** v_PGconn
+)
+{
+	tPGconnResource* t_resource;
+
+	/* If there is a currently acquired connection, release the resource
+	   back to the resource list of the host it came from */
+	if ((!v_PGconnContainer) || (!v_PGconn))
+		return PGCONN_BAD;
+	else if ((*v_PGconn) && (t_resource = getPGconnResource(*v_PGconn))) {
+		/* The resource list may destroy the resource once it has been
+		   released, so note where it came from first */
+		tPGconnHost* t_PGconnHost = t_resource->m_PGconnHost;
+		tPGconnContainer* t_PGconnContainer
+				= t_PGconnHost->m_PGconnContainer;
+		apr_status_t t_status;
+		apr_interval_time_t t_holdTime
+				= apr_time_now() - t_resource->m_heldSince;
+		markPGconnReleased(t_PGconnContainer, t_resource);
+		stopCheckoutTrace(t_resource);
+		resetStatementTimeout(t_resource);
+		recordHistogram(
+			&(getPGconnCounters(t_PGconnContainer)
+						->m_holdHistogram),
+			t_holdTime
+		);
+		PGCONN_PROBE2(release, t_PGconnContainer->m_name, t_holdTime);
+		/* Our connection stops the resource list being destroyed until
+		   it's released, and being a user stops it after that */
+		apr_atomic_inc32(&(t_PGconnHost->m_users));
+		t_status = apr_reslist_release(
+			t_PGconnHost->m_PGconnPool, t_resource
+		);
+		apr_atomic_dec32(&(t_PGconnHost->m_users));
+		if (t_status == APR_SUCCESS) {
+			apr_atomic_dec32(
+				&(getPGconnCounters(t_PGconnContainer)
+								->m_inUse)
+			);
+			*v_PGconn = NULL;
+			return PGCONN_RELEASED;
+		}
+	}
+
+	return PGCONN_BAD;	/* No acquired connection to release! */
+}
+
+
+/******************************************************************************
+ * measurePGconnAvailability()                                                *
+ *   Check how many PGconn resources aren't currently in use.                 *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	0..100 - % of the total PGconn resources not currently in use.*
+ ******************************************************************************/
+static int measurePGconnAvailability(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	tPGconnHost* t_PGconnHost;
+	int t_available;
+
+	if (!v_PGconnContainer)
+		return 0;
+
+	/* The primary's pool size may have been changed by a reload */
+	t_PGconnHost = getSharedPGconnContainer(v_PGconnContainer)->m_primary;
+	if (!useHostPGconnPool(t_PGconnHost))
+		return 0;
+	t_available = ((t_PGconnHost->m_poolMaxHard
+			- apr_reslist_acquired_count(
+				t_PGconnHost->m_PGconnPool
+			)
+		) * 100) / t_PGconnHost->m_poolMaxHard;
+	apr_atomic_dec32(&(t_PGconnHost->m_users));
+
+	return t_available;
+}
+
+
+/******************************************************************************
+ * addPGconnCounters()                                                        *
+ *   Adds a <PGconn> container's striped pool statistics counters (see        *
+ * PGCONN_STATS_STRIPES) to a statistics snapshot.  Each counter is read      *
+ * atomically, but the set as a whole is not, so the counts may be very       *
+ * slightly inconsistent with each other.                                     *
+ *                                                                            *
+ * IN:	v_counters - the counters (g_statsStripes of them).                   *
+ * 	v_stats - the snapshot.                                               *
+ *                                                                            *
+ * OUT:	v_stats - the updated snapshot.                                       *
+ ******************************************************************************/
+static void addPGconnCounters(
+	tPGconnCounters* v_counters,
+	tPGconnStats* v_stats
+)
+{
+	apr_uint32_t t_open = 0;
+	apr_uint32_t t_inUse = 0;
+	apr_uint32_t t_waiting = 0;
+	int i;
+
+	/* A connection may be counted in by one thread and out by another,
+	   so only the sums of the current counts are meaningful (and they
+	   are, despite each stripe's count wrapping around) */
+	for (i = 0; i < g_statsStripes; i++) {
+		#define d_counters	(&(v_counters[i]))
+		t_open += apr_atomic_read32(&(d_counters->m_open));
+		t_inUse += apr_atomic_read32(&(d_counters->m_inUse));
+		t_waiting += apr_atomic_read32(&(d_counters->m_waiting));
+		v_stats->m_acquires += apr_atomic_read64(
+			&(d_counters->m_acquires)
+		);
+		v_stats->m_timeouts += apr_atomic_read64(
+			&(d_counters->m_timeouts)
+		);
+		v_stats->m_deadlineMisses += apr_atomic_read64(
+			&(d_counters->m_deadlineMisses)
+		);
+		v_stats->m_connects += apr_atomic_read64(
+			&(d_counters->m_connects)
+		);
+		v_stats->m_connectFailures += apr_atomic_read64(
+			&(d_counters->m_connectFailures)
+		);
+		v_stats->m_resets += apr_atomic_read64(
+			&(d_counters->m_resets)
+		);
+		v_stats->m_evictions += apr_atomic_read64(
+			&(d_counters->m_evictions)
+		);
+		v_stats->m_pinReuses += apr_atomic_read64(
+			&(d_counters->m_pinReuses)
+		);
+		v_stats->m_waitTime += apr_atomic_read64(
+			&(d_counters->m_waitTime)
+		);
+		addHistogram(
+			&(d_counters->m_waitHistogram), v_stats->m_waitHistogram
+		);
+		addHistogram(
+			&(d_counters->m_holdHistogram), v_stats->m_holdHistogram
+		);
+		addHistogram(
+			&(d_counters->m_connectHistogram),
+			v_stats->m_connectHistogram
+		);
+		#undef d_counters
+	}
+
+	v_stats->m_inUse += t_inUse;
+	v_stats->m_idle += (t_open > t_inUse) ? (t_open - t_inUse) : 0;
+	v_stats->m_waiting += t_waiting;
+}
+
+
+/******************************************************************************
+ * getScoreboardCounters()                                                    *
+ *   Finds a <PGconn> container's striped pool statistics counters in a slot  *
+ * of the statistics shared memory segment.                                   *
+ *                                                                            *
+ * IN:	v_slot - the slot.                                                    *
+ * 	v_statsIndex - the container's m_statsIndex.                          *
+ *                                                                            *
+ * Returns:	the first of the container's counters in the slot.            *
+ ******************************************************************************/
+static tPGconnCounters* getScoreboardCounters(
+	int v_slot,
+	int v_statsIndex
+)
+{
+	return &(g_scoreboard.m_counters[
+		((v_slot * g_scoreboard.m_numContainers) + v_statsIndex)
+							* g_statsStripes
+	]);
+}
+
+
+/******************************************************************************
+ * clearPGconnGauges()                                                        *
+ *   Zeroes the current counts (but not the cumulative ones) in a <PGconn>    *
+ * container's striped pool statistics counters.                              *
+ *                                                                            *
+ * IN:	v_counters - the counters (g_statsStripes of them).                   *
+ ******************************************************************************/
+static void clearPGconnGauges(
+	tPGconnCounters* v_counters
+)
+{
+	int i;
+
+	for (i = 0; i < g_statsStripes; i++) {
+		apr_atomic_set32(&(v_counters[i].m_open), 0);
+		apr_atomic_set32(&(v_counters[i].m_inUse), 0);
+		apr_atomic_set32(&(v_counters[i].m_waiting), 0);
+	}
+}
+
+
+/******************************************************************************
+ * getPGconnStats()                                                           *
+ *   Takes a snapshot of a <PGconn> container's pool statistics in this       *
+ * process.                                                                   *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * OUT:	v_stats - the statistics.                                             *
+ *                                                                            *
+ * Returns:	1 - if everything was OK.                                     *
+ * 		0 - if there was a problem with the parameters.               *
+ ******************************************************************************/
+static int getPGconnStats(
+	const tPGconnContainer* v_PGconnContainer,
+	tPGconnStats* v_stats
+)
+{
+	if ((!v_PGconnContainer) || (!v_stats))
+		return 0;
+
+	/* Containers that share their pools also share their counters */
+	memset(v_stats, 0, sizeof(*v_stats));
+	addPGconnCounters(
+		getSharedPGconnContainer(v_PGconnContainer)->m_stats, v_stats
+	);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * getPGconnServerStats()                                                     *
+ *   Takes a snapshot of a <PGconn> container's pool statistics, summed over  *
+ * every child process, from the statistics shared memory segment.  The       *
+ * cumulative counts include child processes that have since exited.  If the  *
+ * segment couldn't be created, only this process's statistics are returned.  *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * OUT:	v_stats - the statistics.                                             *
+ *                                                                            *
+ * Returns:	1 - if everything was OK.                                     *
+ * 		0 - if there was a problem with the parameters.               *
+ ******************************************************************************/
+static int getPGconnServerStats(
+	const tPGconnContainer* v_PGconnContainer,
+	tPGconnStats* v_stats
+)
+{
+	int t_index;
+	int i;
+
+	if ((!v_PGconnContainer) || (!v_stats))
+		return 0;
+	else if (!g_scoreboard.m_counters)
+		return getPGconnStats(v_PGconnContainer, v_stats);
+
+	memset(v_stats, 0, sizeof(*v_stats));
+	t_index = getSharedPGconnContainer(v_PGconnContainer)->m_statsIndex;
+	if ((t_index < 0) || (t_index >= g_scoreboard.m_numContainers))
+		return 1;
+	for (i = 0; i < g_scoreboard.m_numSlots; i++)
+		addPGconnCounters(getScoreboardCounters(i, t_index), v_stats);
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * measurePGconnPercentile()                                                  *
+ *   Estimates a percentile from one of the latency histograms returned by    *
+ * getPGconnStats().  The estimate is the upper bound of the bucket that the  *
+ * percentile falls in, so it errs on the high side, by up to 25% (or by 1us, *
+ * for values below 4us).                                                     *
+ *                                                                            *
+ * IN:	v_histogram - PGCONN_HISTOGRAM_BUCKETS counts.                        *
+ * 	v_quantile - 0.0..1.0 (e.g. 0.999 for the 99.9th percentile).         *
+ *                                                                            *
+ * Returns:	the percentile, in microseconds, or...                        *
+ * 		0, if the histogram is empty.                                 *
+ ******************************************************************************/
+static apr_interval_time_t measurePGconnPercentile(
+	const apr_uint64_t* v_histogram,
+	double v_quantile
+)
+{
+	apr_uint64_t t_total = 0;
+	apr_uint64_t t_rank;
+	int i;
+
+	if (!v_histogram)
+		return 0;
+	for (i = 0; i < PGCONN_HISTOGRAM_BUCKETS; i++)
+		t_total += v_histogram[i];
+	if (!t_total)
+		return 0;
+
+	/* Find the bucket that contains the value at this rank */
+	if (v_quantile >= 1)
+		t_rank = t_total;
+	else if (v_quantile <= 0)
+		t_rank = 1;
+	else {
+		t_rank = (apr_uint64_t)(v_quantile * t_total);
+		if ((!t_rank) || ((double)t_rank < (v_quantile * t_total)))
+			t_rank++;
+	}
+	for (i = 0; i < PGCONN_HISTOGRAM_BUCKETS - 1; i++) {
+		if (v_histogram[i] >= t_rank)
+			break;
+		t_rank -= v_histogram[i];
+	}
+
+	return getHistogramBound(i);
+}
+
+
+/******************************************************************************
+ * unpinPGconn()                                                              *
+ *   Releases a PostgreSQL connection that was pinned to a client connection. *
+ * This function is called as a connection pool cleanup handler.  (Pinned     *
+ * connections whose idle window has expired are released by the watchdog,    *
+ * or by takePinnedPGconn()).                                                 *
+ *                                                                            *
+ * IN:	v_pin - the pin record.                                               *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t unpinPGconn(
+	void* v_pin
+)
+{
+	#define d_pin	((tPGconnPin*)v_pin)
+	PGconn* t_PGconn = apr_atomic_xchgptr(
+		(volatile void**)&(d_pin->m_PGconn), NULL
+	);
+	if (t_PGconn) {
+		apr_atomic_dec32(
+			&(((tPGconnContainer*)d_pin->m_PGconnContainer)
+							->m_keepAlivePinned)
+		);
+		(void)releasePGconn(d_pin->m_PGconnContainer, &t_PGconn);
+	}
+	#undef d_pin
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * pinPGconn()                                                                *
+ *   Pins a PostgreSQL connection to a keep-alive client connection, so that  *
+ * the next request on that client connection can reuse it.                   *
+ *                                                                            *
+ * IN:	v_binding - the request binding whose connection should be pinned.    *
+ *                                                                            *
+ * OUT:	v_binding - m_PGconn is NULL (if the connection was pinned).          *
+ *                                                                            *
+ * Returns:	1 - if the connection was pinned.                             *
+ * 		0 - if the connection should be released to the pool instead. *
+ ******************************************************************************/
+static int pinPGconn(
+	tPGconnRequestBinding* v_binding
+)
+{
+	tPGconnContainer* t_PGconnContainer
+			= (tPGconnContainer*)v_binding->m_PGconnContainer;
+	conn_rec* t_connection = v_binding->m_connection;
+	tPGconnConnectionConfig* t_PGconnConnectionConfig;
+	tPGconnPin* t_pin;
+
+	/* Only pin idle connections, and only while the client connection is
+	   going to be kept alive */
+	if ((t_PGconnContainer->m_keepAlivePin <= 0) || (t_connection->aborted)
+			|| (t_connection->keepalive != AP_CONN_KEEPALIVE)
+			|| (PQtransactionStatus(v_binding->m_PGconn)
+							!= PQTRANS_IDLE))
+		return 0;
+
+	/* Enforce the per-child limit on pinned connections */
+	if (apr_atomic_inc32(&(t_PGconnContainer->m_keepAlivePinned))
+			>= (apr_uint32_t)t_PGconnContainer->m_keepAlivePinMax) {
+		apr_atomic_dec32(&(t_PGconnContainer->m_keepAlivePinned));
+		return 0;
+	}
+
+	/* Get (or create) the per-connection configuration structure */
+	t_PGconnConnectionConfig = (tPGconnConnectionConfig*)
+		ap_get_module_config(t_connection->conn_config, &pgconn_module);
+	if (!t_PGconnConnectionConfig) {
+		t_PGconnConnectionConfig = (tPGconnConnectionConfig*)
+			apr_pcalloc(t_connection->pool,
+					sizeof(*t_PGconnConnectionConfig));
+		ap_set_module_config(
+			t_connection->conn_config, &pgconn_module,
+			t_PGconnConnectionConfig
+		);
+	}
+
+	/* Reuse this container's pin record for this kind of access, if there
+	   is one.  Otherwise, create one and register a cleanup function to
+	   release the pinned connection when the client connection is
+	   closed */
+	for (t_pin = t_PGconnConnectionConfig->m_first_pin; t_pin;
+			t_pin = t_pin->m_next)
+		if ((t_pin->m_PGconnContainer == t_PGconnContainer)
+				&& (t_pin->m_access == v_binding->m_access))
+			break;
+	if (!t_pin) {
+		t_pin = (tPGconnPin*)apr_pcalloc(
+			t_connection->pool, sizeof(*t_pin)
+		);
+		t_pin->m_PGconnContainer = t_PGconnContainer;
+		t_pin->m_access = v_binding->m_access;
+		t_pin->m_next = t_PGconnConnectionConfig->m_first_pin;
+		t_PGconnConnectionConfig->m_first_pin = t_pin;
+		apr_pool_cleanup_register(
+			t_connection->pool, t_pin, unpinPGconn,
+			apr_pool_cleanup_null
+		);
+	}
+
+	/* Move the connection from the request to the client connection.  The
+	   pin record is only made known to the watchdog once it's complete */
+	t_pin->m_expiry = apr_time_now() + t_PGconnContainer->m_keepAlivePin;
+	t_pin->m_PGconn = v_binding->m_PGconn;
+	markPGconnIdle(
+		t_PGconnContainer, getPGconnResource(v_binding->m_PGconn),
+		t_pin
+	);
+	v_binding->m_PGconn = NULL;
+
+	return 1;
+}
+
+
+/******************************************************************************
+ * takePinnedPGconn()                                                         *
+ *   Takes the PostgreSQL connection (if any) that is pinned to a client      *
+ * connection for a given <PGconn> container and kind of access.  A pinned    *
+ * connection that has outlived its idle window, that no longer works, that   *
+ * is read-write but not to the current primary (i.e. after a failover), or   *
+ * that is to a replica that hasn't replayed the WAL up to v_minLSN, is       *
+ * released to the pool instead.                                              *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_PGconnContainer - connection container details.                     *
+ * 	v_access - PGCONN_READWRITE or PGCONN_READONLY.                       *
+ * 	v_minLSN - the LSN of the client's last write (or 0, if unknown).     *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if one was taken).              *
+ *                                                                            *
+ * Returns:	1 - if a pinned connection was taken.                         *
+ * 		0 - if there was no usable pinned connection.                 *
+ ******************************************************************************/
+static int takePinnedPGconn(
+	const request_rec* v_request,
+	const tPGconnContainer* v_PGconnContainer,
+	ePGconnAccess v_access,
+	apr_uint64_t v_minLSN,
+	PGconn** v_PGconn
+)
+{
+	tPGconnConnectionConfig* t_PGconnConnectionConfig;
+	tPGconnPin* t_pin;
+	tPGconnHost* t_PGconnHost;
+	PGconn* t_PGconn;
+	int t_usable;
+
+	t_PGconnConnectionConfig = (tPGconnConnectionConfig*)
+		ap_get_module_config(v_request->connection->conn_config,
+					&pgconn_module);
+	if (!t_PGconnConnectionConfig)
+		return 0;
+
+	for (t_pin = t_PGconnConnectionConfig->m_first_pin; t_pin;
+			t_pin = t_pin->m_next)
+		if ((t_pin->m_PGconnContainer == v_PGconnContainer)
+				&& (t_pin->m_access == v_access)) {
+			/* Take the connection, unless there isn't one (e.g.
+			   because the watchdog has released it) */
+			t_PGconn = apr_atomic_xchgptr(
+				(volatile void**)&(t_pin->m_PGconn), NULL
+			);
+			if (!t_PGconn)
+				return 0;
+			apr_atomic_dec32(
+				&(((tPGconnContainer*)v_PGconnContainer)
+							->m_keepAlivePinned)
+			);
+
+			/* A connection that isn't to the current primary
+			   must be to a replica that's still usable */
+			t_PGconnHost = getPGconnResource(t_PGconn)
+								->m_PGconnHost;
+			if (t_PGconnHost == v_PGconnContainer->m_primary)
+				t_usable = 1;
+			else if (v_access == PGCONN_READWRITE)
+				t_usable = 0;
+			else
+				t_usable = isReplicaUsable(
+					t_PGconnHost, v_minLSN
+				);
+
+			if ((t_pin->m_expiry < apr_time_now())
+					|| (PQstatus(t_PGconn) != CONNECTION_OK)
+					|| (!t_usable)) {
+				(void)releasePGconn(
+					v_PGconnContainer, &t_PGconn
+				);
+				return 0;
+			}
+			markPGconnHeld(
+				v_PGconnContainer, getPGconnResource(t_PGconn),
+				v_request
+			);
+			*v_PGconn = t_PGconn;
+			return 1;
+		}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * releaseRequestPGconn()                                                     *
+ *   Releases a PostgreSQL connection that was bound to a request, or pins it *
+ * to the client connection if keep-alive pinning is enabled for the          *
+ * <PGconn> container.  This function should only be called as a request pool *
+ * cleanup handler.                                                           *
+ *                                                                            *
+ * IN:	v_binding - the request binding.                                      *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t releaseRequestPGconn(
+	void* v_binding
+)
+{
+	#define d_binding	((tPGconnRequestBinding*)v_binding)
+	if ((d_binding->m_PGconn) && (!pinPGconn(d_binding)))
+		(void)releasePGconn(
+			d_binding->m_PGconnContainer, &(d_binding->m_PGconn)
+		);
+	#undef d_binding
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * encodePGconnName()                                                         *
+ *   Encodes a <PGconn> container name so that it can be used in a cookie     *
+ * name (RFC 6265) or a file name.  Characters other than letters, digits,    *
+ * "-" and "." are encoded as "_" followed by two hex digits.                 *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_prefix - what to put before the encoded name.                       *
+ * 	v_name - the container name.                                          *
+ *                                                                            *
+ * Returns:	the prefix followed by the encoded name.                      *
+ ******************************************************************************/
+static char* encodePGconnName(
+	apr_pool_t* v_pool,
+	const char* v_prefix,
+	const char* v_name
+)
+{
+	static const char t_hex[] = "0123456789ABCDEF";
+	const unsigned char* t_source = (const unsigned char*)v_name;
+	apr_size_t t_prefixLength = strlen(v_prefix);
+	char* t_name = apr_palloc(
+		v_pool, t_prefixLength + (strlen(v_name) * 3) + 1
+	);
+	char* t_dest = t_name + t_prefixLength;
+
+	memcpy(t_name, v_prefix, t_prefixLength);
+	for (; *t_source; t_source++) {
+		if (apr_isalnum(*t_source) || (*t_source == '-')
+				|| (*t_source == '.'))
+			*t_dest++ = *t_source;
+		else {
+			*t_dest++ = '_';
+			*t_dest++ = t_hex[*t_source >> 4];
+			*t_dest++ = t_hex[*t_source & 0x0F];
+		}
+	}
+	*t_dest = '\0';
+
+	return t_name;
+}
+
+
+/******************************************************************************
+ * getLSNTokenName()                                                          *
+ *   Gets the name of the request note and cookie that carry a client's       *
+ * read-your-writes LSN for a <PGconn> container.                             *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	the name.                                                     *
+ ******************************************************************************/
+static const char* getLSNTokenName(
+	apr_pool_t* v_pool,
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return encodePGconnName(
+		v_pool, "PGconnLSN_", v_PGconnContainer->m_name
+	);
+}
+
+
+/******************************************************************************
+ * getLSNToken()                                                              *
+ *   Gets the LSN of a client's last write through a <PGconn> container,      *
+ * from the request's notes (if the write was made by this request) or from   *
+ * the client's cookie (if it was made by an earlier request).                *
+ *                                                                            *
+ * IN:	v_request - the (main) request record.                                *
+ * 	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	the LSN, or...                                                *
+ * 		0, if there is no (valid) token.                              *
+ ******************************************************************************/
+static apr_uint64_t getLSNToken(
+	request_rec* v_request,
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	const char* t_name = getLSNTokenName(
+		v_request->pool, v_PGconnContainer
+	);
+	const char* t_LSN = apr_table_get(v_request->notes, t_name);
+
+	if ((!t_LSN)
+			&& (ap_cookie_read(v_request, t_name, &t_LSN, 0)
+							!= APR_SUCCESS))
+		return 0;
+	return readLSN(t_LSN);
+}
+
+
+/******************************************************************************
+ * PGconn_LSNFilter()                                                         *
+ *   Output filter that is added to a request when it binds a read-write      *
+ * connection for a <PGconn> container that has 'ReadYourWrites' enabled.     *
+ * Before any of the response is sent, if the connection may have been        *
+ * written through (see mayHaveWritten()), it captures the primary's current  *
+ * WAL insert LSN into a request note and a cookie, so that the client's      *
+ * later read-only acquires only use replicas that have replayed its writes.  *
+ *                                                                            *
+ * IN:	v_filter - the filter record (its context is the request binding).    *
+ * 	v_brigade - the brigade to pass on.                                   *
+ *                                                                            *
+ * Returns:	as for ap_pass_brigade().                                     *
+ ******************************************************************************/
+static apr_status_t PGconn_LSNFilter(
+	ap_filter_t* v_filter,
+	apr_bucket_brigade* v_brigade
+)
+{
+	#define d_binding	((tPGconnRequestBinding*)v_filter->ctx)
+	const char* t_name;
+	PGresult* t_PGresult;
+	request_rec* t_request = v_filter->r;
+
+	/* Later acquires look for the note on the initial request */
+	while (t_request->prev)
+		t_request = t_request->prev;
+
+	/* Uncommitted writes can't be waited for yet, and a connection that
+	   is busy can't be used, so only ask when the connection is idle */
+	if ((d_binding->m_PGconn)
+			&& getPGconnResource(d_binding->m_PGconn)->m_wrote
+			&& (PQtransactionStatus(d_binding->m_PGconn)
+							== PQTRANS_IDLE)) {
+		t_PGresult = PQexec(
+			d_binding->m_PGconn,
+			"SELECT pg_current_wal_insert_lsn()"
+		);
+		if ((PQresultStatus(t_PGresult) == PGRES_TUPLES_OK)
+				&& (PQntuples(t_PGresult) == 1)) {
+			t_name = getLSNTokenName(
+				v_filter->r->pool, d_binding->m_PGconnContainer
+			);
+			apr_table_set(
+				t_request->notes, t_name,
+				PQgetvalue(t_PGresult, 0, 0)
+			);
+			ap_cookie_write(
+				v_filter->r, t_name,
+				PQgetvalue(t_PGresult, 0, 0), "Path=/;HttpOnly",
+				(long)apr_time_sec(d_binding->m_PGconnContainer
+							->m_readYourWrites),
+				v_filter->r->headers_out, NULL
+			);
+		}
+		PQclear(t_PGresult);
+	}
+	#undef d_binding
+
+	ap_remove_output_filter(v_filter);
+	return ap_pass_brigade(v_filter->next, v_brigade);
+}
+
+
+/******************************************************************************
+ * measureRequestPGconns()                                                    *
+ *   Measures how long the PostgreSQL connections bound to a request have     *
+ * been held so far, and lists the <PGconn> containers they came from.        *
+ *                                                                            *
+ * IN:	v_PGconnRequestConfig - the per-request configuration.                *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * OUT:	v_holdTime - the total hold time, in microseconds.                    *
+ * 	v_names - the container names, comma-separated.                       *
+ ******************************************************************************/
+static void measureRequestPGconns(
+	const tPGconnRequestConfig* v_PGconnRequestConfig,
+	apr_pool_t* v_pool,
+	apr_interval_time_t* v_holdTime,
+	const char** v_names
+)
+{
+	tPGconnRequestBinding* t_binding;
+	apr_time_t t_now = apr_time_now();
+
+	*v_holdTime = 0;
+	*v_names = NULL;
+	for (t_binding = v_PGconnRequestConfig->m_first_binding; t_binding;
+			t_binding = t_binding->m_next) {
+		*v_holdTime += t_now - t_binding->m_boundTime;
+		*v_names = (*v_names) ? apr_pstrcat(v_pool, t_binding->m_name,
+							",", *v_names, NULL)
+					: t_binding->m_name;
+	}
+	if (!*v_names)
+		*v_names = "";
+}
+
+
+/******************************************************************************
+ * PGconn_timingFilter()                                                      *
+ *   Output filter that is added to a request when it binds a connection for  *
+ * a <PGconn> container that has 'ServerTiming' enabled.  Before any of the   *
+ * response is sent, it adds a Server-Timing header with the time spent       *
+ * waiting for connections and the time they have been held so far.           *
+ *                                                                            *
+ * IN:	v_filter - the filter record (its context is the per-request          *
+ * 			configuration).                                       *
+ * 	v_brigade - the brigade to pass on.                                   *
+ *                                                                            *
+ * Returns:	as for ap_pass_brigade().                                     *
+ ******************************************************************************/
+static apr_status_t PGconn_timingFilter(
+	ap_filter_t* v_filter,
+	apr_bucket_brigade* v_brigade
+)
+{
+	#define d_PGconnRequestConfig	\
+		((tPGconnRequestConfig*)v_filter->ctx)
+	apr_interval_time_t t_holdTime;
+	const char* t_names;
+
+	measureRequestPGconns(
+		d_PGconnRequestConfig, v_filter->r->pool, &t_holdTime, &t_names
+	);
+	apr_table_mergen(
+		v_filter->r->headers_out, "Server-Timing",
+		apr_psprintf(
+			v_filter->r->pool,
+			"pgconn-wait;dur=%.3f, pgconn-hold;dur=%.3f",
+			d_PGconnRequestConfig->m_waitTime / 1000.0,
+			t_holdTime / 1000.0
+		)
+	);
+	#undef d_PGconnRequestConfig
+
+	ap_remove_output_filter(v_filter);
+	return ap_pass_brigade(v_filter->next, v_brigade);
+}
+
+
+/******************************************************************************
+ * PGconn_logTransaction()                                                    *
+ *   Records a request's PostgreSQL connection usage in request notes, for    *
+ * logging with "%{PGconnName}n", "%{PGconnAcquires}n",                       *
+ * "%{PGconnPinReuses}n", "%{PGconnWait}n" and "%{PGconnHold}n" (times are in *
+ * microseconds).  Taking a connection that was pinned by a previous          *
+ * keep-alive request isn't counted as an acquire.  This runs before any      *
+ * other logger, while the request's connections are still bound to it.       *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	DECLINED.                                                     *
+ ******************************************************************************/
+static int PGconn_logTransaction(
+	request_rec* v_request
+)
+{
+	tPGconnRequestConfig* t_PGconnRequestConfig;
+	apr_interval_time_t t_holdTime;
+	const char* t_names;
+	const char* t_acquires;
+	const char* t_pinReuses;
+	const char* t_waitTime;
+	const char* t_holdTimeText;
+	request_rec* t_request;
+
+	t_PGconnRequestConfig = (tPGconnRequestConfig*)ap_get_module_config(
+		v_request->request_config, &pgconn_module
+	);
+	if ((!t_PGconnRequestConfig)
+			|| ((!t_PGconnRequestConfig->m_acquires)
+				&& (!t_PGconnRequestConfig->m_pinReuses)))
+		return DECLINED;
+
+	measureRequestPGconns(
+		t_PGconnRequestConfig, v_request->pool, &t_holdTime, &t_names
+	);
+	t_acquires = apr_itoa(
+		v_request->pool, t_PGconnRequestConfig->m_acquires
+	);
+	t_pinReuses = apr_itoa(
+		v_request->pool, t_PGconnRequestConfig->m_pinReuses
+	);
+	t_waitTime = apr_psprintf(
+		v_request->pool, "%" APR_TIME_T_FMT,
+		t_PGconnRequestConfig->m_waitTime
+	);
+	t_holdTimeText = apr_psprintf(
+		v_request->pool, "%" APR_TIME_T_FMT, t_holdTime
+	);
+
+	/* Most log formats look at the final request of an internal redirect
+	   chain, so set the notes on every request in it */
+	for (t_request = v_request; t_request; t_request = t_request->next) {
+		apr_table_setn(t_request->notes, "PGconnName", t_names);
+		apr_table_setn(t_request->notes, "PGconnAcquires", t_acquires);
+		apr_table_setn(
+			t_request->notes, "PGconnPinReuses", t_pinReuses
+		);
+		apr_table_setn(t_request->notes, "PGconnWait", t_waitTime);
+		apr_table_setn(t_request->notes, "PGconnHold", t_holdTimeText);
+	}
+
+	return DECLINED;
+}
+
+
+/******************************************************************************
+ * getResponseRequest()                                                       *
+ *   Finds the request that sends the response for a request: the last        *
+ * internal redirect of its main request.  Output filters and response        *
+ * headers that are added to any other request are lost.                      *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	the request record that sends the response.                   *
+ ******************************************************************************/
+static request_rec* getResponseRequest(
+	request_rec* v_request
+)
+{
+	while (v_request->main || v_request->prev)
+		v_request = v_request->main ? v_request->main
+						: v_request->prev;
+	while (v_request->next)
+		v_request = v_request->next;
+
+	return v_request;
+}
+
+
+/******************************************************************************
+ * PGconn_insertFilter()                                                      *
+ *   An internal redirect gets a new set of output filters, so re-add the     *
+ * filters that were added to the request that it replaces.                   *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ ******************************************************************************/
+static void PGconn_insertFilter(
+	request_rec* v_request
+)
+{
+	tPGconnRequestConfig* t_PGconnRequestConfig;
+	tPGconnRequestBinding* t_binding;
+	request_rec* t_request = v_request;
+
+	if (v_request->main || (!v_request->prev))
+		return;
+	while (t_request->prev)
+		t_request = t_request->prev;
+
+	t_PGconnRequestConfig = (tPGconnRequestConfig*)ap_get_module_config(
+		t_request->request_config, &pgconn_module
+	);
+	if (!t_PGconnRequestConfig)
+		return;
+
+	for (t_binding = t_PGconnRequestConfig->m_first_binding; t_binding;
+			t_binding = t_binding->m_next)
+		if ((t_binding->m_access == PGCONN_READWRITE)
+				&& (t_binding->m_PGconnContainer
+						->m_readYourWrites > 0))
+			ap_add_output_filter(
+				"PGCONN_LSN", t_binding, v_request,
+				v_request->connection
+			);
+
+	if (t_PGconnRequestConfig->m_serverTiming)
+		ap_add_output_filter(
+			"PGCONN_TIMING", t_PGconnRequestConfig, v_request,
+			v_request->connection
+		);
+}
+
+
+/******************************************************************************
+ * getRequestPGconnEx()                                                       *
+ *   Gets the PostgreSQL connection that is bound to a request.  The first    *
+ * call for a given <PGconn> container and kind of access acquires a          *
+ * connection (see acquirePGconnEx()) and binds it to the request; subsequent *
+ * calls (from this module or any other) return the same connection.  A       *
+ * read-only call returns the request's read-write connection, if it already  *
+ * has one, so that the request sees its own writes.  The connection is       *
+ * released automatically when the request pool is destroyed, so the caller   *
+ * must NOT call releasePGconn() for it.                                      *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_PGconnContainer - connection container details.                     *
+ * 	v_access - PGCONN_READWRITE or PGCONN_READONLY.                       *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	PGCONN_ACQUIRED - if everything was OK.                       *
+ * 		PGCONN_ALREADYACQUIRED - if v_PGconn was not NULL.            *
+ * 		PGCONN_UNAVAILABLE - if all the connections in the pool are   *
+ * 					already in use.                       *
+ * 		PGCONN_BAD - if the connection could not be opened/reset.     *
+ * 		PGCONN_TIMEDOUT - if the request's Timeout has already        *
+ * 					expired.                              *
+ ******************************************************************************/
+static ePGconnStatus getRequestPGconnEx(
+	request_rec* v_request,
+	const tPGconnContainer* v_PGconnContainer,
+	ePGconnAccess v_access,
+	PGconn** v_PGconn
+)
+{
+	tPGconnRequestConfig* t_PGconnRequestConfig;
+	tPGconnRequestBinding* t_binding;
+	ePGconnStatus t_PGconnStatus;
+	apr_time_t t_deadline = 0;
+	apr_uint64_t t_minLSN = 0;
+	const char* t_name;
+	request_rec* t_response;
+
+	if ((!v_request) || (!v_PGconnContainer) || (!v_PGconn))
+		return PGCONN_BAD;
+	else if (*v_PGconn)
+		return PGCONN_ALREADYACQUIRED;
+	t_name = v_PGconnContainer->m_name;
+	v_PGconnContainer = getSharedPGconnContainer(v_PGconnContainer);
+
+	/* Sub-requests and internal redirects share the connection of the
+	   request that started them, whose pool outlives theirs */
+	while (v_request->main || v_request->prev)
+		v_request = v_request->main ? v_request->main
+						: v_request->prev;
+	t_response = getResponseRequest(v_request);
+
+	/* Get (or create) the per-request configuration structure */
+	t_PGconnRequestConfig = (tPGconnRequestConfig*)ap_get_module_config(
+		v_request->request_config, &pgconn_module
+	);
+	if (!t_PGconnRequestConfig) {
+		t_PGconnRequestConfig = (tPGconnRequestConfig*)apr_pcalloc(
+			v_request->pool, sizeof(*t_PGconnRequestConfig)
+		);
+		ap_set_module_config(
+			v_request->request_config, &pgconn_module,
+			t_PGconnRequestConfig
+		);
+	}
+
+	/* Look for a connection that is already bound to this request */
+	for (t_binding = t_PGconnRequestConfig->m_first_binding; t_binding;
+			t_binding = t_binding->m_next)
+		if ((t_binding->m_PGconnContainer == v_PGconnContainer)
+				&& ((t_binding->m_access == v_access)
+					|| (t_binding->m_access
+							== PGCONN_READWRITE))) {
+			*v_PGconn = t_binding->m_PGconn;
+			return PGCONN_ACQUIRED;
+		}
+
+	/* If required, stop the backend working on this request once the
+	   client (or whatever is in front of us) has stopped waiting */
+	if (v_PGconnContainer->m_propagateTimeout)
+		t_deadline = v_request->request_time
+					+ v_request->server->timeout;
+
+	/* If required, only use a replica that has replayed the client's last
+	   write */
+	if ((v_access == PGCONN_READONLY)
+			&& (v_PGconnContainer->m_readYourWrites > 0))
+		t_minLSN = getLSNToken(v_request, v_PGconnContainer);
+
+	/* Take the connection pinned by a previous keep-alive request, or
+	   acquire a new connection */
+	t_binding = (tPGconnRequestBinding*)apr_pcalloc(
+		v_request->pool, sizeof(*t_binding)
+	);
+	if ((v_PGconnContainer->m_keepAlivePin > 0)
+			&& (takePinnedPGconn(v_request, v_PGconnContainer,
+						v_access, t_minLSN,
+						&(t_binding->m_PGconn)))) {
+		if (!setStatementTimeout(getPGconnResource(t_binding->m_PGconn),
+						t_deadline)) {
+			apr_atomic_inc64(
+				&(getPGconnCounters(v_PGconnContainer)
+							->m_deadlineMisses)
+			);
+			(void)releasePGconn(
+				v_PGconnContainer, &(t_binding->m_PGconn)
+			);
+			return PGCONN_TIMEDOUT;
+		}
+		apr_atomic_inc64(
+			&(getPGconnCounters(v_PGconnContainer)->m_pinReuses)
+		);
+		t_PGconnRequestConfig->m_pinReuses++;
+	}
+	else {
+		t_PGconnStatus = acquirePGconn_request(
+			v_PGconnContainer, v_access, v_request, t_deadline,
+			t_minLSN, &(t_binding->m_PGconn)
+		);
+		if (t_PGconnStatus != PGCONN_ACQUIRED)
+			return t_PGconnStatus;
+		t_PGconnRequestConfig->m_waitTime += getPGconnResource(
+			t_binding->m_PGconn
+		)->m_waitTime;
+		t_PGconnRequestConfig->m_acquires++;
+	}
+
+	/* Bind it to this request, and register a cleanup function to release
+	   it when the request pool is destroyed */
+	t_binding->m_PGconnContainer = v_PGconnContainer;
+	t_binding->m_name = t_name;
+	t_binding->m_access = v_access;
+	t_binding->m_connection = v_request->connection;
+	t_binding->m_boundTime = apr_time_now();
+	t_binding->m_next = t_PGconnRequestConfig->m_first_binding;
+	t_PGconnRequestConfig->m_first_binding = t_binding;
+	apr_pool_cleanup_register(
+		v_request->pool, t_binding, releaseRequestPGconn,
+		apr_pool_cleanup_null
+	);
+
+	/* If required, capture the LSN of this request's writes before the
+	   response is sent */
+	if ((v_access == PGCONN_READWRITE)
+			&& (v_PGconnContainer->m_readYourWrites > 0))
+		ap_add_output_filter(
+			"PGCONN_LSN", t_binding, t_response,
+			t_response->connection
+		);
+
+	/* If required, report this request's database time to the client */
+	if ((v_PGconnContainer->m_serverTiming)
+			&& (!t_PGconnRequestConfig->m_serverTiming)) {
+		t_PGconnRequestConfig->m_serverTiming = 1;
+		ap_add_output_filter(
+			"PGCONN_TIMING", t_PGconnRequestConfig, t_response,
+			t_response->connection
+		);
+	}
+
+	*v_PGconn = t_binding->m_PGconn;
+	return PGCONN_ACQUIRED;
+}
+
+
+/******************************************************************************
+ * getRequestPGconn()                                                         *
+ *   Gets the read-write PostgreSQL connection that is bound to a request.    *
+ * See getRequestPGconnEx().                                                  *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_PGconnContainer - connection container details.                     *
+ * 	v_PGconn - should be NULL.                                            *
+ *                                                                            *
+ * OUT:	v_PGconn - connection record pointer (if successful).                 *
+ *                                                                            *
+ * Returns:	as for getRequestPGconnEx().                                  *
+ ******************************************************************************/
+static ePGconnStatus getRequestPGconn(
+	request_rec* v_request,
+	const tPGconnContainer* v_PGconnContainer,
+	PGconn** v_PGconn
+)
+{
+	return getRequestPGconnEx(
+		v_request, v_PGconnContainer, PGCONN_READWRITE, v_PGconn
+	);
+}
+
+
+/******************************************************************************
+ * foldModuleName()                                                           *
+ *   Converts a module name to the form used as a key in the per-directory    *
+ * module->container table: lower-case, without any "mod_" prefix or ".c"     *
+ * suffix (so "mod_pgproc.c", "mod_pgproc" and "pgproc" are all "pgproc").    *
+ *                                                                            *
+ * IN:	v_moduleName - the module name.                                       *
+ * 	v_buffer - where to write the folded name.                            *
+ * 	v_bufferSize - the size of v_buffer.                                  *
+ *                                                                            *
+ * Returns:	the length of the folded name, or...                          *
+ * 		-1, if it doesn't fit in v_buffer.                            *
+ ******************************************************************************/
+static int foldModuleName(
+	const char* v_moduleName,
+	char* v_buffer,
+	apr_size_t v_bufferSize
+)
+{
+	apr_size_t t_length;
+
+	if (!strncasecmp(v_moduleName, "mod_", 4))
+		v_moduleName += 4;
+	t_length = strlen(v_moduleName);
+	if ((t_length > 2) && (!strcasecmp(v_moduleName + t_length - 2, ".c")))
+		t_length -= 2;
+	if (t_length >= v_bufferSize)
+		return -1;
+
+	memcpy(v_buffer, v_moduleName, t_length);
+	v_buffer[t_length] = '\0';
+	ap_str_tolower(v_buffer);
+	return (int)t_length;
+}
+
+
+/******************************************************************************
+ * PGconn_serverConfig_create()                                               *
+ *   Creates the per-server configuration structure.                          *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	pointer to per-server config structure.                       *
+ ******************************************************************************/
+static void* PGconn_serverConfig_create(
+	apr_pool_t* v_pool,
+	server_rec* v_server_unused
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+
+	/* Allocate memory for per-server config structure */
+	t_PGconnServerConfig = (tPGconnServerConfig*)apr_pcalloc(
+		v_pool, sizeof(*t_PGconnServerConfig)
+	);
+
+	/* No connections setup to start with. 'm_first_PGconnContainer' will
+	   have already been NULLified by memset() */
+	t_PGconnServerConfig->m_index = apr_hash_make(v_pool);
+
+	return (void*)t_PGconnServerConfig;
+}
+
+
+/******************************************************************************
+ * PGconn_dirConfig_create()                                                  *
+ *   Creates the per-directory configuration structure.                       *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	pointer to per-directory config structure.                    *
+ ******************************************************************************/
+static void* PGconn_dirConfig_create(
+	apr_pool_t* v_pool,
+	char* v_directory_unused
+)
+{
+	tPGconnDirConfig* t_PGconnDirConfig;
+
+	/* Allocate memory for per-directory config structure, zeroising it with
+	   memset() */
+	t_PGconnDirConfig = (tPGconnDirConfig*)apr_pcalloc(
+		v_pool, sizeof(*t_PGconnDirConfig)
+	);
+
+	/* There is no default default <PGconn> container.
+	   'm_defaultPGconnContainer' and 'm_moduleDefaults' will have already
+	   been NULLified by memset() */
+
+	return (void*)t_PGconnDirConfig;
+}
+
+
+/******************************************************************************
+ * PGconn_dirConfig_merge()                                                   *
+ *   Merges a per-directory configuration structure with its parent's.        *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_base - the parent's per-directory config structure.                 *
+ * 	v_add - this directory's per-directory config structure.              *
+ *                                                                            *
+ * Returns:	pointer to the merged per-directory config structure.         *
+ ******************************************************************************/
+static void* PGconn_dirConfig_merge(
+	apr_pool_t* v_pool,
+	void* v_base,
+	void* v_add
+)
+{
+	#define d_base	((tPGconnDirConfig*)v_base)
+	#define d_add	((tPGconnDirConfig*)v_add)
+	tPGconnDirConfig* t_PGconnDirConfig = (tPGconnDirConfig*)apr_pcalloc(
+		v_pool, sizeof(*t_PGconnDirConfig)
+	);
+
+	t_PGconnDirConfig->m_defaultPGconnContainer
+		= d_add->m_defaultPGconnContainer
+			? d_add->m_defaultPGconnContainer
+			: d_base->m_defaultPGconnContainer;
+
+	/* This directory's module->container entries override its parent's */
+	if ((d_add->m_moduleDefaults) && (d_base->m_moduleDefaults))
+		t_PGconnDirConfig->m_moduleDefaults = apr_hash_overlay(
+			v_pool, d_add->m_moduleDefaults,
+			d_base->m_moduleDefaults
+		);
+	else
+		t_PGconnDirConfig->m_moduleDefaults
+			= d_add->m_moduleDefaults ? d_add->m_moduleDefaults
+						: d_base->m_moduleDefaults;
+	#undef d_add
+	#undef d_base
+
+	return (void*)t_PGconnDirConfig;
+}
+
+
+/******************************************************************************
+ * getDefaultPGconnContainer()                                                *
+ *   Gets the <PGconn> container that a module should use, by default, for a  *
+ * request: the one given to "PGconn <module> <name>" for this module, or     *
+ * else the one given to "PGconn <name>".                                     *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_moduleName - the module name (e.g. "mod_pgproc.c"), or NULL.        *
+ *                                                                            *
+ * Returns:	pointer to the <PGconn> container, or...                      *
+ * 		NULL, if there isn't a default.                               *
+ ******************************************************************************/
+static tPGconnContainer* getDefaultPGconnContainer(
+	const request_rec* v_request,
+	const char* v_moduleName
+)
+{
+	tPGconnDirConfig* t_PGconnDirConfig;
+	tPGconnContainer* t_PGconnContainer = NULL;
+	char t_foldedName[64];
+	int t_length;
+
+	if (!v_request)
+		return NULL;
+	t_PGconnDirConfig = (tPGconnDirConfig*)ap_get_module_config(
+		v_request->per_dir_config, &pgconn_module
+	);
+	if (!t_PGconnDirConfig)
+		return NULL;
+
+	if ((v_moduleName) && (t_PGconnDirConfig->m_moduleDefaults)
+			&& ((t_length = foldModuleName(v_moduleName,
+						t_foldedName,
+						sizeof(t_foldedName))) >= 0))
+		t_PGconnContainer = (tPGconnContainer*)apr_hash_get(
+			t_PGconnDirConfig->m_moduleDefaults, t_foldedName,
+			t_length
+		);
+
+	return t_PGconnContainer ? t_PGconnContainer
+				: t_PGconnDirConfig->m_defaultPGconnContainer;
+}
+
+
+/******************************************************************************
+ * copyPoolSizes()                                                            *
+ *   Gives a host a <PGconn> container's configured pool sizes.               *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ * 	v_PGconnContainer - connection container details.                     *
+ ******************************************************************************/
+static void copyPoolSizes(
+	tPGconnHost* v_PGconnHost,
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	v_PGconnHost->m_poolMin = v_PGconnContainer->m_poolMin;
+	v_PGconnHost->m_poolMaxSoft = v_PGconnContainer->m_poolMaxSoft;
+	v_PGconnHost->m_poolMaxHard = v_PGconnContainer->m_poolMaxHard;
+	v_PGconnHost->m_poolTTL = v_PGconnContainer->m_poolTTL;
+}
+
+
+/******************************************************************************
+ * setPGconnHostName()                                                        *
+ *   Names a host for logging, by the host and port in its ConnInfo, so that  *
+ * the password (which the ConnInfo may contain) is never logged.             *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * OUT:	v_PGconnHost - the host record, with its name set.                    *
+ ******************************************************************************/
+static void setPGconnHostName(
+	tPGconnHost* v_PGconnHost,
+	apr_pool_t* v_pool
+)
+{
+	PQconninfoOption* t_options;
+	PQconninfoOption* t_option;
+	const char* t_host = NULL;
+	const char* t_hostAddr = NULL;
+	const char* t_port = NULL;
+
+	t_options = PQconninfoParse(v_PGconnHost->m_connInfo, NULL);
+	for (t_option = t_options; t_option && t_option->keyword; t_option++)
+		if ((!t_option->val) || (!*t_option->val))
+			continue;
+		else if (!strcmp(t_option->keyword, "host"))
+			t_host = t_option->val;
+		else if (!strcmp(t_option->keyword, "hostaddr"))
+			t_hostAddr = t_option->val;
+		else if (!strcmp(t_option->keyword, "port"))
+			t_port = t_option->val;
+
+	/* libpq's default is a Unix-domain socket */
+	v_PGconnHost->m_hostName = apr_pstrcat(
+		v_pool, t_host ? t_host : t_hostAddr ? t_hostAddr : "(local)",
+		t_port ? ":" : "", t_port ? t_port : "", NULL
+	);
+	PQconninfoFree(t_options);
+}
+
+
+/******************************************************************************
+ * readReloadFile()                                                           *
+ *   Reads a <PGconn> container's 'ReloadFile', which can override the        *
+ * primary's ConnInfo, PoolMin, PoolMaxSoft, PoolMaxHard and PoolTTL.  Blank  *
+ * lines and lines starting with "#" are ignored.                             *
+ *                                                                            *
+ * IN:	v_PGconnHost - the primary's host record, with the values to          *
+ * 			override.                                             *
+ * 	v_fileName - the reload file's name.                                  *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * OUT:	v_PGconnHost - the host record, with any overridden values.           *
+ *                                                                            *
+ * Returns:	NULL - if everything was OK.                                  *
+ * 		otherwise - an error message.                                 *
+ ******************************************************************************/
+static const char* readReloadFile(
+	tPGconnHost* v_PGconnHost,
+	const char* v_fileName,
+	apr_pool_t* v_pool
+)
+{
+	ap_configfile_t* t_configFile;
+	char t_line[MAX_STRING_LEN];
+	const char* t_args;
+	char* t_directive;
+	char* t_endPtr;
+	const char* t_errorMessage = NULL;
+	unsigned t_lineNumber;
+
+	if (ap_pcfg_openfile(&t_configFile, v_pool, v_fileName)
+							!= APR_SUCCESS)
+		return apr_psprintf(v_pool, "Could not open '%s'", v_fileName);
+
+	while ((!t_errorMessage)
+			&& (ap_cfg_getline(t_line, sizeof(t_line),
+						t_configFile) == APR_SUCCESS)) {
+		t_args = t_line;
+		t_directive = ap_getword_conf(v_pool, &t_args);
+		t_endPtr = "";
+		if ((!*t_directive) || (*t_directive == '#'))
+			continue;
+		else if (!strcasecmp(t_directive, "ConnInfo")) {
+			v_PGconnHost->m_connInfo = ap_getword_conf(
+				v_pool, &t_args
+			);
+			if (*t_args)
+				t_errorMessage = "ConnInfo: Too many arguments";
+			else if (!strlen(v_PGconnHost->m_connInfo))
+				t_errorMessage = "ConnInfo: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive, "PoolMin"))
+			v_PGconnHost->m_poolMin = strtol(
+				t_args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive, "PoolMaxSoft"))
+			v_PGconnHost->m_poolMaxSoft = strtol(
+				t_args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive, "PoolMaxHard"))
+			v_PGconnHost->m_poolMaxHard = strtol(
+				t_args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive, "PoolTTL"))
+			v_PGconnHost->m_poolTTL = apr_strtoi64(
+				t_args, &t_endPtr, 10
+			);
+		else
+			t_errorMessage = apr_psprintf(
+				v_pool, "'%s' not recognized", t_directive
+			);
+
+		/* Check if an error occurred */
+		if ((!t_errorMessage) && (*t_endPtr))
+			t_errorMessage = apr_psprintf(
+				v_pool, "Invalid value specified for '%s'",
+				t_directive
+			);
+	}
+	t_lineNumber = t_configFile->line_number;
+	ap_cfg_closefile(t_configFile);
+
+	if (t_errorMessage)
+		return apr_psprintf(
+			v_pool, "%s, line %u: %s", v_fileName, t_lineNumber,
+			t_errorMessage
+		);
+	else if (v_PGconnHost->m_poolMaxHard < 1)
+		return apr_psprintf(
+			v_pool, "%s: PoolMaxHard must be at least 1",
+			v_fileName
+		);
+	return NULL;
+}
+
+
+/******************************************************************************
+ * PGconn_containerCommand()                                                  *
+ *   Process the "<PGconn>" container directive.                              *
+ *                                                                            *
+ * IN:	v_cmdParms - various server configuration details.                    *
+ * 	v_args - connection name plus trailing ">".                           *
+ *                                                                            *
+ * Returns:	NULL or an error message.                                     *
+ ******************************************************************************/
+static const char* PGconn_containerCommand(
+	cmd_parms* v_cmdParms,
+	void* v_dirConfig_unused,
+	const char* v_args
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnContainer** t_PGconnContainer;
+	tPGconnHost* t_PGconnHost;
+	ap_directive_t* t_directive;
+	const char* t_args;
+	char* t_endPtr = "";
+	static APR_OPTIONAL_FN_TYPE(getAllFunctionDetails)*
+							getAllFunctionDetails;
+	char* t_errorMessage = NULL;
+	const char* t_reloadError;
+	apr_finfo_t t_finfo;
+	char* t_foldedName;
+	int i;
+
+	/* Check that the Connection Name has been specified */
+	if (v_args[0] == '>')
+		return "Missing Connection Name";
+
+	/* Check that there is a closing ">" for the container start
+	   directive */
+	if (!strrchr(v_args, '>'))
+		return "Missing \">\"";
+
+	/* Get the server configuration structure */
+	t_PGconnServerConfig = (tPGconnServerConfig*)ap_get_module_config(
+		v_cmdParms->server->module_config, &pgconn_module
+	);
+	if (!t_PGconnServerConfig)
+		return "ap_get_module_config() failed";
+
+	/* Find the end of the <PGconn> container linked list */
+	for (t_PGconnContainer = &(t_PGconnServerConfig->
+						m_first_PGconnContainer);
+			*t_PGconnContainer;
+			t_PGconnContainer = &((*t_PGconnContainer)->m_next))
+		if (!strcmp((*t_PGconnContainer)->m_name, v_args))
+			return "Duplicate Connection Name";
+
+	/* Allocate memory for the <PGconn> container structure, zeroising with
+	   memset() */
+	*t_PGconnContainer = (tPGconnContainer*)apr_pcalloc(
+		v_cmdParms->pool, sizeof(**t_PGconnContainer)
+	);
+	if (!(*t_PGconnContainer))
+		return "Not enough memory";
+
+	/* This is added to the end of the list. 'm_next' will already be
+	   NULL, because apr_pcalloc() was used to allocate memory */
+	/* No PGconn* resource list yet. 'm_PGconnPool' will already be NULL,
+	   because apr_pcalloc() was used to allocate memory */
+	/* Copy the connection name, removing the container start directive's
+	   closing ">" */
+	(*t_PGconnContainer)->m_name = apr_pstrndup(
+		v_cmdParms->pool, v_args, strlen(v_args) - 1
+	);
+	/* Remember which virtual host it's in, for the statistics */
+	(*t_PGconnContainer)->m_server = v_cmdParms->server;
+	/* Add it to the case-folded name index (unless a container with the
+	   same name is already there), and give it a handle */
+	t_foldedName = apr_pstrdup(
+		v_cmdParms->pool, (*t_PGconnContainer)->m_name
+	);
+	foldPGconnName(t_foldedName);
+	if (!apr_hash_get(t_PGconnServerConfig->m_index, t_foldedName,
+				APR_HASH_KEY_STRING))
+		apr_hash_set(
+			t_PGconnServerConfig->m_index, t_foldedName,
+			APR_HASH_KEY_STRING, *t_PGconnContainer
+		);
+	(*t_PGconnContainer)->m_handle = g_PGconnContainers->nelts;
+	APR_ARRAY_PUSH(g_PGconnContainers, tPGconnContainer*)
+						= *t_PGconnContainer;
+	/* Default 'connInfo' is "" */
+	(*t_PGconnContainer)->m_connInfo = "";
+	/* Create the primary host record. Its 'connInfo' is filled in once the
+	   contents of the container have been parsed */
+	(*t_PGconnContainer)->m_primary = (tPGconnHost*)apr_pcalloc(
+		v_cmdParms->pool, sizeof(tPGconnHost)
+	);
+	(*t_PGconnContainer)->m_primary->m_PGconnContainer
+							= *t_PGconnContainer;
+	(*t_PGconnContainer)->m_configured = (*t_PGconnContainer)->m_primary;
+	/* There is no standby by default. 'm_standby' will already be NULL,
+	   because apr_pcalloc() was used to allocate memory */
+	(*t_PGconnContainer)->m_standbyPoolMin = 1;
+	/* There are no replicas by default.  'm_replicaBalance' will already
+	   be POWEROFTWO, because apr_pcalloc() was used to allocate memory */
+	(*t_PGconnContainer)->m_replicas = apr_array_make(
+		v_cmdParms->pool, 0, sizeof(tPGconnHost*)
+	);
+	/* Replica lag monitoring is disabled by default. 'm_maxReplicaLag'
+	   will already be '0', because apr_pcalloc() was used to allocate
+	   memory */
+	(*t_PGconnContainer)->m_replicaCheckInterval = apr_time_from_sec(5);
+	/* Containers are only shared if they are identical, by default.
+	   'm_sharedPool' and 'm_shared' will already be NULL, because
+	   apr_pcalloc() was used to allocate memory */
+	/* Read-your-writes routing is disabled by default. 'm_readYourWrites'
+	   will already be '0', because apr_pcalloc() was used to allocate
+	   memory */
+	/* Resource lists are created at startup by default.
+	   'm_poolCreateLazy' will already be '0', because apr_pcalloc() was
+	   used to allocate memory */
+	/* Minimum pool size will already be '0', because apr_pcalloc() was used
+	   to allocate memory */
+	/* Soft Maximum pool size will already be '0', because apr_pcalloc() was
+	   used to allocate memory */
+	/* Set Hard Maximum pool size to 1 */
+	(*t_PGconnContainer)->m_poolMaxHard = 1;
+	/* Default 'poolTTL' will already be '0', because apr_pcalloc() was used
+	   to allocate memory */
+	/* Default 'traceDir' will already be NULL, because apr_pcalloc() was
+	   used to allocate memory */
+	/* Default 'traceMode' will already be TRACEFILES, because apr_pcalloc()
+	   was used to allocate memory */
+	(*t_PGconnContainer)->m_traceMaxSize = 64;
+	/* Default 'traceFormat' will already be TRACETEXT, because
+	   apr_pcalloc() was used to allocate memory */
+	(*t_PGconnContainer)->m_tracePayload = 64;
+	/* Default 'traceSample' will already be '0' and 'traceEnv' will
+	   already be NULL (i.e. trace every connection), because apr_pcalloc()
+	   was used to allocate memory */
+	/* Keep-alive pinning is disabled by default. 'm_keepAlivePin' and
+	   'm_keepAlivePinMax' will already be '0', because apr_pcalloc() was
+	   used to allocate memory */
+	/* The held-connection watchdog is disabled by default. 'm_holdWarn',
+	   'm_holdCancel' and 'm_cancelOnAbort' will already be '0', because
+	   apr_pcalloc() was used to allocate memory */
+	/* Timeout propagation is disabled by default. 'm_propagateTimeout'
+	   will already be '0', because apr_pcalloc() was used to allocate
+	   memory */
+	/* The Server-Timing header is disabled by default. 'm_serverTiming'
+	   will already be '0', because apr_pcalloc() was used to allocate
+	   memory */
+	/* Catalog cache is disabled by default. 'm_catalogCache' will already
+	   be DISABLED and 'm_catalog' will already be NULL, because
+	   apr_pcalloc() was used to allocate memory */
+	/* The statistics counters are allocated by PGconn_postConfig(), once
+	   it knows whether the container is merged into another one */
+
+	/* Parse the contents of the container */
+	for (t_directive = v_cmdParms->directive->first_child; t_directive;
+			t_directive = t_directive->next) {
+		t_args = t_directive->args;
+		if (!strcasecmp(t_directive->directive, "ConnInfo")) {
+			(*t_PGconnContainer)->m_connInfo = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "ConnInfo: Too many arguments";
+			else if (strlen((*t_PGconnContainer)->m_connInfo))
+				continue;
+			else
+				return "ConnInfo: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"ReplicaConnInfo")) {
+			t_PGconnHost = (tPGconnHost*)apr_pcalloc(
+				v_cmdParms->pool, sizeof(*t_PGconnHost)
+			);
+			t_PGconnHost->m_PGconnContainer = *t_PGconnContainer;
+			t_PGconnHost->m_connInfo = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "ReplicaConnInfo: Too many arguments";
+			else if (!strlen(t_PGconnHost->m_connInfo))
+				return "ReplicaConnInfo: Too few arguments";
+			APR_ARRAY_PUSH((*t_PGconnContainer)->m_replicas,
+					tPGconnHost*) = t_PGconnHost;
+			continue;
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"StandbyConnInfo")) {
+			t_PGconnHost = (tPGconnHost*)apr_pcalloc(
+				v_cmdParms->pool, sizeof(*t_PGconnHost)
+			);
+			t_PGconnHost->m_PGconnContainer = *t_PGconnContainer;
+			t_PGconnHost->m_connInfo = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "StandbyConnInfo: Too many arguments";
+			else if (!strlen(t_PGconnHost->m_connInfo))
+				return "StandbyConnInfo: Too few arguments";
+			(*t_PGconnContainer)->m_standby = t_PGconnHost;
+			continue;
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"StandbyPoolMin"))
+			(*t_PGconnContainer)->m_standbyPoolMin = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive,
+							"ReplicaBalance")) {
+			if (!strcasecmp(t_args, "PowerOfTwo"))
+				(*t_PGconnContainer)->m_replicaBalance
+							= POWEROFTWO;
+			else if (!strcasecmp(t_args, "LeastOutstanding"))
+				(*t_PGconnContainer)->m_replicaBalance
+							= LEASTOUTSTANDING;
+			else if (!strcasecmp(t_args, "RoundRobin"))
+				(*t_PGconnContainer)->m_replicaBalance
+							= ROUNDROBIN;
+			else
+				return "ReplicaBalance: must be PowerOfTwo,"
+					" LeastOutstanding or RoundRobin";
+		}
+		else if (!strcasecmp(t_directive->directive, "MaxReplicaLag"))
+			(*t_PGconnContainer)->m_maxReplicaLag
+				= apr_time_from_sec(strtol(
+					t_directive->args, &t_endPtr, 10
+				));
+		else if (!strcasecmp(t_directive->directive,
+						"ReplicaCheckInterval")) {
+			(*t_PGconnContainer)->m_replicaCheckInterval
+				= apr_time_from_sec(strtol(
+					t_directive->args, &t_endPtr, 10
+				));
+			if ((!*t_endPtr) && ((*t_PGconnContainer)->
+						m_replicaCheckInterval <= 0))
+				return "ReplicaCheckInterval: must be at least"
+					" 1 second";
+		}
+		else if (!strcasecmp(t_directive->directive, "ReadYourWrites"))
+			(*t_PGconnContainer)->m_readYourWrites
+				= apr_time_from_sec(strtol(
+					t_directive->args, &t_endPtr, 10
+				));
+		else if (!strcasecmp(t_directive->directive, "PoolCreate")) {
+			if (!strcasecmp(t_args, "startup"))
+				(*t_PGconnContainer)->m_poolCreateLazy = 0;
+			else if (!strcasecmp(t_args, "lazy"))
+				(*t_PGconnContainer)->m_poolCreateLazy = 1;
+			else
+				return "PoolCreate: must be Startup or Lazy";
+		}
+		else if (!strcasecmp(t_directive->directive, "PoolMin"))
+			(*t_PGconnContainer)->m_poolMin = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive, "PoolMaxSoft"))
+			(*t_PGconnContainer)->m_poolMaxSoft = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive, "PoolMaxHard"))
+			(*t_PGconnContainer)->m_poolMaxHard = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive, "PoolTTL"))
+			(*t_PGconnContainer)->m_poolTTL = apr_strtoi64(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive, "KeepAlivePin"))
+			(*t_PGconnContainer)->m_keepAlivePin
+				= apr_time_from_sec(strtol(
+					t_directive->args, &t_endPtr, 10
+				));
+		else if (!strcasecmp(t_directive->directive,
+							"KeepAlivePinMax"))
+			(*t_PGconnContainer)->m_keepAlivePinMax = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+		else if (!strcasecmp(t_directive->directive, "HoldWarn"))
+			(*t_PGconnContainer)->m_holdWarn = apr_time_from_sec(
+				strtol(t_directive->args, &t_endPtr, 10)
+			);
+		else if (!strcasecmp(t_directive->directive, "HoldCancel")) {
+			if (!strcasecmp(t_args, "on"))
+				(*t_PGconnContainer)->m_holdCancel = 1;
+			else if (!strcasecmp(t_args, "off"))
+				(*t_PGconnContainer)->m_holdCancel = 0;
+			else
+				return "HoldCancel: must be On or Off";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"CancelOnAbort")) {
+			if (!strcasecmp(t_args, "on"))
+				(*t_PGconnContainer)->m_cancelOnAbort = 1;
+			else if (!strcasecmp(t_args, "off"))
+				(*t_PGconnContainer)->m_cancelOnAbort = 0;
+			else
+				return "CancelOnAbort: must be On or Off";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"PropagateTimeout")) {
+			if (!strcasecmp(t_args, "on"))
+				(*t_PGconnContainer)->m_propagateTimeout = 1;
+			else if (!strcasecmp(t_args, "off"))
+				(*t_PGconnContainer)->m_propagateTimeout = 0;
+			else
+				return "PropagateTimeout: must be On or Off";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"ServerTiming")) {
+			if (!strcasecmp(t_args, "on"))
+				(*t_PGconnContainer)->m_serverTiming = 1;
+			else if (!strcasecmp(t_args, "off"))
+				(*t_PGconnContainer)->m_serverTiming = 0;
+			else
+				return "ServerTiming: must be On or Off";
+		}
+		else if (!strcasecmp(t_directive->directive, "SharedPool")) {
+			(*t_PGconnContainer)->m_sharedPool = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "SharedPool: Too many arguments";
+			else if (strlen((*t_PGconnContainer)->m_sharedPool))
+				continue;
+			else
+				return "SharedPool: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive->directive, "ReloadFile")) {
+			(*t_PGconnContainer)->m_reloadFile = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "ReloadFile: Too many arguments";
+			else if (strlen((*t_PGconnContainer)->m_reloadFile)) {
+				(*t_PGconnContainer)->m_reloadFile
+						= ap_server_root_relative(
+					v_cmdParms->pool,
+					(*t_PGconnContainer)->m_reloadFile
+				);
+				continue;
+			}
+			else
+				return "ReloadFile: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive->directive, "TraceDir")) {
+			(*t_PGconnContainer)->m_traceDir = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "TraceDir: Too many arguments";
+			else if (strlen((*t_PGconnContainer)->m_traceDir)) {
+				(*t_PGconnContainer)->m_traceDir
+						= ap_server_root_relative(
+					v_cmdParms->pool,
+					(*t_PGconnContainer)->m_traceDir
+				);
+				continue;
+			}
+			else
+				return "TraceDir: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive->directive, "TraceMode")) {
+			if (!strcasecmp(t_args, "PerConnection"))
+				(*t_PGconnContainer)->m_traceMode = TRACEFILES;
+			else if (!strcasecmp(t_args, "Ring"))
+#ifdef PGCONN_HAVE_FOPENCOOKIE
+				(*t_PGconnContainer)->m_traceMode = TRACERING;
+#else
+				return "TraceMode: Ring needs fopencookie(),"
+					" which this C library doesn't have";
+#endif
+			else
+				return "TraceMode: must be PerConnection or"
+					" Ring";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"TraceMaxSize")) {
+			(*t_PGconnContainer)->m_traceMaxSize = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+			if ((*t_PGconnContainer)->m_traceMaxSize < 1)
+				return "TraceMaxSize: must be at least 1";
+		}
+		else if (!strcasecmp(t_directive->directive, "TraceFormat")) {
+			if (!strcasecmp(t_args, "Text"))
+				(*t_PGconnContainer)->m_traceFormat = TRACETEXT;
+			else if (!strcasecmp(t_args, "Binary"))
+#ifdef PGCONN_HAVE_FOPENCOOKIE
+				(*t_PGconnContainer)->m_traceFormat
+								= TRACEBINARY;
+#else
+				return "TraceFormat: Binary needs"
+					" fopencookie(), which this C library"
+					" doesn't have";
+#endif
+			else
+				return "TraceFormat: must be Text or Binary";
+		}
+		else if (!strcasecmp(t_directive->directive,
+							"TracePayload")) {
+			(*t_PGconnContainer)->m_tracePayload = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+			if (((*t_PGconnContainer)->m_tracePayload < 0)
+				|| ((*t_PGconnContainer)->m_tracePayload
+									> 256))
+				return "TracePayload: must be between 0 and"
+					" 256";
+		}
+		else if (!strcasecmp(t_directive->directive, "TraceSample")) {
+			(*t_PGconnContainer)->m_traceSample = strtol(
+				t_directive->args, &t_endPtr, 10
+			);
+			if (((*t_PGconnContainer)->m_traceSample < 1)
+				|| ((*t_PGconnContainer)->m_traceSample
+									> 100))
+				return "TraceSample: must be between 1 and"
+					" 100";
+		}
+		else if (!strcasecmp(t_directive->directive, "TraceEnv")) {
+			(*t_PGconnContainer)->m_traceEnv = ap_getword_conf(
+				v_cmdParms->pool, &t_args
+			);
+			if (*t_args)
+				return "TraceEnv: Too many arguments";
+			else if (!strlen((*t_PGconnContainer)->m_traceEnv))
+				return "TraceEnv: Too few arguments";
+		}
+		else if (!strcasecmp(t_directive->directive, "CatalogCache")) {
+			if (!strcasecmp(t_args, "disabled"))
+				(*t_PGconnContainer)->m_catalogCache = DISABLED;
+			else if (!strcasecmp(t_args, "enabled"))
+				(*t_PGconnContainer)->m_catalogCache = ENABLED;
+			else if (!strcasecmp(t_args, "required"))
+				(*t_PGconnContainer)->m_catalogCache = REQUIRED;
+		}
+		else
+			return apr_psprintf(
+				v_cmdParms->temp_pool,
+				"'%s' not recognized", t_directive->directive
+			);
+
+		/* Check if an error occurred */
+		if (*t_endPtr)
+			return apr_psprintf(
+				v_cmdParms->temp_pool,
+				"Invalid value specified for '%s'",
+				t_directive->directive
+			);
+	}
+
+	/* Give each host the container's pool sizes.  A standby only keeps a
+	   few connections warm until it is promoted */
+	copyPoolSizes((*t_PGconnContainer)->m_primary, *t_PGconnContainer);
+	for (i = 0; i < (*t_PGconnContainer)->m_replicas->nelts; i++)
+		copyPoolSizes(
+			APR_ARRAY_IDX((*t_PGconnContainer)->m_replicas, i,
+					tPGconnHost*),
+			*t_PGconnContainer
+		);
+	if ((*t_PGconnContainer)->m_standby) {
+		copyPoolSizes(
+			(*t_PGconnContainer)->m_standby, *t_PGconnContainer
+		);
+		(*t_PGconnContainer)->m_standby->m_poolMin
+				= (*t_PGconnContainer)->m_standbyPoolMin;
+	}
+	(*t_PGconnContainer)->m_primary->m_connInfo
+					= (*t_PGconnContainer)->m_connInfo;
+
+	/* The reload file (if there is one) overrides the primary's settings,
+	   so that changes made to it before a restart aren't lost.  Remember
+	   when it was last modified, so that each child only reloads it if it
+	   changes again */
+	if ((*t_PGconnContainer)->m_reloadFile) {
+		t_reloadError = readReloadFile(
+			(*t_PGconnContainer)->m_primary,
+			(*t_PGconnContainer)->m_reloadFile, v_cmdParms->pool
+		);
+		if (t_reloadError)
+			return t_reloadError;
+		if (apr_stat(&t_finfo, (*t_PGconnContainer)->m_reloadFile,
+				APR_FINFO_MTIME, v_cmdParms->temp_pool)
+							== APR_SUCCESS)
+			(*t_PGconnContainer)->m_reloadMTime = t_finfo.mtime;
+		(*t_PGconnContainer)->m_connInfo
+				= (*t_PGconnContainer)->m_primary->m_connInfo;
+	}
+	setPGconnHostName((*t_PGconnContainer)->m_primary, v_cmdParms->pool);
+	for (i = 0; i < (*t_PGconnContainer)->m_replicas->nelts; i++)
+		setPGconnHostName(
+			APR_ARRAY_IDX((*t_PGconnContainer)->m_replicas, i,
+					tPGconnHost*),
+			v_cmdParms->pool
+		);
+	if ((*t_PGconnContainer)->m_standby)
+		setPGconnHostName(
+			(*t_PGconnContainer)->m_standby, v_cmdParms->pool
+		);
+
+	/* By default, allow up to half of the pool to be pinned to keep-alive
+	   connections */
+	if (((*t_PGconnContainer)->m_keepAlivePin > 0)
+			&& ((*t_PGconnContainer)->m_keepAlivePinMax <= 0))
+		(*t_PGconnContainer)->m_keepAlivePinMax
+			= ((*t_PGconnContainer)->m_poolMaxHard + 1) / 2;
+
+	/* If required, call the mod_pgproc function to cache the "function
+	   catalog" */
+	if ((*t_PGconnContainer)->m_catalogCache != DISABLED) {
+		getAllFunctionDetails = APR_RETRIEVE_OPTIONAL_FN(
+			getAllFunctionDetails
+		);
+		if (!getAllFunctionDetails)
+			t_errorMessage = "\"CatalogCache enabled/required\""
+					" requires mod_pgproc!";
+		else
+			t_errorMessage = getAllFunctionDetails(
+				v_cmdParms->pool, v_cmdParms->temp_pool,
+				(*t_PGconnContainer)
+			);
+	}
+
+	return t_errorMessage;
+}
+
+
+/******************************************************************************
+ * moduleDefinesPGconn()                                                      *
+ *   Checks whether a module defines its own "PGconn" directive, as consumer  *
+ * modules (e.g. mod_pgproc) did before this module kept a per-directory      *
+ * module->container table.                                                   *
+ *                                                                            *
+ * IN:	v_moduleName - the module name, as given to the "PGconn" directive.   *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	1 - if it does.                                               *
+ * 		0 - if it doesn't (or the module isn't loaded).               *
+ ******************************************************************************/
+static int moduleDefinesPGconn(
+	const char* v_moduleName,
+	apr_pool_t* v_pool
+)
+{
+	char t_foldedName[64];
+	module* t_module;
+	const command_rec* t_command;
+
+	if (foldModuleName(v_moduleName, t_foldedName,
+				sizeof(t_foldedName)) < 0)
+		return 0;
+
+	t_module = ap_find_linked_module(
+		apr_pstrcat(v_pool, "mod_", t_foldedName, ".c", NULL)
+	);
+	if ((!t_module) || (t_module == &pgconn_module))
+		return 0;
+
+	for (t_command = t_module->cmds; t_command && t_command->name;
+			t_command++)
+		if (!strcasecmp(t_command->name, "PGconn"))
+			return 1;
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * PGconn_command()                                                           *
+ *   Process the "PGconn" command.                                            *
  *                                                                            *
  * IN:	v_cmdParms - various server configuration details.                    *
- * 	v_args - connection name plus trailing ">".                           *
+ * 	v_PGconnDirConfig - the per-directory config structure.               *
+ * 	v_moduleName - if specified (as the first of two arguments), the name *
+ * 			of the module that should use the specified           *
+ * 			connection name by default (otherwise, the specified  *
+ * 			connection name will be used by default for all       *
+ * 			modules).                                             *
+ * 	v_PGconnName - the name of the <PGconn> container to use, by default, *
+ * 			for this directory.                                   *
+ *                                                                            *
+ * Returns:	NULL or an error message.                                     *
+ ******************************************************************************/
+static const char* PGconn_command(
+	cmd_parms* v_cmdParms,
+	void* v_PGconnDirConfig,
+	const char* v_PGconnName,		/* these are reversed... */
+	const char* v_moduleName		/* ...on purpose */
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnContainer* t_PGconnContainer;
+	char t_foldedName[64];
+	const char* t_swap;
+
+	/* With two arguments, the first is the module name */
+	if (v_moduleName) {
+		t_swap = v_moduleName;
+		v_moduleName = v_PGconnName;
+		v_PGconnName = t_swap;
+	}
+
+	/* Get the server configuration structure */
+	t_PGconnServerConfig = (tPGconnServerConfig*)ap_get_module_config(
+		v_cmdParms->server->module_config, &pgconn_module
+	);
+
+	/* Find the required <PGconn> container record */
+	t_PGconnContainer = getPGconnContainerByName(
+		t_PGconnServerConfig, v_PGconnName
+	);
+	if (!t_PGconnContainer)
+		return "Invalid Connection Name";
+
+	#define t_PGconnDirConfig	((tPGconnDirConfig*)v_PGconnDirConfig)
+	if (!v_moduleName)
+		t_PGconnDirConfig->m_defaultPGconnContainer = t_PGconnContainer;
+	else {
+		/* Record it in the module->container table */
+		if (foldModuleName(v_moduleName, t_foldedName,
+					sizeof(t_foldedName)) < 0)
+			return "Module name too long";
+		if (!t_PGconnDirConfig->m_moduleDefaults)
+			t_PGconnDirConfig->m_moduleDefaults = apr_hash_make(
+				v_cmdParms->pool
+			);
+		apr_hash_set(
+			t_PGconnDirConfig->m_moduleDefaults,
+			apr_pstrdup(v_cmdParms->pool, t_foldedName),
+			APR_HASH_KEY_STRING, t_PGconnContainer
+		);
+
+		/* Let a module that still handles this directive itself
+		   (e.g. an older mod_pgproc) handle it too */
+		if (moduleDefinesPGconn(v_moduleName, v_cmdParms->temp_pool))
+			return DECLINE_CMD;
+	}
+	#undef t_PGconnDirConfig
+
+	return NULL;
+}
+
+
+/* The most queries that the watchdog cancels in one visit to a <PGconn>
+   container.  Any others are cancelled on its next visit */
+#define PGCONN_MAX_CANCELS	16
+
+
+/******************************************************************************
+ * checkHeldPGconns()                                                         *
+ *   Logs (and optionally cancels the running query of) every connection in a *
+ * <PGconn> container's pool that has been held for longer than 'HoldWarn'.   *
+ * Also cancels the running query of every connection whose client has gone   *
+ * away, if 'CancelOnAbort' is enabled, and releases every connection pinned  *
+ * to a keep-alive connection whose 'KeepAlivePin' window has expired (even   *
+ * if no further request arrives on the keep-alive connection).               *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void checkHeldPGconns(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server
+)
+{
+	tPGconnCancel t_cancels[PGCONN_MAX_CANCELS];
+	PGconn* t_expired[PGCONN_MAX_CANCELS];
+	tPGconnResource* t_resource;
+	apr_time_t t_now = apr_time_now();
+	char t_errorBuffer[256];
+	int t_numCancels = 0;
+	int t_numExpired = 0;
+	int t_cancel;
+	int i;
+
+	/* Decide which queries to cancel while holding the mutex, but don't
+	   hold it while PQcancel() runs (it connects to the server, which
+	   could take a while if the server is struggling) */
+	apr_thread_mutex_lock(v_PGconnContainer->m_heldMutex);
+	for (t_resource = v_PGconnContainer->m_first_held;
+			t_resource && (t_numCancels < PGCONN_MAX_CANCELS)
+				&& (t_numExpired < PGCONN_MAX_CANCELS);
+			t_resource = t_resource->m_nextHeld) {
+		/* Take an expired pinned connection from its pin record,
+		   unless the client connection's thread has just taken it.
+		   Either way, the pin record stays valid while we hold the
+		   mutex, because whoever takes the connection then needs the
+		   mutex to mark it held or released */
+		if ((t_resource->m_pin)
+				&& (t_resource->m_pin->m_expiry < t_now)) {
+			if (apr_atomic_casptr(
+					(volatile void**)&(t_resource->m_pin
+								->m_PGconn),
+					NULL, t_resource->m_PGconn)
+						== t_resource->m_PGconn) {
+				t_expired[t_numExpired++]
+						= t_resource->m_PGconn;
+				t_resource->m_pin = NULL;
+			}
+			continue;
+		}
+
+		if ((!t_resource->m_acquireTime) || (t_resource->m_cancelled))
+			continue;
+		t_cancel = 0;
+
+		/* Has the connection been held for too long? */
+		if ((v_PGconnContainer->m_holdWarn > 0)
+				&& (!t_resource->m_warned)
+				&& ((t_now - t_resource->m_acquireTime)
+					>= v_PGconnContainer->m_holdWarn)) {
+			t_resource->m_warned = 1;
+			ap_log_error(
+				APLOG_MARK, APLOG_WARNING, 0, v_server,
+				"PGconn '%s': connection (backend PID %d) held"
+				" for %" APR_TIME_T_FMT "s by thread %lu,"
+				" URI '%s'",
+				v_PGconnContainer->m_name,
+				PQbackendPID(t_resource->m_PGconn),
+				apr_time_sec(t_now - t_resource->m_acquireTime),
+				(unsigned long)t_resource->m_thread,
+				t_resource->m_uri[0] ? t_resource->m_uri
+							: "(unknown)"
+			);
+			t_cancel = v_PGconnContainer->m_holdCancel;
+		}
+
+		/* Has the client gone away while a query is running? */
+		if ((v_PGconnContainer->m_cancelOnAbort)
+				&& (t_resource->m_clientSocket != -1)
+				&& (isClientGone(t_resource->m_clientSocket))) {
+			ap_log_error(
+				APLOG_MARK, APLOG_INFO, 0, v_server,
+				"PGconn '%s': client disconnected from URI"
+				" '%s'; cancelling query on backend PID %d",
+				v_PGconnContainer->m_name, t_resource->m_uri,
+				PQbackendPID(t_resource->m_PGconn)
+			);
+			t_cancel = 1;
+		}
+
+		if ((!t_cancel) || (!t_resource->m_PGcancel))
+			continue;
+		t_resource->m_cancelled = 1;
+		t_cancels[t_numCancels].m_PGcancel = t_resource->m_PGcancel;
+		t_cancels[t_numCancels].m_resource = t_resource;
+		t_cancels[t_numCancels].m_backendPID = PQbackendPID(
+			t_resource->m_PGconn
+		);
+		t_resource->m_cancel = &(t_cancels[t_numCancels++]);
+	}
+	apr_thread_mutex_unlock(v_PGconnContainer->m_heldMutex);
+
+	for (i = 0; i < t_numExpired; i++) {
+		apr_atomic_dec32(&(v_PGconnContainer->m_keepAlivePinned));
+		(void)releasePGconn(v_PGconnContainer, &(t_expired[i]));
+	}
+
+	if (!t_numCancels)
+		return;
+
+	/* A connection that is released meanwhile leaves its PGcancel object
+	   for us to free (see markPGconnReleased()) */
+	for (i = 0; i < t_numCancels; i++)
+		if (!PQcancel(t_cancels[i].m_PGcancel, t_errorBuffer,
+				sizeof(t_errorBuffer)))
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, v_server,
+				"PGconn '%s': PQcancel() error (backend PID"
+				" %d): %s", v_PGconnContainer->m_name,
+				t_cancels[i].m_backendPID, t_errorBuffer
+			);
+
+	apr_thread_mutex_lock(v_PGconnContainer->m_heldMutex);
+	for (i = 0; i < t_numCancels; i++)
+		if (t_cancels[i].m_resource)
+			t_cancels[i].m_resource->m_cancel = NULL;
+		else
+			PQfreeCancel(t_cancels[i].m_PGcancel);
+	apr_thread_mutex_unlock(v_PGconnContainer->m_heldMutex);
+}
+
+
+/******************************************************************************
+ * setReplicaRotation()                                                       *
+ *   Puts a replica into (or takes it out of) rotation for read-only          *
+ * acquires, logging the change.                                              *
+ *                                                                            *
+ * IN:	v_PGconnHost - the replica's host record.                             *
+ * 	v_inRotation - 1 to put it into rotation, 0 to take it out.           *
+ * 	v_reason - why it is being taken out of rotation.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void setReplicaRotation(
+	tPGconnHost* v_PGconnHost,
+	apr_uint32_t v_inRotation,
+	const char* v_reason,
+	server_rec* v_server
+)
+{
+	if (apr_atomic_xchg32(&(v_PGconnHost->m_outOfRotation), !v_inRotation)
+							== !v_inRotation)
+		return;
+
+	if (v_inRotation)
+		ap_log_error(
+			APLOG_MARK, APLOG_NOTICE, 0, v_server,
+			"PGconn '%s': replica '%s' is back in rotation",
+			v_PGconnHost->m_PGconnContainer->m_name,
+			v_PGconnHost->m_hostName
+		);
+	else
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, v_server,
+			"PGconn '%s': replica '%s' taken out of rotation: %s",
+			v_PGconnHost->m_PGconnContainer->m_name,
+			v_PGconnHost->m_hostName, v_reason
+		);
+}
+
+
+/******************************************************************************
+ * closeMonitorPGconn()                                                       *
+ *   Closes a host's monitoring connection, if it has one.                    *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record (or NULL).                             *
+ ******************************************************************************/
+static void closeMonitorPGconn(
+	tPGconnHost* v_PGconnHost
+)
+{
+	if ((v_PGconnHost) && (v_PGconnHost->m_monitorPGconn)) {
+		PQfinish(v_PGconnHost->m_monitorPGconn);
+		v_PGconnHost->m_monitorPGconn = NULL;
+	}
+}
+
+
+/******************************************************************************
+ * openMonitorPGconn()                                                        *
+ *   (Re)opens a host's monitoring connection, if necessary.  Connecting is   *
+ * bounded by a connect_timeout of 'ReplicaCheckInterval' (which overrides    *
+ * any in the ConnInfo), so that an unreachable host can't stall the replica  *
+ * monitor, and so are the session's statements (by a statement_timeout that  *
+ * is only set if the ConnInfo doesn't set 'options' itself).                 *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ *                                                                            *
+ * Returns:	1 - if the monitoring connection is usable.                   *
+ * 		0 - if it isn't.                                              *
+ ******************************************************************************/
+static int openMonitorPGconn(
+	tPGconnHost* v_PGconnHost
+)
+{
+	const char* t_keywords[] = {
+		"options", "dbname", "connect_timeout", NULL
+	};
+	const char* t_values[4];
+	char t_statementTimeout[48];
+	char t_connectTimeout[24];
+	#define d_interval	\
+		(v_PGconnHost->m_PGconnContainer->m_replicaCheckInterval)
+
+	if ((v_PGconnHost->m_monitorPGconn)
+			&& (PQstatus(v_PGconnHost->m_monitorPGconn)
+							!= CONNECTION_OK)) {
+		PQfinish(v_PGconnHost->m_monitorPGconn);
+		v_PGconnHost->m_monitorPGconn = NULL;
+	}
+	if (!v_PGconnHost->m_monitorPGconn) {
+		/* Keywords before "dbname" (which the ConnInfo is expanded
+		   from) can be overridden by the ConnInfo, and those after it
+		   override it */
+		apr_snprintf(
+			t_statementTimeout, sizeof(t_statementTimeout),
+			"-c statement_timeout=%" APR_TIME_T_FMT,
+			apr_time_as_msec(d_interval)
+		);
+		/* libpq treats a connect_timeout of 1 as 2 anyway */
+		apr_snprintf(
+			t_connectTimeout, sizeof(t_connectTimeout),
+			"%" APR_TIME_T_FMT, apr_time_sec(d_interval)
+		);
+		t_values[0] = t_statementTimeout;
+		t_values[1] = v_PGconnHost->m_connInfo;
+		t_values[2] = t_connectTimeout;
+		t_values[3] = NULL;
+		v_PGconnHost->m_monitorPGconn = PQconnectdbParams(
+			t_keywords, t_values, 1
+		);
+	}
+	#undef d_interval
+
+	return (v_PGconnHost->m_monitorPGconn)
+		&& (PQstatus(v_PGconnHost->m_monitorPGconn) == CONNECTION_OK);
+}
+
+
+/******************************************************************************
+ * execMonitorQuery()                                                         *
+ *   Runs a query over a host's monitoring connection, waiting for the result *
+ * for no longer than 'ReplicaCheckInterval'.  A query that takes longer      *
+ * (e.g. because the host has become unreachable, which a statement_timeout   *
+ * wouldn't catch) is abandoned, and the monitoring connection is closed.     *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record, with a usable monitoring connection.  *
+ * 	v_query - the query.                                                  *
+ *                                                                            *
+ * Returns:	the query's result (which the caller must PQclear()), or...   *
+ * 		NULL, if it timed out.                                        *
+ ******************************************************************************/
+static PGresult* execMonitorQuery(
+	tPGconnHost* v_PGconnHost,
+	const char* v_query
+)
+{
+	PGconn* t_PGconn = v_PGconnHost->m_monitorPGconn;
+	PGresult* t_PGresult = NULL;
+	PGresult* t_nextPGresult;
+	struct pollfd t_pollFD;
+	apr_time_t t_deadline = apr_time_now()
+		+ v_PGconnHost->m_PGconnContainer->m_replicaCheckInterval;
+	apr_interval_time_t t_remaining;
+	int t_ready;
+
+	/* A send that fails leaves PQgetResult() to report why */
+	if (PQsendQuery(t_PGconn, v_query))
+		while (PQisBusy(t_PGconn)) {
+			t_remaining = t_deadline - apr_time_now();
+			t_pollFD.fd = PQsocket(t_PGconn);
+			t_pollFD.events = POLLIN;
+			t_pollFD.revents = 0;
+			t_ready = (t_remaining <= 0) ? 0 : poll(
+				&t_pollFD, 1, apr_time_as_msec(t_remaining) + 1
+			);
+			if ((t_ready < 0) && (errno == EINTR))
+				continue;
+			else if (t_ready <= 0) {
+				closeMonitorPGconn(v_PGconnHost);
+				return NULL;
+			}
+			else if (!PQconsumeInput(t_PGconn))
+				break;
+		}
+
+	/* Every query run here returns a single result */
+	while ((t_nextPGresult = PQgetResult(t_PGconn))) {
+		PQclear(t_PGresult);
+		t_PGresult = t_nextPGresult;
+	}
+
+	return t_PGresult;
+}
+
+
+/******************************************************************************
+ * checkReplica()                                                             *
+ *   Samples a replica's replication lag and replay LSN, over the replica's   *
+ * own monitoring connection, and updates its rotation status accordingly.    *
+ *                                                                            *
+ * IN:	v_PGconnHost - the replica's host record.                             *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void checkReplica(
+	tPGconnHost* v_PGconnHost,
+	server_rec* v_server
+)
+{
+	#define d_PGconnContainer	(v_PGconnHost->m_PGconnContainer)
+	PGresult* t_PGresult;
+	const char* t_reason = NULL;
+	double t_lag;
+
+	if (!openMonitorPGconn(v_PGconnHost)) {
+		setReplicaRotation(
+			v_PGconnHost, 0, "unable to connect", v_server
+		);
+		return;
+	}
+
+	/* The replay timestamp stops advancing when the primary is idle, so
+	   a replica that has replayed everything it has received is treated
+	   as having no lag; but only if its WAL receiver is streaming, since
+	   otherwise it isn't receiving anything.  A replica that has received
+	   WAL without replaying a transaction since it started (so that its
+	   lag can't be measured) is treated as lagging */
+	t_PGresult = execMonitorQuery(
+		v_PGconnHost,
+		"SELECT CASE"
+			" WHEN pg_last_wal_receive_lsn()"
+				" = pg_last_wal_replay_lsn() THEN 0"
+			" ELSE extract(epoch FROM now()"
+				" - pg_last_xact_replay_timestamp())"
+		" END, pg_last_wal_replay_lsn(),"
+		" (SELECT coalesce(status, '') FROM pg_stat_wal_receiver)"
+	);
+	if (!t_PGresult) {
+		setReplicaRotation(
+			v_PGconnHost, 0, "monitoring query timed out", v_server
+		);
+		return;
+	}
+	else if ((PQresultStatus(t_PGresult) != PGRES_TUPLES_OK)
+			|| (PQntuples(t_PGresult) != 1)) {
+		setReplicaRotation(
+			v_PGconnHost, 0, PQresultErrorMessage(t_PGresult),
+			v_server
+		);
+		PQclear(t_PGresult);
+		return;
+	}
+
+	apr_atomic_set64(
+		&(v_PGconnHost->m_replayLSN),
+		readLSN(PQgetisnull(t_PGresult, 0, 1) ? NULL
+					: PQgetvalue(t_PGresult, 0, 1))
+	);
+	/* The status is only visible to superusers and members of
+	   pg_read_all_stats (e.g. via pg_monitor) */
+	if (PQgetisnull(t_PGresult, 0, 2))
+		t_reason = "WAL receiver not running";
+	else if (!*PQgetvalue(t_PGresult, 0, 2))
+		t_reason = "WAL receiver status not visible (grant pg_monitor)";
+	else if (strcmp(PQgetvalue(t_PGresult, 0, 2), "streaming"))
+		t_reason = apr_pstrcat(
+			v_PGconnHost->m_monitorPool, "WAL receiver ",
+			PQgetvalue(t_PGresult, 0, 2), NULL
+		);
+	else if (PQgetisnull(t_PGresult, 0, 0))
+		t_reason = "lag unknown (no transaction replayed yet)";
+	else {
+		t_lag = strtod(PQgetvalue(t_PGresult, 0, 0), NULL);
+		if ((d_PGconnContainer->m_maxReplicaLag > 0)
+				&& (t_lag * APR_USEC_PER_SEC
+					> d_PGconnContainer->m_maxReplicaLag))
+			t_reason = apr_psprintf(
+				v_PGconnHost->m_monitorPool, "%.1fs behind",
+				t_lag
+			);
+	}
+	PQclear(t_PGresult);
+
+	setReplicaRotation(v_PGconnHost, !t_reason, t_reason, v_server);
+	apr_pool_clear(v_PGconnHost->m_monitorPool);
+	#undef d_PGconnContainer
+}
+
+
+/******************************************************************************
+ * retirePGconnHost()                                                         *
+ *   Marks a host that has been replaced (by a reload, or by its standby      *
+ * being promoted) as retired, so that no more connections are acquired from  *
+ * it, and adds it to its <PGconn> container's list of hosts to drain (see    *
+ * drainPGconnHosts()).  The list may be added to by any thread.              *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_PGconnHost - the host record.                                       *
+ ******************************************************************************/
+static void retirePGconnHost(
+	tPGconnContainer* v_PGconnContainer,
+	tPGconnHost* v_PGconnHost
+)
+{
+	tPGconnHost* t_first;
+
+	apr_atomic_xchg32(&(v_PGconnHost->m_retired), 1);
+	do {
+		t_first = v_PGconnContainer->m_first_draining;
+		v_PGconnHost->m_nextDraining = t_first;
+	} while (apr_atomic_casptr(
+			(volatile void**)&(v_PGconnContainer->m_first_draining),
+			v_PGconnHost, t_first) != t_first);
+}
+
+
+/******************************************************************************
+ * drainPGconnHosts()                                                         *
+ *   Destroys the PGconn* resource lists of a <PGconn> container's hosts that *
+ * have been retired (see retirePGconnHost()), once none of their connections *
+ * are in use and no thread is using them (see useHostPGconnPool()).  The     *
+ * host records themselves are never freed, because a thread may still be     *
+ * about to look at them.                                                     *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_force - 1 to destroy them even if connections are in use (i.e. at   *
+ * 			shutdown), 0 otherwise.                               *
+ ******************************************************************************/
+static void drainPGconnHosts(
+	tPGconnContainer* v_PGconnContainer,
+	int v_force
+)
+{
+	tPGconnHost* t_PGconnHost;
+	tPGconnHost* t_next;
+
+	/* Take the whole list, so that other threads can add to it while we
+	   go through it, and put back the hosts that aren't drained yet */
+	t_PGconnHost = apr_atomic_xchgptr(
+		(volatile void**)&(v_PGconnContainer->m_first_draining), NULL
+	);
+	for (; t_PGconnHost; t_PGconnHost = t_next) {
+		t_next = t_PGconnHost->m_nextDraining;
+		/* A thread that releases a connection becomes a user before
+		   the connection stops counting, so check in this order */
+		if ((!v_force)
+				&& (t_PGconnHost->m_PGconnPool)
+				&& ((apr_reslist_acquired_count(
+						t_PGconnHost->m_PGconnPool))
+					|| (apr_atomic_read32(
+						&(t_PGconnHost->m_users)))))
+			retirePGconnHost(v_PGconnContainer, t_PGconnHost);
+		else
+			destroyHostPGconnPool(t_PGconnHost);
+	}
+}
+
+
+/******************************************************************************
+ * isPrimaryPGconnHost()                                                      *
+ *   Checks whether a host is up and accepting writes, over its monitoring    *
+ * connection.  Both connecting and the query are bounded by                  *
+ * 'ReplicaCheckInterval' (see openMonitorPGconn() and execMonitorQuery()),   *
+ * so a host that has become unreachable counts as down within one interval.  *
+ *                                                                            *
+ * IN:	v_PGconnHost - the host record.                                       *
+ *                                                                            *
+ * Returns:	1 - if it is.                                                 *
+ * 		0 - if it isn't (or it can't be reached).                     *
+ ******************************************************************************/
+static int isPrimaryPGconnHost(
+	tPGconnHost* v_PGconnHost
+)
+{
+	PGresult* t_PGresult;
+	int t_isPrimary;
+
+	if (!openMonitorPGconn(v_PGconnHost))
+		return 0;
+
+	t_PGresult = execMonitorQuery(
+		v_PGconnHost, "SELECT pg_is_in_recovery()"
+	);
+	t_isPrimary = (PQresultStatus(t_PGresult) == PGRES_TUPLES_OK)
+			&& (PQntuples(t_PGresult) == 1)
+			&& (*PQgetvalue(t_PGresult, 0, 0) == 'f');
+	PQclear(t_PGresult);
+
+	return t_isPrimary;
+}
+
+
+/* The number of consecutive checks that must find the primary down, while
+   its standby has been promoted, before failing over */
+#define PGCONN_FAILOVER_CHECKS	3
+
+/******************************************************************************
+ * checkStandby()                                                             *
+ *   Checks whether a <PGconn> container's standby has been promoted.  If it  *
+ * has, and the primary has been down (or in recovery) for                    *
+ * PGCONN_FAILOVER_CHECKS consecutive checks, the standby (whose PGconn*      *
+ * resource list is already warm) becomes the primary, so that read-write     *
+ * acquires stop using the old primary, which is then drained.                *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void checkStandby(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server
+)
+{
+	tPGconnHost* t_oldPrimary = v_PGconnContainer->m_primary;
+	tPGconnHost* t_standby = v_PGconnContainer->m_standby;
+
+	/* Stop monitoring a primary that has been replaced since the last
+	   check */
+	if (v_PGconnContainer->m_monitoredPrimary != t_oldPrimary) {
+		closeMonitorPGconn(v_PGconnContainer->m_monitoredPrimary);
+		v_PGconnContainer->m_monitoredPrimary = NULL;
+		v_PGconnContainer->m_primaryFailures = 0;
+	}
+
+	/* Nothing to do if there's no standby, if its resource list couldn't
+	   be created, if it has already become the primary, or if it hasn't
+	   been promoted */
+	if ((!t_standby) || (!t_standby->m_PGconnPool)
+			|| (t_oldPrimary == t_standby)
+			|| (!isPrimaryPGconnHost(t_standby))) {
+		v_PGconnContainer->m_primaryFailures = 0;
+		return;
+	}
+
+	/* A standby that was promoted while the primary is still up (e.g. one
+	   that was already promoted when we started) isn't a reason to fail
+	   over, and nor is a single failed check of the primary */
+	v_PGconnContainer->m_monitoredPrimary = t_oldPrimary;
+	if (isPrimaryPGconnHost(t_oldPrimary)) {
+		v_PGconnContainer->m_primaryFailures = 0;
+		return;
+	}
+	else if (++v_PGconnContainer->m_primaryFailures
+						< PGCONN_FAILOVER_CHECKS)
+		return;
+
+	/* Switch over.  Connections already acquired from the old primary are
+	   released back to its resource list, as usual, and then it is
+	   drained */
+	if (apr_atomic_casptr((volatile void**)&(v_PGconnContainer->m_primary),
+				t_standby, t_oldPrimary) != t_oldPrimary)
+		return;
+	apr_atomic_xchgptr(
+		(volatile void**)&(v_PGconnContainer->m_PGconnPool),
+		t_standby->m_PGconnPool
+	);
+	retirePGconnHost(v_PGconnContainer, t_oldPrimary);
+	/* The standby's monitoring connection is closed once it is replaced
+	   in turn (e.g. by a reload) */
+	closeMonitorPGconn(t_oldPrimary);
+	v_PGconnContainer->m_monitoredPrimary = t_standby;
+	ap_log_error(
+		APLOG_MARK, APLOG_WARNING, 0, v_server,
+		"PGconn '%s': standby '%s' has been promoted and primary '%s'"
+		" is down, so the standby is now the primary",
+		v_PGconnContainer->m_name, t_standby->m_hostName,
+		t_oldPrimary->m_hostName
+	);
+}
+
+
+/******************************************************************************
+ * checkReplicas()                                                            *
+ *   Checks each of a <PGconn> container's replicas (and its standby, if it   *
+ * has one), every 'ReplicaCheckInterval', and drains any hosts that have     *
+ * been retired.                                                              *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void checkReplicas(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server
+)
+{
+	apr_time_t t_now = apr_time_now();
+	int i;
+
+	drainPGconnHosts(v_PGconnContainer, 0);
+
+	if (t_now < v_PGconnContainer->m_nextReplicaCheck)
+		return;
+	v_PGconnContainer->m_nextReplicaCheck
+			= t_now + v_PGconnContainer->m_replicaCheckInterval;
+
+	checkStandby(v_PGconnContainer, v_server);
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++)
+		checkReplica(
+			APR_ARRAY_IDX(v_PGconnContainer->m_replicas, i,
+					tPGconnHost*),
+			v_server
+		);
+}
+
+
+/******************************************************************************
+ * closeReplicaMonitors()                                                     *
+ *   Closes a <PGconn> container's replica (and standby and primary)          *
+ * monitoring connections.                                                    *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ ******************************************************************************/
+static void closeReplicaMonitors(
+	tPGconnContainer* v_PGconnContainer
+)
+{
+	int i;
+
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++)
+		closeMonitorPGconn(APR_ARRAY_IDX(
+			v_PGconnContainer->m_replicas, i, tPGconnHost*
+		));
+	closeMonitorPGconn(v_PGconnContainer->m_standby);
+	closeMonitorPGconn(v_PGconnContainer->m_monitoredPrimary);
+}
+
+
+/******************************************************************************
+ * wantsReplicaChecks()                                                       *
+ *   Checks whether the replica monitor should check a <PGconn> container.    *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	1 - if it should.                                             *
+ * 		0 - if it shouldn't.                                          *
+ ******************************************************************************/
+static int wantsReplicaChecks(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return (((v_PGconnContainer->m_maxReplicaLag > 0)
+				|| (v_PGconnContainer->m_readYourWrites > 0))
+			&& (v_PGconnContainer->m_replicas->nelts > 0))
+		|| (v_PGconnContainer->m_standby);
+}
+
+
+/******************************************************************************
+ * checkReloadFile()                                                          *
+ *   Checks whether a <PGconn> container's 'ReloadFile' has been modified.    *
+ * If it has, a new generation of the configured primary (with the new        *
+ * ConnInfo and pool sizes) is brought up in the background and then swapped  *
+ * in, and the old primary is drained as its connections are released.        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void checkReloadFile(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server
+)
+{
+	tPGconnHost* t_oldPrimary = v_PGconnContainer->m_primary;
+	tPGconnHost* t_configured = v_PGconnContainer->m_configured;
+	tPGconnHost* t_newPrimary;
+	apr_pool_t* t_pool;
+	apr_finfo_t t_finfo;
+	const char* t_errorMessage;
+
+	drainPGconnHosts(v_PGconnContainer, 0);
+
+	apr_pool_clear(v_PGconnContainer->m_reloadPool);
+	if ((apr_stat(&t_finfo, v_PGconnContainer->m_reloadFile,
+				APR_FINFO_MTIME,
+				v_PGconnContainer->m_reloadPool) != APR_SUCCESS)
+			|| (t_finfo.mtime == v_PGconnContainer->m_reloadMTime))
+		return;
+	v_PGconnContainer->m_reloadMTime = t_finfo.mtime;
+
+	/* Read the new settings into a new host record, starting from the
+	   configured primary's (not those of a standby that has since been
+	   promoted).  Its ConnInfo and PGconn* resource list live in their
+	   own pool, but the record itself is never freed */
+	if (apr_pool_create(&t_pool, NULL) != APR_SUCCESS)
+		return;
+	t_newPrimary = (tPGconnHost*)apr_pcalloc(
+		v_PGconnContainer->m_reloadHostPool, sizeof(*t_newPrimary)
+	);
+	t_newPrimary->m_PGconnContainer = v_PGconnContainer;
+	t_newPrimary->m_connInfo = apr_pstrdup(
+		t_pool, t_configured->m_connInfo
+	);
+	t_newPrimary->m_poolMin = t_configured->m_poolMin;
+	t_newPrimary->m_poolMaxSoft = t_configured->m_poolMaxSoft;
+	t_newPrimary->m_poolMaxHard = t_configured->m_poolMaxHard;
+	t_newPrimary->m_poolTTL = t_configured->m_poolTTL;
+	t_newPrimary->m_generation = t_configured->m_generation + 1;
+	t_newPrimary->m_pool = t_pool;
+	t_errorMessage = readReloadFile(
+		t_newPrimary, v_PGconnContainer->m_reloadFile, t_pool
+	);
+	if (t_errorMessage) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"PGconn '%s': not reloaded: %s",
+			v_PGconnContainer->m_name, t_errorMessage
+		);
+		apr_pool_destroy(t_pool);
+		return;
+	}
+	setPGconnHostName(t_newPrimary, v_PGconnContainer->m_reloadHostPool);
+
+	/* Bring up the new generation's PoolMin connections before switching
+	   to it */
+	if (createHostPGconnPool(t_newPrimary, NULL) != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"PGconn '%s': not reloaded: Failed to create PGconn*"
+			" resource list!", v_PGconnContainer->m_name
+		);
+		return;
+	}
+
+	/* Switch over, unless the standby has been promoted in the meantime */
+	if (apr_atomic_casptr((volatile void**)&(v_PGconnContainer->m_primary),
+				t_newPrimary, t_oldPrimary) != t_oldPrimary) {
+		destroyHostPGconnPool(t_newPrimary);
+		return;
+	}
+	apr_atomic_xchgptr(
+		(volatile void**)&(v_PGconnContainer->m_PGconnPool),
+		t_newPrimary->m_PGconnPool
+	);
+	v_PGconnContainer->m_connInfo = t_newPrimary->m_connInfo;
+	v_PGconnContainer->m_configured = t_newPrimary;
+
+	/* A promoted standby that is replaced is no longer a standby */
+	apr_atomic_casptr(
+		(volatile void**)&(v_PGconnContainer->m_standby), NULL,
+		t_oldPrimary
+	);
+
+	/* Drain the old primary */
+	retirePGconnHost(v_PGconnContainer, t_oldPrimary);
+
+	ap_log_error(
+		APLOG_MARK, APLOG_NOTICE, 0, v_server,
+		"PGconn '%s': reloaded from '%s' (generation %d; PoolMin %d,"
+		" PoolMaxSoft %d, PoolMaxHard %d)", v_PGconnContainer->m_name,
+		v_PGconnContainer->m_reloadFile, t_newPrimary->m_generation,
+		t_newPrimary->m_poolMin, t_newPrimary->m_poolMaxSoft,
+		t_newPrimary->m_poolMaxHard
+	);
+}
+
+
+/******************************************************************************
+ * finishReloads()                                                            *
+ *   Destroys the PGconn* resource lists that were created by reloads.        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ ******************************************************************************/
+static void finishReloads(
+	tPGconnContainer* v_PGconnContainer
+)
+{
+	drainPGconnHosts(v_PGconnContainer, 1);
+	/* The primary from the httpd configuration is destroyed by the child
+	   pool's cleanup instead */
+	if (v_PGconnContainer->m_primary->m_generation > 0)
+		destroyHostPGconnPool(v_PGconnContainer->m_primary);
+}
+
+
+/******************************************************************************
+ * wantsReloadChecks()                                                        *
+ *   Checks whether the reloader should check a <PGconn> container.           *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	1 - if it should.                                             *
+ * 		0 - if it shouldn't.                                          *
+ ******************************************************************************/
+static int wantsReloadChecks(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return (v_PGconnContainer->m_reloadFile)
+		&& (v_PGconnContainer->m_reloadPool);
+}
+
+
+/******************************************************************************
+ * putTraceBlock()                                                            *
+ *   Writes out the block of 'TraceFormat Binary' records that a trace ring   *
+ * buffer has built up, compressing it with zstd if that was compiled in.     *
+ *                                                                            *
+ * IN:	v_traceRing - the ring buffer, whose trace file must be open.         *
+ ******************************************************************************/
+static void putTraceBlock(
+	tPGconnTraceRing* v_traceRing
+)
+{
+	unsigned char t_header[PGCONN_TRACE_BLOCK_HEADER];
+	const unsigned char* t_data = v_traceRing->m_block;
+	apr_size_t t_length = v_traceRing->m_blockLength;
+#ifdef PGCONN_ZSTD
+	size_t t_compressedLength;
+#endif
+
+	if (!t_length)
+		return;
+
+#ifdef PGCONN_ZSTD
+	/* Store the block uncompressed if compression doesn't help */
+	t_compressedLength = ZSTD_compress(
+		v_traceRing->m_compressed, v_traceRing->m_compressedSize,
+		t_data, t_length, 1
+	);
+	if ((!ZSTD_isError(t_compressedLength))
+			&& (t_compressedLength < t_length)) {
+		t_data = v_traceRing->m_compressed;
+		t_length = t_compressedLength;
+	}
+#endif
+
+	putTrace32(t_header, v_traceRing->m_blockLength);
+	putTrace32(t_header + 4, t_length);
+	v_traceRing->m_fileSize += fwrite(
+		t_header, 1, sizeof(t_header), v_traceRing->m_file
+	);
+	v_traceRing->m_fileSize += fwrite(
+		t_data, 1, t_length, v_traceRing->m_file
+	);
+	v_traceRing->m_blockLength = 0;
+}
+
+
+/******************************************************************************
+ * putTraceRecord()                                                           *
+ *   Adds a 'TraceFormat Binary' record to a trace ring buffer's block,       *
+ * writing out the block first if the record won't fit.                       *
+ *                                                                            *
+ * IN:	v_traceRing - the ring buffer, whose trace file must be open.         *
+ * 	v_time - when the message was traced.                                 *
+ * 	v_backendPID - the backend PID of the connection.                     *
+ * 	v_direction - 'F', 'B', '?' or '!' (see pgconn_trace.h).              *
+ * 	v_type - the message type byte (or 0).                                *
+ * 	v_length - the message length.                                        *
+ * 	v_flags - PGCONN_TRACE_TRUNCATED (or 0).                              *
+ * 	v_payload - the payload.                                              *
+ * 	v_payloadLength - the length of the payload.                          *
+ ******************************************************************************/
+static void putTraceRecord(
+	tPGconnTraceRing* v_traceRing,
+	apr_time_t v_time,
+	int v_backendPID,
+	char v_direction,
+	char v_type,
+	apr_uint32_t v_length,
+	int v_flags,
+	const char* v_payload,
+	apr_size_t v_payloadLength
+)
+{
+	unsigned char* t_record;
+
+	if (v_traceRing->m_blockLength + PGCONN_TRACE_RECORD_HEADER
+				+ v_payloadLength > PGCONN_TRACE_BLOCK)
+		putTraceBlock(v_traceRing);
+
+	t_record = v_traceRing->m_block + v_traceRing->m_blockLength;
+	putTrace64(t_record, v_time);
+	putTrace32(t_record + 8, v_backendPID);
+	t_record[12] = v_direction;
+	t_record[13] = v_type;
+	putTrace32(t_record + 14, v_length);
+	t_record[18] = v_flags;
+	putTrace16(t_record + 19, v_payloadLength);
+	if (v_payloadLength)
+		memcpy(t_record + PGCONN_TRACE_RECORD_HEADER, v_payload,
+			v_payloadLength);
+	v_traceRing->m_blockLength += PGCONN_TRACE_RECORD_HEADER
+							+ v_payloadLength;
+}
+
+
+/******************************************************************************
+ * getTraceMessageType()                                                      *
+ *   Looks up the type byte of a message that PQtrace() has named.            *
+ *                                                                            *
+ * IN:	v_direction - 'F' (frontend) or 'B' (backend).                        *
+ * 	v_name - the message name (not NUL-terminated).                       *
+ * 	v_length - the length of the message name.                            *
+ *                                                                            *
+ * Returns:	the type byte, or...                                          *
+ * 		0, if the message doesn't have one (or is unknown).           *
+ ******************************************************************************/
+static char getTraceMessageType(
+	char v_direction,
+	const char* v_name,
+	apr_size_t v_length
+)
+{
+	const tPGconnTraceMessage* t_message;
+
+	for (t_message = g_traceMessages; t_message->m_name; t_message++)
+		if ((t_message->m_direction == v_direction)
+				&& (!strncmp(t_message->m_name, v_name,
+								v_length))
+				&& (!t_message->m_name[v_length]))
+			return t_message->m_type;
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * putTraceSlot()                                                             *
+ *   Converts the line that PQtrace() wrote into a trace ring buffer slot     *
+ * into a 'TraceFormat Binary' record.  The line is expected to be            *
+ * "[<timestamp>\t]<direction>\t<length>\t<message name>[\t<details>]", as    *
+ * written by libpq 14 or later; anything else is kept as it is.  The         *
+ * details are kept as the payload, cut short at 'TracePayload' bytes.        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_slot - the first slot of the line.                                  *
+ ******************************************************************************/
+static void putTraceSlot(
+	tPGconnContainer* v_PGconnContainer,
+	const tPGconnTraceSlot* v_slot
+)
+{
+	const char* t_field = v_slot->m_data;
+	const char* t_end = v_slot->m_data + v_slot->m_length;
+	const char* t_next;
+	const char* t_payload = v_slot->m_data;
+	apr_size_t t_payloadMax = v_slot->m_length;
+	apr_uint32_t t_length = 0;
+	char t_direction = '?';
+	char t_type = 0;
+	int t_flags = 0;
+
+	/* A line that fills its slot is continued in the next slot(s), which
+	   aren't kept */
+	if (v_slot->m_length == PGCONN_TRACE_DATA)
+		t_flags = PGCONN_TRACE_TRUNCATED;
+	else if (t_end[-1] == '\n')
+		t_end--;
+
+	/* Skip the timestamp, if there is one */
+	t_next = memchr(t_field, '\t', t_end - t_field);
+	if (t_next && (t_next != t_field + 1)) {
+		t_field = t_next + 1;
+		t_next = memchr(t_field, '\t', t_end - t_field);
+	}
+
+	if (t_next && (t_next == t_field + 1)
+			&& ((*t_field == 'F') || (*t_field == 'B'))) {
+		for (t_next++; (t_next < t_end) && apr_isdigit(*t_next);
+								t_next++)
+			t_length = (t_length * 10) + (*t_next - '0');
+		if ((t_next < t_end) && (*t_next == '\t')) {
+			t_direction = *t_field;
+			t_field = t_next + 1;
+			t_next = memchr(t_field, '\t', t_end - t_field);
+			if (!t_next)
+				t_next = t_end;
+
+			/* Look up the message's type byte.  A message
+			   without one keeps its name in the payload */
+			t_type = getTraceMessageType(
+				t_direction, t_field, t_next - t_field
+			);
+			t_payload = t_field;
+			t_payloadMax = t_next - t_field;
+			if (t_type) {
+				/* Skip the separators before the details */
+				for (t_payload = t_next; (t_payload < t_end)
+						&& ((*t_payload == '\t')
+						    || (*t_payload == ' '));
+								t_payload++);
+				t_payloadMax = 0;
+			}
+			if (t_payloadMax < (apr_size_t)v_PGconnContainer
+							->m_tracePayload)
+				t_payloadMax = v_PGconnContainer
+							->m_tracePayload;
+		}
+	}
+
+	if ((apr_size_t)(t_end - t_payload) > t_payloadMax)
+		t_flags = PGCONN_TRACE_TRUNCATED;
+	else
+		t_payloadMax = t_end - t_payload;
+	putTraceRecord(
+		v_PGconnContainer->m_traceRing, v_slot->m_time,
+		v_slot->m_backendPID, t_direction, t_type, t_length, t_flags,
+		t_payload, t_payloadMax
+	);
+}
+
+
+/******************************************************************************
+ * drainTraceRing()                                                           *
+ *   Writes out everything in a <PGconn> container's trace ring buffer, to    *
+ * this child's trace file for the container.  Once the file reaches          *
+ * 'TraceMaxSize', it is renamed to "<file>.1" (replacing the previous one)   *
+ * and a new file is started.                                                 *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_server - the server record to log against.                          *
+ ******************************************************************************/
+static void drainTraceRing(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server
+)
+{
+	tPGconnTraceRing* t_traceRing = v_PGconnContainer->m_traceRing;
+	tPGconnTraceSlot* t_slot;
+	apr_uint32_t t_dropped;
+
+	if ((!t_traceRing->m_file) && (!(t_traceRing->m_file = fopen(
+					t_traceRing->m_fileName, "w"))))
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, errno, v_server,
+			"PGconn '%s': failed to open trace file '%s'",
+			v_PGconnContainer->m_name, t_traceRing->m_fileName
+		);
+	else if ((!t_traceRing->m_fileSize)
+			&& (v_PGconnContainer->m_traceFormat == TRACEBINARY)) {
+		unsigned char t_header[PGCONN_TRACE_HEADER] = { 0 };
+		memcpy(t_header, PGCONN_TRACE_MAGIC, 4);
+		t_header[4] = PGCONN_TRACE_VERSION;
+#ifdef PGCONN_ZSTD
+		t_header[5] = PGCONN_TRACE_ZSTD;
+#endif
+		t_traceRing->m_fileSize = fwrite(
+			t_header, 1, sizeof(t_header), t_traceRing->m_file
+		);
+	}
+
+	/* Write out (or, if the file isn't open, discard) each slot that has
+	   been filled, in order, stopping at the first one that hasn't */
+	for (;;) {
+		t_slot = &(t_traceRing->m_slot[t_traceRing->m_tail
+						& (PGCONN_TRACE_SLOTS - 1)]);
+		if (apr_atomic_read32(&(t_slot->m_sequence))
+						!= t_traceRing->m_tail + 1)
+			break;
+		if (!t_traceRing->m_file)
+			;
+		else if (v_PGconnContainer->m_traceFormat == TRACEBINARY) {
+			if (!t_slot->m_continued)
+				putTraceSlot(v_PGconnContainer, t_slot);
+		}
+		else {
+			if (!t_slot->m_continued)
+				t_traceRing->m_fileSize += fprintf(
+					t_traceRing->m_file, "%d\t",
+					t_slot->m_backendPID
+				);
+			t_traceRing->m_fileSize += fwrite(
+				t_slot->m_data, 1, t_slot->m_length,
+				t_traceRing->m_file
+			);
+		}
+		apr_atomic_xchg32(
+			&(t_slot->m_sequence),
+			t_traceRing->m_tail + PGCONN_TRACE_SLOTS
+		);
+		t_traceRing->m_tail++;
+	}
+
+	if (!t_traceRing->m_file)
+		return;
+	t_dropped = apr_atomic_xchg32(&(t_traceRing->m_dropped), 0);
+	if (v_PGconnContainer->m_traceFormat == TRACEBINARY) {
+		if (t_dropped)
+			putTraceRecord(
+				t_traceRing, apr_time_now(), 0, '!', 0,
+				t_dropped, 0, NULL, 0
+			);
+		putTraceBlock(t_traceRing);
+	}
+	else if (t_dropped)
+		t_traceRing->m_fileSize += fprintf(
+			t_traceRing->m_file,
+			"# %u trace writes dropped (ring buffer full)\n",
+			t_dropped
+		);
+	fflush(t_traceRing->m_file);
+
+	/* Rotate the file, if it is full */
+	if (t_traceRing->m_fileSize
+			>= (apr_off_t)v_PGconnContainer->m_traceMaxSize
+							* 1024 * 1024) {
+		fclose(t_traceRing->m_file);
+		t_traceRing->m_file = NULL;
+		t_traceRing->m_fileSize = 0;
+		rename(t_traceRing->m_fileName, t_traceRing->m_oldFileName);
+	}
+}
+
+
+/******************************************************************************
+ * closeTraceRing()                                                           *
+ *   Writes out whatever is left in a <PGconn> container's trace ring buffer, *
+ * and closes the trace file.                                                 *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ ******************************************************************************/
+static void closeTraceRing(
+	tPGconnContainer* v_PGconnContainer
+)
+{
+	drainTraceRing(v_PGconnContainer, NULL);
+	if (v_PGconnContainer->m_traceRing->m_file) {
+		fclose(v_PGconnContainer->m_traceRing->m_file);
+		v_PGconnContainer->m_traceRing->m_file = NULL;
+	}
+}
+
+
+/******************************************************************************
+ * wantsTraceRing()                                                           *
+ *   Checks whether the trace writer should visit a <PGconn> container.       *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ *                                                                            *
+ * Returns:	1 - if it should.                                             *
+ * 		0 - if it shouldn't.                                          *
+ ******************************************************************************/
+static int wantsTraceRing(
+	const tPGconnContainer* v_PGconnContainer
+)
+{
+	return v_PGconnContainer->m_traceRing != NULL;
+}
+
+
+/* Typedef for a per-child background thread that visits each <PGconn>
+   container periodically */
+typedef struct tPGconnWorker {
+	const char* m_name;
+	apr_interval_time_t m_interval;
+	int (*m_wants)(const tPGconnContainer*);
+	void (*m_visit)(tPGconnContainer*, server_rec*);
+	void (*m_finish)(tPGconnContainer*);	/* May be NULL */
+	apr_thread_t* m_thread;
+	apr_thread_mutex_t* m_mutex;
+	apr_thread_cond_t* m_cond;
+	int m_stop;
+	server_rec* m_server;
+} tPGconnWorker;
+
+/* The background threads.  They are separate so that a replica (or a
+   reloaded primary) that is slow to respond can't delay the others */
+static tPGconnWorker g_watchdog = {
+	"watchdog", apr_time_from_sec(1), wantsHeldPGconnChecks,
+	checkHeldPGconns, NULL
+};
+static tPGconnWorker g_replicaMonitor = {
+	"replica monitor", apr_time_from_sec(1), wantsReplicaChecks,
+	checkReplicas, closeReplicaMonitors
+};
+static tPGconnWorker g_reloader = {
+	"reloader", apr_time_from_sec(1), wantsReloadChecks, checkReloadFile,
+	finishReloads
+};
+static tPGconnWorker g_traceWriter = {
+	"trace writer", apr_time_from_msec(100), wantsTraceRing,
+	drainTraceRing, closeTraceRing
+};
+static tPGconnWorker* const g_workers[] = {
+	&g_watchdog, &g_replicaMonitor, &g_reloader, &g_traceWriter, NULL
+};
+
+
+/******************************************************************************
+ * visitPGconnContainers()                                                    *
+ *   Calls a function for each <PGconn> container (in every Virtual Host)     *
+ * that has a PGconn* resource list and that a background thread wants to     *
+ * visit.                                                                     *
+ *                                                                            *
+ * IN:	v_worker - the background thread.                                     *
+ * 	v_visit - the function to call.                                       *
+ ******************************************************************************/
+static void visitPGconnContainers(
+	tPGconnWorker* v_worker,
+	void (*v_visit)(tPGconnContainer*, server_rec*)
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnContainer* t_PGconnContainer;
+	server_rec* t_server;
+
+	for (t_server = v_worker->m_server; t_server;
+			t_server = t_server->next) {
+		t_PGconnServerConfig =
+			(tPGconnServerConfig*)ap_get_module_config(
+				t_server->module_config, &pgconn_module
+			);
+		for (t_PGconnContainer = t_PGconnServerConfig->
+							m_first_PGconnContainer;
+				t_PGconnContainer;
+				t_PGconnContainer = t_PGconnContainer->m_next)
+			if ((t_PGconnContainer->m_PGconnPool)
+					&& (v_worker->m_wants(
+							t_PGconnContainer)))
+				v_visit(t_PGconnContainer, t_server);
+	}
+}
+
+
+/******************************************************************************
+ * finishPGconnContainer()                                                    *
+ *   Adapts a background thread's 'finish' function for                       *
+ * visitPGconnContainers().                                                   *
+ ******************************************************************************/
+static tPGconnWorker* g_finishingWorker;
+static void finishPGconnContainer(
+	tPGconnContainer* v_PGconnContainer,
+	server_rec* v_server_unused
+)
+{
+	g_finishingWorker->m_finish(v_PGconnContainer);
+}
+
+
+/******************************************************************************
+ * PGconn_worker()                                                            *
+ *   The body of each background thread.  Every m_interval (e.g. once per     *
+ * second), it visits every <PGconn> container that it wants to visit.        *
+ *                                                                            *
+ * IN:	v_thread - the thread record.                                         *
+ * 	v_worker - the background thread's details.                           *
  *                                                                            *
- * Returns:	NULL or an error message.                                     *
+ * Returns:	NULL.                                                         *
  ******************************************************************************/
-static const char* PGconn_containerCommand(
-	cmd_parms* v_cmdParms,
-	void* v_dirConfig_unused,
-	const char* v_args
+static void* APR_THREAD_FUNC PGconn_worker(
+	apr_thread_t* v_thread,
+	void* v_worker
 )
 {
-	tPGconnServerConfig* t_PGconnServerConfig;
-	tPGconnContainer** t_PGconnContainer;
-	ap_directive_t* t_directive;
-	const char* t_args;
-	char* t_endPtr = "";
-	static APR_OPTIONAL_FN_TYPE(getAllFunctionDetails)*
-							getAllFunctionDetails;
-	char* t_errorMessage = NULL;
+	#define d_worker	((tPGconnWorker*)v_worker)
+	apr_thread_mutex_lock(d_worker->m_mutex);
+	while (!d_worker->m_stop) {
+		apr_thread_cond_timedwait(
+			d_worker->m_cond, d_worker->m_mutex,
+			d_worker->m_interval
+		);
+		if (!d_worker->m_stop)
+			visitPGconnContainers(d_worker, d_worker->m_visit);
+	}
+	apr_thread_mutex_unlock(d_worker->m_mutex);
+	#undef d_worker
 
-	/* Check that the Connection Name has been specified */
-	if (v_args[0] == '>')
-		return "Missing Connection Name";
+	apr_thread_exit(v_thread, APR_SUCCESS);
+	return NULL;
+}
 
-	/* Check that there is a closing ">" for the container start
-	   directive */
-	if (!strrchr(v_args, '>'))
-		return "Missing \">\"";
 
-	/* Get the server configuration structure */
-	t_PGconnServerConfig = (tPGconnServerConfig*)ap_get_module_config(
-		v_cmdParms->server->module_config, &pgconn_module
-	);
-	if (!t_PGconnServerConfig)
-		return "ap_get_module_config() failed";
+/******************************************************************************
+ * stopWorker()                                                               *
+ *   Stops a background thread.  This function should only be called as a     *
+ * child pool cleanup handler.                                                *
+ *                                                                            *
+ * IN:	v_worker - the background thread's details.                           *
+ *                                                                            *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t stopWorker(
+	void* v_worker
+)
+{
+	#define d_worker	((tPGconnWorker*)v_worker)
+	apr_status_t t_threadStatus;
 
-	/* Find the end of the <PGconn> container linked list */
-	for (t_PGconnContainer = &(t_PGconnServerConfig->
-						m_first_PGconnContainer);
-			*t_PGconnContainer;
-			t_PGconnContainer = &((*t_PGconnContainer)->m_next))
-		if (!strcmp((*t_PGconnContainer)->m_name, v_args))
-			return "Duplicate Connection Name";
+	apr_thread_mutex_lock(d_worker->m_mutex);
+	d_worker->m_stop = 1;
+	apr_thread_cond_signal(d_worker->m_cond);
+	apr_thread_mutex_unlock(d_worker->m_mutex);
+	apr_thread_join(&t_threadStatus, d_worker->m_thread);
 
-	/* Allocate memory for the <PGconn> container structure, zeroising with
-	   memset() */
-	*t_PGconnContainer = (tPGconnContainer*)apr_pcalloc(
-		v_cmdParms->pool, sizeof(**t_PGconnContainer)
-	);
-	if (!(*t_PGconnContainer))
-		return "Not enough memory";
+	/* Now that the thread has stopped, let it tidy up */
+	if (d_worker->m_finish) {
+		g_finishingWorker = d_worker;
+		visitPGconnContainers(d_worker, finishPGconnContainer);
+	}
+	#undef d_worker
 
-	/* This is added to the end of the list. 'm_next' will already be
-	   NULL, because apr_pcalloc() was used to allocate memory */
-	/* No PGconn* resource list yet. 'm_PGconnPool' will already be NULL,
-	   because apr_pcalloc() was used to allocate memory */
-	/* Copy the connection name, removing the container start directive's
-	   closing ">" */
-	(*t_PGconnContainer)->m_name = apr_pstrndup(
-		v_cmdParms->pool, v_args, strlen(v_args) - 1
-	);
-	/* Default 'connInfo' is "" */
-	(*t_PGconnContainer)->m_connInfo = "";
-	/* Minimum pool size will already be '0', because apr_pcalloc() was used
-	   to allocate memory */
-	/* Soft Maximum pool size will already be '0', because apr_pcalloc() was
-	   used to allocate memory */
-	/* Set Hard Maximum pool size to 1 */
-	(*t_PGconnContainer)->m_poolMaxHard = 1;
-	/* Default 'poolTTL' will already be '0', because apr_pcalloc() was used
-	   to allocate memory */
-	/* Default 'traceDir' will already be NULL, because apr_pcalloc() was
-	   used to allocate memory */
-	/* Catalog cache is disabled by default. 'm_catalogCache' will already
-	   be DISABLED and 'm_catalog' will already be NULL, because
-	   apr_pcalloc() was used to allocate memory */
+	return APR_SUCCESS;
+}
 
-	/* Parse the contents of the container */
-	for (t_directive = v_cmdParms->directive->first_child; t_directive;
-			t_directive = t_directive->next) {
-		t_args = t_directive->args;
-		if (!strcasecmp(t_directive->directive, "ConnInfo")) {
-			(*t_PGconnContainer)->m_connInfo = ap_getword_conf(
-				v_cmdParms->pool, &t_args
-			);
-			if (*t_args)
-				return "ConnInfo: Too many arguments";
-			else if (strlen((*t_PGconnContainer)->m_connInfo))
-				continue;
-			else
-				return "ConnInfo: Too few arguments";
+
+/******************************************************************************
+ * startWorkers()                                                             *
+ *   Starts each background thread that at least one <PGconn> container       *
+ * needs, for this process.  A container whose resource lists are created     *
+ * lazily is only visited once they have been created.                        *
+ *                                                                            *
+ * IN:	v_pool - pool to use for memory allocation.                           *
+ * 	v_server - the server record.                                         *
+ ******************************************************************************/
+static void startWorkers(
+	apr_pool_t* v_pool,
+	server_rec* v_server
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnContainer* t_PGconnContainer;
+	server_rec* t_server;
+	tPGconnWorker* t_worker;
+	int i;
+
+	for (i = 0; (t_worker = g_workers[i]); i++) {
+		/* Is this background thread needed? */
+		for (t_server = v_server; t_server; t_server = t_server->next) {
+			t_PGconnServerConfig =
+				(tPGconnServerConfig*)ap_get_module_config(
+					t_server->module_config, &pgconn_module
+				);
+			for (t_PGconnContainer = t_PGconnServerConfig->
+							m_first_PGconnContainer;
+					t_PGconnContainer;
+					t_PGconnContainer
+						= t_PGconnContainer->m_next)
+				if ((t_PGconnContainer->m_heldMutex)
+						&& (t_worker->m_wants(
+							t_PGconnContainer)))
+					break;
+			if (t_PGconnContainer)
+				break;
 		}
-		else if (!strcasecmp(t_directive->directive, "PoolMin"))
-			(*t_PGconnContainer)->m_poolMin = strtol(
-				t_directive->args, &t_endPtr, 10
-			);
-		else if (!strcasecmp(t_directive->directive, "PoolMaxSoft"))
-			(*t_PGconnContainer)->m_poolMaxSoft = strtol(
-				t_directive->args, &t_endPtr, 10
-			);
-		else if (!strcasecmp(t_directive->directive, "PoolMaxHard"))
-			(*t_PGconnContainer)->m_poolMaxHard = strtol(
-				t_directive->args, &t_endPtr, 10
+		if (!t_server)
+			continue;
+
+		t_worker->m_stop = 0;
+		t_worker->m_server = v_server;
+		if ((apr_thread_mutex_create(&(t_worker->m_mutex),
+						APR_THREAD_MUTEX_DEFAULT,
+						v_pool) != APR_SUCCESS)
+				|| (apr_thread_cond_create(&(t_worker->m_cond),
+							v_pool) != APR_SUCCESS)
+				|| (apr_thread_create(&(t_worker->m_thread),
+							NULL, PGconn_worker,
+							t_worker, v_pool)
+							!= APR_SUCCESS)) {
+			ap_log_error(
+				APLOG_MARK, APLOG_ERR, 0, v_server,
+				"Failed to start PGconn %s thread!",
+				t_worker->m_name
 			);
-		else if (!strcasecmp(t_directive->directive, "PoolTTL"))
-			(*t_PGconnContainer)->m_poolTTL = apr_strtoi64(
-				t_directive->args, &t_endPtr, 10
+			continue;
+		}
+
+		/* Register a cleanup function to stop the background thread
+		   when the server shuts down.  This is registered after the
+		   PGconn* resource lists' cleanup functions, so it runs before
+		   them */
+		apr_pool_cleanup_register(
+			v_pool, t_worker, stopWorker, apr_pool_cleanup_null
+		);
+	}
+}
+
+
+/******************************************************************************
+ * createPGconnPool()                                                         *
+ *   Sets up a <PGconn> container in this process, and creates its PGconn*    *
+ * resource lists (unless 'PoolCreate lazy' is configured, in which case they *
+ * are created by ensurePGconnPool() when they are first needed).             *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ * 	v_server - the server record to log against.                          *
+ *                                                                            *
+ * Returns:	APR_SUCCESS - if everything was OK.                           *
+ * 		otherwise - if something could not be created.                *
+ ******************************************************************************/
+static apr_status_t createPGconnPool(
+	tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool,
+	server_rec* v_server
+)
+{
+	apr_status_t t_status;
+	int i;
+
+	/* Create the held list and creation mutexes */
+	t_status = apr_thread_mutex_create(
+		&(v_PGconnContainer->m_heldMutex), APR_THREAD_MUTEX_DEFAULT,
+		v_pool
+	);
+	if (t_status == APR_SUCCESS)
+		t_status = apr_thread_mutex_create(
+			&(v_PGconnContainer->m_createMutex),
+			APR_THREAD_MUTEX_DEFAULT, v_pool
+		);
+	if (t_status != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_ERR, 0, v_server,
+			"Failed to create PGconn mutexes!"
+		);
+		v_PGconnContainer->m_heldMutex = NULL;
+		v_PGconnContainer->m_createMutex = NULL;
+		return t_status;
+	}
+
+	/* Create the trace ring buffer, if there is one ('TraceFormat Binary'
+	   implies 'TraceMode Ring').  Each slot starts off free for the ring
+	   buffer's first lap */
+	if ((v_PGconnContainer->m_traceDir)
+			&& ((v_PGconnContainer->m_traceMode == TRACERING)
+				|| (v_PGconnContainer->m_traceFormat
+							== TRACEBINARY))) {
+		v_PGconnContainer->m_traceRing = (tPGconnTraceRing*)apr_pcalloc(
+			v_pool, sizeof(*(v_PGconnContainer->m_traceRing))
+		);
+		for (i = 0; i < PGCONN_TRACE_SLOTS; i++)
+			v_PGconnContainer->m_traceRing->m_slot[i].m_sequence
+									= i;
+		v_PGconnContainer->m_traceRing->m_fileName = apr_psprintf(
+			v_pool, "%s/%d_%s.%s", v_PGconnContainer->m_traceDir,
+			getpid(),
+			encodePGconnName(
+				v_pool, "", v_PGconnContainer->m_name
+			),
+			(v_PGconnContainer->m_traceFormat == TRACEBINARY)
+				? "trb" : "trc"
+		);
+		v_PGconnContainer->m_traceRing->m_oldFileName = apr_pstrcat(
+			v_pool, v_PGconnContainer->m_traceRing->m_fileName,
+			".1", NULL
+		);
+		if (v_PGconnContainer->m_traceFormat == TRACEBINARY) {
+			v_PGconnContainer->m_traceRing->m_block = apr_palloc(
+				v_pool, PGCONN_TRACE_BLOCK
 			);
-		else if (!strcasecmp(t_directive->directive, "TraceDir")) {
-			(*t_PGconnContainer)->m_traceDir = ap_getword_conf(
-				v_cmdParms->pool, &t_args
+#ifdef PGCONN_ZSTD
+			v_PGconnContainer->m_traceRing->m_compressedSize
+				= ZSTD_compressBound(PGCONN_TRACE_BLOCK);
+			v_PGconnContainer->m_traceRing->m_compressed
+						= apr_palloc(
+				v_pool,
+				v_PGconnContainer->m_traceRing->m_compressedSize
 			);
-			if (*t_args)
-				return "TraceDir: Too many arguments";
-			else if (strlen((*t_PGconnContainer)->m_traceDir)) {
-				(*t_PGconnContainer)->m_traceDir
-						= ap_server_root_relative(
-					v_cmdParms->pool,
-					(*t_PGconnContainer)->m_traceDir
-				);
-				continue;
-			}
-			else
-				return "TraceDir: Too few arguments";
-		}
-		else if (!strcasecmp(t_directive->directive, "CatalogCache")) {
-			if (!strcasecmp(t_args, "disabled"))
-				(*t_PGconnContainer)->m_catalogCache = DISABLED;
-			else if (!strcasecmp(t_args, "enabled"))
-				(*t_PGconnContainer)->m_catalogCache = ENABLED;
-			else if (!strcasecmp(t_args, "required"))
-				(*t_PGconnContainer)->m_catalogCache = REQUIRED;
+#endif
 		}
-		else
-			return apr_psprintf(
-				v_cmdParms->temp_pool,
-				"'%s' not recognized", t_directive->directive
+	}
+
+	/* Create the reloader's scratch pool and the pool for the host
+	   records it creates, if there is a reload file */
+	if ((v_PGconnContainer->m_reloadFile)
+			&& ((apr_pool_create(&(v_PGconnContainer->m_reloadPool),
+						v_pool) != APR_SUCCESS)
+				|| (apr_pool_create(
+					&(v_PGconnContainer->m_reloadHostPool),
+					v_pool) != APR_SUCCESS)))
+		v_PGconnContainer->m_reloadPool = NULL;
+
+	if (!v_PGconnContainer->m_poolCreateLazy)
+		return createHostPGconnPools(
+			v_PGconnContainer, v_pool, v_server
+		);
+
+	/* The resource lists will be created by a request thread, which can't
+	   safely register cleanups in the child's pool, so register them now.
+	   They do nothing if the resource lists are never created */
+	apr_pool_cleanup_register(
+		v_pool, v_PGconnContainer->m_primary, destroyHostPGconnPool,
+		apr_pool_cleanup_null
+	);
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++)
+		apr_pool_cleanup_register(
+			v_pool,
+			APR_ARRAY_IDX(v_PGconnContainer->m_replicas, i,
+					tPGconnHost*),
+			destroyHostPGconnPool, apr_pool_cleanup_null
+		);
+	if (v_PGconnContainer->m_standby)
+		apr_pool_cleanup_register(
+			v_pool, v_PGconnContainer->m_standby,
+			destroyHostPGconnPool, apr_pool_cleanup_null
+		);
+
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * PGconn_preConfig()                                                         *
+ *   This function is executed each time, before the configuration is read.   *
+ * It starts a new handle table, because handles are only valid until the     *
+ * configuration is next read.                                                *
+ *                                                                            *
+ * IN:	v_pconf - the configuration pool.                                     *
+ *                                                                            *
+ * Returns:	OK.                                                           *
+ ******************************************************************************/
+static int PGconn_preConfig(
+	apr_pool_t* v_pconf,
+	apr_pool_t* v_plog_unused,
+	apr_pool_t* v_ptemp_unused
+)
+{
+	g_PGconnContainers = apr_array_make(
+		v_pconf, 16, sizeof(tPGconnContainer*)
+	);
+	return OK;
+}
+
+
+/******************************************************************************
+ * getSharingKey()                                                            *
+ *   Gets a string that is the same for two <PGconn> containers if, and only  *
+ * if, they can share the same PGconn* resource lists: i.e. they have the     *
+ * same 'SharedPool' name or, if they don't have one, identical settings.     *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	the key.                                                      *
+ ******************************************************************************/
+static const char* getSharingKey(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool
+)
+{
+	char* t_key;
+	int i;
+
+	if (v_PGconnContainer->m_sharedPool)
+		return apr_pstrcat(
+			v_pool, "SharedPool\n", v_PGconnContainer->m_sharedPool,
+			NULL
+		);
+
+	t_key = apr_psprintf(
+		v_pool,
+		"%s\n%s\n%s\n%s\n%s\n%d %d %d %d %" APR_INT64_T_FMT
+		" %d %d %d %d %d %d %d %d %d %d %d %d\n%" APR_TIME_T_FMT
+		" %" APR_TIME_T_FMT " %" APR_TIME_T_FMT " %" APR_TIME_T_FMT
+		" %" APR_TIME_T_FMT,
+		v_PGconnContainer->m_primary->m_connInfo,
+		v_PGconnContainer->m_standby
+			? v_PGconnContainer->m_standby->m_connInfo : "",
+		v_PGconnContainer->m_traceDir
+			? v_PGconnContainer->m_traceDir : "",
+		v_PGconnContainer->m_reloadFile
+			? v_PGconnContainer->m_reloadFile : "",
+		v_PGconnContainer->m_traceEnv
+			? v_PGconnContainer->m_traceEnv : "",
+		v_PGconnContainer->m_poolMin, v_PGconnContainer->m_poolMaxSoft,
+		v_PGconnContainer->m_poolMaxHard,
+		v_PGconnContainer->m_standbyPoolMin,
+		v_PGconnContainer->m_poolTTL,
+		v_PGconnContainer->m_keepAlivePinMax,
+		v_PGconnContainer->m_holdCancel,
+		v_PGconnContainer->m_cancelOnAbort,
+		v_PGconnContainer->m_propagateTimeout,
+		v_PGconnContainer->m_serverTiming,
+		(int)v_PGconnContainer->m_traceMode,
+		v_PGconnContainer->m_traceMaxSize,
+		v_PGconnContainer->m_traceSample,
+		(int)v_PGconnContainer->m_traceFormat,
+		v_PGconnContainer->m_tracePayload,
+		(int)v_PGconnContainer->m_replicaBalance,
+		v_PGconnContainer->m_poolCreateLazy,
+		v_PGconnContainer->m_keepAlivePin,
+		v_PGconnContainer->m_holdWarn,
+		v_PGconnContainer->m_maxReplicaLag,
+		v_PGconnContainer->m_replicaCheckInterval,
+		v_PGconnContainer->m_readYourWrites
+	);
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++)
+		t_key = apr_pstrcat(
+			v_pool, t_key, "\n",
+			APR_ARRAY_IDX(v_PGconnContainer->m_replicas, i,
+					tPGconnHost*)->m_connInfo,
+			NULL
+		);
+
+	return t_key;
+}
+
+
+/******************************************************************************
+ * createScoreboard()                                                         *
+ *   Creates the statistics shared memory segment, with a slot for each child *
+ * process that the MPM can run at once, and gives each <PGconn> container    *
+ * that isn't merged into another an index in the slots.  If it can't be      *
+ * created, each child just keeps its own statistics.                         *
+ *                                                                            *
+ * IN:	v_pconf - the configuration pool.                                     *
+ * 	v_server - the server record.                                         *
+ ******************************************************************************/
+static void createScoreboard(
+	apr_pool_t* v_pconf,
+	server_rec* v_server
+)
+{
+	tPGconnContainer* t_PGconnContainer;
+	apr_size_t t_pidSize;
+	apr_size_t t_size;
+	apr_status_t t_status;
+	int t_numSlots;
+	int t_numContainers = 0;
+	int i;
+
+	/* The previous segment (if any) went with the previous v_pconf */
+	memset(&g_scoreboard, 0, sizeof(g_scoreboard));
+	for (i = 0; i < g_PGconnContainers->nelts; i++) {
+		t_PGconnContainer = APR_ARRAY_IDX(
+			g_PGconnContainers, i, tPGconnContainer*
+		);
+		t_PGconnContainer->m_statsIndex = t_PGconnContainer->m_shared
+						? -1 : t_numContainers++;
+	}
+	if (t_numContainers < 1)
+		return;
+
+	if ((ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &t_numSlots)
+							!= APR_SUCCESS)
+			|| (t_numSlots < 1))
+		t_numSlots = 1;
+	t_pidSize = APR_ALIGN_DEFAULT(t_numSlots * sizeof(apr_uint32_t));
+	t_size = t_pidSize + (t_numSlots * t_numContainers * g_statsStripes
+						* sizeof(tPGconnCounters));
+
+	/* Anonymous shared memory is inherited by every child, at the same
+	   address */
+	t_status = apr_shm_create(&(g_scoreboard.m_shm), t_size, NULL, v_pconf);
+	if (t_status != APR_SUCCESS) {
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, t_status, v_server,
+			"PGconn: apr_shm_create() failed, so statistics will"
+			" only be available per child process"
+		);
+		g_scoreboard.m_shm = NULL;
+		return;
+	}
+	memset(apr_shm_baseaddr_get(g_scoreboard.m_shm), 0, t_size);
+
+	g_scoreboard.m_numSlots = t_numSlots;
+	g_scoreboard.m_numContainers = t_numContainers;
+	g_scoreboard.m_pid = (volatile apr_uint32_t*)apr_shm_baseaddr_get(
+		g_scoreboard.m_shm
+	);
+	g_scoreboard.m_counters = (tPGconnCounters*)(
+		(char*)apr_shm_baseaddr_get(g_scoreboard.m_shm) + t_pidSize
+	);
+}
+
+
+/******************************************************************************
+ * PGconn_postConfig()                                                        *
+ *   This function is executed once the configuration has been read.  It      *
+ * merges each <PGconn> container (in every Virtual Host) into the first      *
+ * container that it can share PGconn* resource lists with, so that each      *
+ * child only creates one set of resource lists for them, logs how much that  *
+ * saved, and then creates the statistics shared memory segment.              *
+ *                                                                            *
+ * IN:	v_pconf - the configuration pool.                                     *
+ * 	v_ptemp - pool to use for temporary memory allocation.                *
+ * 	v_server - the server record.                                         *
+ *                                                                            *
+ * Returns:	OK - if everything was OK.                                    *
+ * 		HTTP_INTERNAL_SERVER_ERROR - if containers with the same      *
+ * 					'SharedPool' name have different      *
+ * 					ConnInfos.                            *
+ ******************************************************************************/
+static int PGconn_postConfig(
+	apr_pool_t* v_pconf,
+	apr_pool_t* v_plog_unused,
+	apr_pool_t* v_ptemp,
+	server_rec* v_server
+)
+{
+	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnContainer* t_PGconnContainer;
+	tPGconnContainer* t_canonical;
+	apr_hash_t* t_shared = apr_hash_make(v_ptemp);
+	const char* t_key;
+	server_rec* t_server;
+	int t_merged = 0;
+	int t_mergedMaxHard = 0;
+
+	/* Stripe the statistics counters for as many threads as each child
+	   runs, up to PGCONN_STATS_STRIPES */
+	if ((ap_mpm_query(AP_MPMQ_MAX_THREADS, &g_statsStripes)
+							!= APR_SUCCESS)
+			|| (g_statsStripes < 1))
+		g_statsStripes = 1;
+	else if (g_statsStripes > PGCONN_STATS_STRIPES)
+		g_statsStripes = PGCONN_STATS_STRIPES;
+
+	/* Navigate through all the Virtual Hosts */
+	for (t_server = v_server; t_server; t_server = t_server->next) {
+		t_PGconnServerConfig =
+			(tPGconnServerConfig*)ap_get_module_config(
+				t_server->module_config, &pgconn_module
+			);
+		for (t_PGconnContainer = t_PGconnServerConfig->
+							m_first_PGconnContainer;
+				t_PGconnContainer;
+				t_PGconnContainer = t_PGconnContainer->m_next) {
+			t_key = getSharingKey(t_PGconnContainer, v_ptemp);
+			t_canonical = apr_hash_get(
+				t_shared, t_key, APR_HASH_KEY_STRING
 			);
+			if (!t_canonical) {
+				apr_hash_set(
+					t_shared, t_key, APR_HASH_KEY_STRING,
+					t_PGconnContainer
+				);
+				t_PGconnContainer->m_localStats = apr_pcalloc(
+					v_pconf, g_statsStripes
+						* sizeof(tPGconnCounters)
+				);
+				t_PGconnContainer->m_stats =
+					t_PGconnContainer->m_localStats;
+				continue;
+			}
 
-		/* Check if an error occurred */
-		if (*t_endPtr)
-			return apr_psprintf(
-				v_cmdParms->temp_pool,
-				"Invalid value specified for '%s'",
-				t_directive->directive
+			if (strcmp(t_canonical->m_primary->m_connInfo,
+					t_PGconnContainer->m_primary
+							->m_connInfo)) {
+				ap_log_error(
+					APLOG_MARK, APLOG_CRIT, 0, v_server,
+					"PGconn '%s' and PGconn '%s' have the"
+					" same SharedPool, but different"
+					" ConnInfos", t_canonical->m_name,
+					t_PGconnContainer->m_name
+				);
+				return HTTP_INTERNAL_SERVER_ERROR;
+			}
+			t_PGconnContainer->m_shared = t_canonical;
+			t_merged++;
+			t_mergedMaxHard += t_PGconnContainer->m_primary
+							->m_poolMaxHard;
+			ap_log_error(
+				APLOG_MARK, APLOG_DEBUG, 0, t_server,
+				"PGconn '%s': sharing the connection pool of"
+				" PGconn '%s'", t_PGconnContainer->m_name,
+				t_canonical->m_name
 			);
+		}
 	}
 
-	/* If required, call the mod_pgproc function to cache the "function
-	   catalog" */
-	if ((*t_PGconnContainer)->m_catalogCache != DISABLED) {
-		getAllFunctionDetails = APR_RETRIEVE_OPTIONAL_FN(
-			getAllFunctionDetails
+	if (t_merged)
+		ap_log_error(
+			APLOG_MARK, APLOG_NOTICE, 0, v_server,
+			"PGconn: merged %d <PGconn> containers (with a"
+			" combined PoolMaxHard of %d) into the connection"
+			" pools of others", t_merged, t_mergedMaxHard
 		);
-		if (!getAllFunctionDetails)
-			t_errorMessage = "\"CatalogCache enabled/required\""
-					" requires mod_pgproc!";
-		else
-			t_errorMessage = getAllFunctionDetails(
-				v_cmdParms->pool, v_cmdParms->temp_pool,
-				(*t_PGconnContainer)
-			);
-	}
 
-	return t_errorMessage;
+	createScoreboard(v_pconf, v_server);
+
+	return OK;
 }
 
 
 /******************************************************************************
- * PGconn_command()                                                           *
- *   Process the "PGconn" command.                                            *
+ * releaseScoreboardSlot()                                                    *
+ *   Gives up this child's statistics shared memory slot when it exits.  The  *
+ * cumulative counts are left in the slot, so that the server-wide totals     *
+ * never go backwards; the current counts are zeroed.  This function is       *
+ * called as a child pool cleanup handler.                                    *
  *                                                                            *
- * IN:	v_cmdParms - various server configuration details.                    *
- * 	v_PGconnDirConfig - the per-directory config structure.               *
- * 	v_moduleName - if specified, the name of the module that should use   *
- * 			the specified connection name by default (otherwise,  *
- * 			the specified connection name will be used by default *
- * 			for all modules).                                     *
- * 	v_PGconnName - the name of the <PGconn> container to use, by default, *
- * 			for this directory.                                   *
+ * Returns:	APR_SUCCESS.                                                  *
+ ******************************************************************************/
+static apr_status_t releaseScoreboardSlot(
+	void* v_unused
+)
+{
+	tPGconnContainer* t_PGconnContainer;
+	int i;
+
+	/* Any connections that are closed after this are counted locally */
+	for (i = 0; i < g_PGconnContainers->nelts; i++) {
+		t_PGconnContainer = APR_ARRAY_IDX(
+			g_PGconnContainers, i, tPGconnContainer*
+		);
+		if (t_PGconnContainer->m_shared)
+			continue;
+		t_PGconnContainer->m_stats = t_PGconnContainer->m_localStats;
+		clearPGconnGauges(getScoreboardCounters(
+			g_scoreboardSlot, t_PGconnContainer->m_statsIndex
+		));
+	}
+
+	apr_atomic_set32(&(g_scoreboard.m_pid[g_scoreboardSlot]), 0);
+	g_scoreboardSlot = -1;
+	return APR_SUCCESS;
+}
+
+
+/******************************************************************************
+ * claimScoreboardSlot()                                                      *
+ *   Claims a free slot in the statistics shared memory segment for this      *
+ * child, and points the counters of every <PGconn> container that isn't      *
+ * merged into another at it.  A slot is free if its owner released it, or    *
+ * if the parent has reaped its owner (see PGconn_childStatus()).             *
  *                                                                            *
- * Returns:	NULL or an error message.                                     *
+ * IN:	v_pool - the child pool.                                              *
+ * 	v_server - the server record.                                         *
  ******************************************************************************/
-static const char* PGconn_command(
-	cmd_parms* v_cmdParms,
-	void* v_PGconnDirConfig,
-	const char* v_PGconnName,		/* these are reversed... */
-	const char* v_moduleName		/* ...on purpose */
+static void claimScoreboardSlot(
+	apr_pool_t* v_pool,
+	server_rec* v_server
 )
 {
-	tPGconnServerConfig* t_PGconnServerConfig;
+	tPGconnCounters* t_counters;
 	tPGconnContainer* t_PGconnContainer;
+	apr_uint32_t t_pid = (apr_uint32_t)getpid();
+	int i;
 
-	/* Check if this directive should be handled by another module */
-	if (v_moduleName)
-		return DECLINE_CMD;
+	if (!g_scoreboard.m_counters)
+		return;
 
-	/* Get the server configuration structure */
-	t_PGconnServerConfig = (tPGconnServerConfig*)ap_get_module_config(
-		v_cmdParms->server->module_config, &pgconn_module
-	);
+	for (i = 0; (i < g_scoreboard.m_numSlots) && (g_scoreboardSlot < 0);
+			i++) {
+		if (apr_atomic_cas32(&(g_scoreboard.m_pid[i]), t_pid, 0) == 0)
+			g_scoreboardSlot = i;
+	}
+	if (g_scoreboardSlot < 0) {
+		ap_log_error(
+			APLOG_MARK, APLOG_WARNING, 0, v_server,
+			"PGconn: no free statistics slot for child %u",
+			(unsigned)t_pid
+		);
+		return;
+	}
 
-	/* Find the required <PGconn> container record */
-	t_PGconnContainer = getPGconnContainerByName(
-		t_PGconnServerConfig, v_PGconnName
+	/* Start counting in the slot.  Its current counts were zeroed when it
+	   was freed, but zero them again in case the previous owner was still
+	   counting when it was reaped */
+	for (i = 0; i < g_PGconnContainers->nelts; i++) {
+		t_PGconnContainer = APR_ARRAY_IDX(
+			g_PGconnContainers, i, tPGconnContainer*
+		);
+		if (t_PGconnContainer->m_shared)
+			continue;
+		t_counters = getScoreboardCounters(
+			g_scoreboardSlot, t_PGconnContainer->m_statsIndex
+		);
+		clearPGconnGauges(t_counters);
+		t_PGconnContainer->m_stats = t_counters;
+	}
+
+	apr_pool_cleanup_register(
+		v_pool, NULL, releaseScoreboardSlot, apr_pool_cleanup_null
 	);
-	#define t_PGconnDirConfig	((tPGconnDirConfig*)v_PGconnDirConfig)
-	if (t_PGconnContainer)
-		t_PGconnDirConfig->m_defaultPGconnContainer = t_PGconnContainer;
-	else
-		return "Invalid Connection Name";
-	#undef t_PGconnDirConfig
+}
 
-	return NULL;
+
+/******************************************************************************
+ * PGconn_childStatus()                                                       *
+ *   This function is executed in the parent process when the MPM starts or   *
+ * reaps a child.  A child that crashed (or was killed) didn't release its    *
+ * statistics shared memory slot, so its current counts are zeroed and the    *
+ * slot is freed here.  The pid can't have been reused before the parent      *
+ * reaped it, so it can't match a newer child's slot.                         *
+ *                                                                            *
+ * IN:	v_server - the server record.                                         *
+ * 	v_pid - the child's process ID.                                       *
+ * 	v_generation - the child's generation.                                *
+ * 	v_slot - the child's httpd scoreboard slot.                           *
+ * 	v_status - what happened to the child.                                *
+ ******************************************************************************/
+static void PGconn_childStatus(
+	server_rec* v_server,
+	pid_t v_pid,
+	ap_generation_t v_generation,
+	int v_slot,
+	mpm_child_status v_status
+)
+{
+	int i;
+	int j;
+
+	if ((v_status != MPM_CHILD_EXITED) || (!g_scoreboard.m_counters))
+		return;
+
+	for (i = 0; i < g_scoreboard.m_numSlots; i++) {
+		if (apr_atomic_read32(&(g_scoreboard.m_pid[i]))
+						!= (apr_uint32_t)v_pid)
+			continue;
+		for (j = 0; j < g_scoreboard.m_numContainers; j++)
+			clearPGconnGauges(getScoreboardCounters(i, j));
+		apr_atomic_cas32(
+			&(g_scoreboard.m_pid[i]), 0, (apr_uint32_t)v_pid
+		);
+	}
 }
 
 
@@ -641,7 +6179,9 @@ static void PGconn_childInit(
 	tPGconnServerConfig* t_PGconnServerConfig;
 	tPGconnContainer* t_PGconnContainer;
 	server_rec* t_server;
-	apr_status_t t_status;
+
+	/* Publish this child's statistics in shared memory */
+	claimScoreboardSlot(v_pool, v_server);
 
 	/* Navigate through all the Virtual Hosts */
 	for (t_server = v_server; t_server; t_server = t_server->next) {
@@ -657,41 +6197,483 @@ static void PGconn_childInit(
 							m_first_PGconnContainer;
 				t_PGconnContainer;
 				t_PGconnContainer = t_PGconnContainer->m_next)
-			if (t_PGconnContainer->m_poolMaxHard >= 1) {
-				/* Connections are allowed, so create the
-				   PGconn* resource list for this process */
-				t_status = apr_reslist_create(
-					&(t_PGconnContainer->m_PGconnPool),
-					t_PGconnContainer->m_poolMin,
-					t_PGconnContainer->m_poolMaxSoft,
-					t_PGconnContainer->m_poolMaxHard,
-					t_PGconnContainer->m_poolTTL,
-					t_PGconnContainer->m_traceDir ?
-						openPGconn_tracing :
-						openPGconn,
-					t_PGconnContainer->m_traceDir ?
-						closePGconn_tracing :
-						closePGconn,
-					t_PGconnContainer, v_pool
+			/* If connections are allowed, create the PGconn*
+			   resource list for this process */
+			if ((t_PGconnContainer->m_poolMaxHard >= 1)
+					&& (!t_PGconnContainer->m_shared))
+				createPGconnPool(
+					t_PGconnContainer, v_pool, v_server
+				);
+	}
+
+	/* Start the background threads (the held-connection watchdog and the
+	   replica monitor) that the <PGconn> containers need */
+	startWorkers(v_pool, v_server);
+}
+
+
+/******************************************************************************
+ * getPGconnState()                                                           *
+ *   Describes a <PGconn> container's failover and replica rotation state, as *
+ * seen by this child.                                                        *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	the description.                                              *
+ ******************************************************************************/
+static const char* getPGconnState(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool
+)
+{
+	const char* t_state;
+	int t_inRotation = 0;
+	int i;
+
+	if (!v_PGconnContainer->m_PGconnPool)
+		t_state = ((v_PGconnContainer->m_poolCreateLazy)
+				&& (v_PGconnContainer->m_poolMaxHard >= 1))
+			? "Not created yet" : "Unavailable";
+	else if ((v_PGconnContainer->m_standby)
+			&& (v_PGconnContainer->m_primary
+					== v_PGconnContainer->m_standby))
+		t_state = "Failed over to standby";
+	else
+		t_state = "OK";
+	if (v_PGconnContainer->m_replicas->nelts < 1)
+		return t_state;
+
+	for (i = 0; i < v_PGconnContainer->m_replicas->nelts; i++)
+		if (isReplicaUsable(APR_ARRAY_IDX(v_PGconnContainer->m_replicas,
+						i, tPGconnHost*), 0))
+			t_inRotation++;
+	return apr_psprintf(
+		v_pool, "%s, %d/%d replicas in rotation", t_state,
+		t_inRotation, v_PGconnContainer->m_replicas->nelts
+	);
+}
+
+
+/******************************************************************************
+ * getPGconnVhostName()                                                       *
+ *   Gets the "host:port" name of the virtual host that a <PGconn> container  *
+ * is defined in, which tells apart containers with the same name.            *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	the name.                                                     *
+ ******************************************************************************/
+static const char* getPGconnVhostName(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool
+)
+{
+	#define d_server	v_PGconnContainer->m_server
+	return apr_psprintf(
+		v_pool, "%s:%u",
+		d_server->server_hostname ? d_server->server_hostname : "",
+		(unsigned)d_server->port
+	);
+	#undef d_server
+}
+
+
+/******************************************************************************
+ * PGconn_statusHook()                                                        *
+ *   Adds each <PGconn> container's pool statistics, summed over every child  *
+ * process, to mod_status's server-status page.  Containers are identified by *
+ * name and virtual host.                                                     *
+ *                                                                            *
+ * IN:	v_request - the server-status request.                                *
+ * 	v_flags - AP_STATUS_SHORT for the machine-readable ("?auto") format.  *
+ *                                                                            *
+ * Returns:	OK.                                                           *
+ ******************************************************************************/
+static int PGconn_statusHook(
+	request_rec* v_request,
+	int v_flags
+)
+{
+	tPGconnContainer* t_PGconnContainer;
+	tPGconnStats t_stats;
+	const char* t_vhost;
+	const char* t_key;
+	int i;
+
+	if ((!g_PGconnContainers) || (g_PGconnContainers->nelts < 1))
+		return OK;
+
+	if (!(v_flags & AP_STATUS_SHORT))
+		ap_rputs(
+			"<hr />\n<h2>PGconn connection pools</h2>\n"
+			"<table border=\"0\"><tr><th>PGconn</th>"
+			"<th>Virtual host</th><th>Open</th>"
+			"<th>Max per child</th><th>Idle</th>"
+			"<th>In use</th><th>Waiting</th><th>Acquires</th>"
+			"<th>Timeouts</th><th>Deadline misses</th>"
+			"<th>Wait p50/p99/p99.9 (us)</th>"
+			"<th>Hold p99 (us)</th><th>Connects</th>"
+			"<th>Connect failures</th><th>Resets</th>"
+			"<th>Evictions</th><th>State</th></tr>\n",
+			v_request
+		);
+
+	/* Containers that share another's pools are reported under its name */
+	for (i = 0; i < g_PGconnContainers->nelts; i++) {
+		t_PGconnContainer = APR_ARRAY_IDX(
+			g_PGconnContainers, i, tPGconnContainer*
+		);
+		if ((t_PGconnContainer->m_shared)
+				|| (!getPGconnServerStats(t_PGconnContainer,
+								&t_stats)))
+			continue;
+		t_vhost = getPGconnVhostName(
+			t_PGconnContainer, v_request->pool
+		);
+
+		if (v_flags & AP_STATUS_SHORT) {
+			/* Keyed by name@host:port */
+			#define d_name	t_key
+			t_key = apr_pstrcat(
+				v_request->pool, t_PGconnContainer->m_name,
+				"@", t_vhost, NULL
+			);
+			ap_rprintf(
+				v_request,
+				"PGconn %s Idle: %u\nPGconn %s InUse: %u\n"
+				"PGconn %s Waiting: %u\n"
+				"PGconn %s Acquires: %" APR_UINT64_T_FMT "\n"
+				"PGconn %s Timeouts: %" APR_UINT64_T_FMT "\n"
+				"PGconn %s DeadlineMisses: %" APR_UINT64_T_FMT
+				"\n"
+				"PGconn %s WaitP99: %" APR_TIME_T_FMT "\n"
+				"PGconn %s ConnectFailures: %"
+				APR_UINT64_T_FMT "\n",
+				d_name, t_stats.m_idle, d_name, t_stats.m_inUse,
+				d_name, t_stats.m_waiting,
+				d_name, t_stats.m_acquires,
+				d_name, t_stats.m_timeouts,
+				d_name, t_stats.m_deadlineMisses,
+				d_name, measurePGconnPercentile(
+					t_stats.m_waitHistogram, 0.99
+				),
+				d_name, t_stats.m_connectFailures
+			);
+			#undef d_name
+			continue;
+		}
+
+		ap_rprintf(
+			v_request,
+			"<tr><td>%s</td><td>%s</td><td>%u</td><td>%d</td>"
+			"<td>%u</td>"
+			"<td>%u</td><td>%u</td><td>%" APR_UINT64_T_FMT "</td>"
+			"<td>%" APR_UINT64_T_FMT "</td><td>%" APR_UINT64_T_FMT
+			"</td><td>%" APR_TIME_T_FMT "/%" APR_TIME_T_FMT "/%"
+			APR_TIME_T_FMT "</td>"
+			"<td>%" APR_TIME_T_FMT "</td><td>%" APR_UINT64_T_FMT
+			"</td><td>%" APR_UINT64_T_FMT "</td><td>%"
+			APR_UINT64_T_FMT "</td><td>%" APR_UINT64_T_FMT
+			"</td><td>%s</td></tr>\n",
+			ap_escape_html(v_request->pool,
+					t_PGconnContainer->m_name),
+			ap_escape_html(v_request->pool, t_vhost),
+			t_stats.m_idle + t_stats.m_inUse,
+			t_PGconnContainer->m_primary->m_poolMaxHard,
+			t_stats.m_idle, t_stats.m_inUse, t_stats.m_waiting,
+			t_stats.m_acquires, t_stats.m_timeouts,
+			t_stats.m_deadlineMisses,
+			measurePGconnPercentile(t_stats.m_waitHistogram, 0.5),
+			measurePGconnPercentile(t_stats.m_waitHistogram, 0.99),
+			measurePGconnPercentile(
+				t_stats.m_waitHistogram, 0.999
+			),
+			measurePGconnPercentile(t_stats.m_holdHistogram, 0.99),
+			t_stats.m_connects, t_stats.m_connectFailures,
+			t_stats.m_resets, t_stats.m_evictions,
+			getPGconnState(t_PGconnContainer, v_request->pool)
+		);
+	}
+
+	if (!(v_flags & AP_STATUS_SHORT))
+		ap_rputs("</table>\n", v_request);
+
+	return OK;
+}
+
+
+/******************************************************************************
+ * escapeMetricsLabel()                                                       *
+ *   Escapes a string for use as an OpenMetrics label value.  Memory is only  *
+ * allocated if the string needs escaping (which is unusual).                 *
+ *                                                                            *
+ * IN:	v_value - the string.                                                 *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	the label value.                                              *
+ ******************************************************************************/
+static const char* escapeMetricsLabel(
+	const char* v_value,
+	apr_pool_t* v_pool
+)
+{
+	char* t_label;
+	char* t_out;
+
+	if (!strpbrk(v_value, "\\\"\n"))
+		return v_value;
+
+	t_out = t_label = apr_palloc(v_pool, (strlen(v_value) * 2) + 1);
+	for (; *v_value; v_value++) {
+		if ((*v_value == '\\') || (*v_value == '"'))
+			*(t_out++) = '\\';
+		else if (*v_value == '\n') {
+			*(t_out++) = '\\';
+			*(t_out++) = 'n';
+			continue;
+		}
+		*(t_out++) = *v_value;
+	}
+	*t_out = '\0';
+	return t_label;
+}
+
+
+/******************************************************************************
+ * getMetricsLabel()                                                          *
+ *   Gets the OpenMetrics labels that identify a <PGconn> container: its name *
+ * and its virtual host.                                                      *
+ *                                                                            *
+ * IN:	v_PGconnContainer - connection container details.                     *
+ * 	v_pool - pool to use for memory allocation.                           *
+ *                                                                            *
+ * Returns:	the labels, separated by commas.                              *
+ ******************************************************************************/
+static const char* getMetricsLabel(
+	const tPGconnContainer* v_PGconnContainer,
+	apr_pool_t* v_pool
+)
+{
+	return apr_psprintf(
+		v_pool, "pgconn=\"%s\",vhost=\"%s\"",
+		escapeMetricsLabel(v_PGconnContainer->m_name, v_pool),
+		escapeMetricsLabel(
+			getPGconnVhostName(v_PGconnContainer, v_pool), v_pool
+		)
+	);
+}
+
+
+/******************************************************************************
+ * putMetricsHistogram()                                                      *
+ *   Outputs one of a <PGconn> container's latency histograms in OpenMetrics  *
+ * format.                                                                    *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ * 	v_metric - the metric family details.                                 *
+ * 	v_label - the container's labels.                                     *
+ * 	v_stats - the container's statistics.                                 *
+ ******************************************************************************/
+static void putMetricsHistogram(
+	request_rec* v_request,
+	const tPGconnMetric* v_metric,
+	const char* v_label,
+	const tPGconnStats* v_stats
+)
+{
+	const apr_uint64_t* t_histogram = (const apr_uint64_t*)(
+		(const char*)v_stats + v_metric->m_offset
+	);
+	apr_uint64_t t_count = 0;
+	int i;
+
+	for (i = 0; i < PGCONN_HISTOGRAM_BUCKETS; i++) {
+		t_count += t_histogram[i];
+		if (i != PGCONN_HISTOGRAM_BUCKETS - 1)
+			ap_rprintf(
+				v_request,
+				"%s_bucket{%s,le=\"%.6f\"} %"
+				APR_UINT64_T_FMT "\n", v_metric->m_name,
+				v_label, getHistogramBound(i) / 1000000.0,
+				t_count
+			);
+	}
+	ap_rprintf(
+		v_request,
+		"%s_bucket{%s,le=\"+Inf\"} %" APR_UINT64_T_FMT "\n"
+		"%s_count{%s} %" APR_UINT64_T_FMT "\n",
+		v_metric->m_name, v_label, t_count, v_metric->m_name, v_label,
+		t_count
+	);
+	if (v_metric->m_sumOffset)
+		ap_rprintf(
+			v_request, "%s_sum{%s} %.6f\n",
+			v_metric->m_name, v_label,
+			*(const apr_uint64_t*)((const char*)v_stats
+						+ v_metric->m_sumOffset)
+				/ 1000000.0
+		);
+}
+
+
+/* The counter and histogram metric families, in output order */
+static const tPGconnMetric g_metricsCounters[] = {
+	{ "pgconn_acquires", "Connections acquired.",
+		APR_OFFSETOF(tPGconnStats, m_acquires), 0 },
+	{ "pgconn_timeouts",
+		"Acquires that gave up waiting for a replica's connection.",
+		APR_OFFSETOF(tPGconnStats, m_timeouts), 0 },
+	{ "pgconn_deadline_misses",
+		"Acquires whose deadline had already passed.",
+		APR_OFFSETOF(tPGconnStats, m_deadlineMisses), 0 },
+	{ "pgconn_connects", "Connections opened.",
+		APR_OFFSETOF(tPGconnStats, m_connects), 0 },
+	{ "pgconn_connect_failures", "Connections that failed to open.",
+		APR_OFFSETOF(tPGconnStats, m_connectFailures), 0 },
+	{ "pgconn_resets", "Broken connections that were reset.",
+		APR_OFFSETOF(tPGconnStats, m_resets), 0 },
+	{ "pgconn_evictions",
+		"Connections closed for exceeding PoolTTL or PoolMaxSoft.",
+		APR_OFFSETOF(tPGconnStats, m_evictions), 0 },
+	{ "pgconn_pin_reuses",
+		"Pinned keep-alive connections that were reused (these aren't "
+		"counted as acquires).",
+		APR_OFFSETOF(tPGconnStats, m_pinReuses), 0 },
+	{ NULL, NULL, 0, 0 }
+};
+static const tPGconnMetric g_metricsHistograms[] = {
+	{ "pgconn_acquire_wait_seconds", "Time spent waiting to acquire.",
+		APR_OFFSETOF(tPGconnStats, m_waitHistogram),
+		APR_OFFSETOF(tPGconnStats, m_waitTime) },
+	{ "pgconn_hold_seconds", "Time from acquire to release.",
+		APR_OFFSETOF(tPGconnStats, m_holdHistogram), 0 },
+	{ "pgconn_connect_seconds", "Time taken to open a connection.",
+		APR_OFFSETOF(tPGconnStats, m_connectHistogram), 0 },
+	{ NULL, NULL, 0, 0 }
+};
+
+
+/******************************************************************************
+ * PGconn_metricsHandler()                                                    *
+ *   Handles "SetHandler pgconn-metrics" requests, by outputting every        *
+ * <PGconn> container's pool statistics, summed over every child process, in  *
+ * OpenMetrics text format.  The statistics are read straight from the shared *
+ * memory segment with atomic loads, so no locks are taken.                   *
+ *                                                                            *
+ * IN:	v_request - the request record.                                       *
+ *                                                                            *
+ * Returns:	OK - if the metrics were output.                              *
+ * 		DECLINED - if this isn't a pgconn-metrics request.            *
+ * 		HTTP_METHOD_NOT_ALLOWED - if it isn't a GET request.          *
+ ******************************************************************************/
+static int PGconn_metricsHandler(
+	request_rec* v_request
+)
+{
+	tPGconnContainer* t_PGconnContainer;
+	tPGconnStats* t_stats;
+	const char** t_label;
+	const tPGconnMetric* t_metric;
+	int t_numContainers;
+	int i;
+
+	if ((!v_request->handler)
+			|| strcmp(v_request->handler, "pgconn-metrics"))
+		return DECLINED;
+	else if (v_request->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	ap_set_content_type(
+		v_request,
+		"application/openmetrics-text; version=1.0.0; charset=utf-8"
+	);
+	if (v_request->header_only)
+		return OK;
+
+	/* Take one snapshot of each container that owns its pools (the others
+	   are reported under its name), because each metric family has to be
+	   output in one piece */
+	t_numContainers = g_PGconnContainers ? g_PGconnContainers->nelts : 0;
+	t_stats = (tPGconnStats*)apr_palloc(
+		v_request->pool, (t_numContainers + 1) * sizeof(*t_stats)
+	);
+	t_label = (const char**)apr_palloc(
+		v_request->pool, (t_numContainers + 1) * sizeof(*t_label)
+	);
+	for (i = 0; i < t_numContainers; i++) {
+		t_PGconnContainer = APR_ARRAY_IDX(
+			g_PGconnContainers, i, tPGconnContainer*
+		);
+		t_label[i] = ((!t_PGconnContainer->m_shared)
+				&& getPGconnServerStats(t_PGconnContainer,
+							&(t_stats[i])))
+			? getMetricsLabel(t_PGconnContainer, v_request->pool)
+			: NULL;
+	}
+
+	ap_rputs(
+		"# TYPE pgconn_connections gauge\n"
+		"# HELP pgconn_connections Open connections, by state.\n",
+		v_request
+	);
+	for (i = 0; i < t_numContainers; i++)
+		if (t_label[i])
+			ap_rprintf(
+				v_request,
+				"pgconn_connections{%s,"
+				"state=\"idle\"} %u\n"
+				"pgconn_connections{%s,"
+				"state=\"in_use\"} %u\n",
+				t_label[i], t_stats[i].m_idle, t_label[i],
+				t_stats[i].m_inUse
+			);
+
+	ap_rputs(
+		"# TYPE pgconn_waiting gauge\n"
+		"# HELP pgconn_waiting Callers waiting to acquire.\n",
+		v_request
+	);
+	for (i = 0; i < t_numContainers; i++)
+		if (t_label[i])
+			ap_rprintf(
+				v_request, "pgconn_waiting{%s} %u\n",
+				t_label[i], t_stats[i].m_waiting
+			);
+
+	for (t_metric = g_metricsCounters; t_metric->m_name; t_metric++) {
+		ap_rprintf(
+			v_request, "# TYPE %s counter\n# HELP %s %s\n",
+			t_metric->m_name, t_metric->m_name, t_metric->m_help
+		);
+		for (i = 0; i < t_numContainers; i++)
+			if (t_label[i])
+				ap_rprintf(
+					v_request,
+					"%s_total{%s} %"
+					APR_UINT64_T_FMT "\n",
+					t_metric->m_name, t_label[i],
+					*(apr_uint64_t*)((char*)&(t_stats[i])
+							+ t_metric->m_offset)
+				);
+	}
+
+	for (t_metric = g_metricsHistograms; t_metric->m_name; t_metric++) {
+		ap_rprintf(
+			v_request, "# TYPE %s histogram\n# HELP %s %s\n",
+			t_metric->m_name, t_metric->m_name, t_metric->m_help
+		);
+		for (i = 0; i < t_numContainers; i++)
+			if (t_label[i])
+				putMetricsHistogram(
+					v_request, t_metric, t_label[i],
+					&(t_stats[i])
 				);
-				if (t_status != APR_SUCCESS)
-					ap_log_error(
-						APLOG_MARK, APLOG_ERR, 0,
-						v_server,
-						"Failed to create PGconn*"
-							" resource list!"
-					);
-				else	/* Register a cleanup function to
-					   destroy the PGconn* resource list
-					   when the server shuts down */
-					apr_pool_cleanup_register(
-						v_pool,
-						t_PGconnContainer->m_PGconnPool,
-						(void*)apr_reslist_destroy,
-						apr_pool_cleanup_null
-					);
-			}
 	}
+
+	ap_rputs("# EOF\n", v_request);
+	return OK;
 }
 
 
@@ -705,7 +6687,7 @@ static const command_rec PGconn_commandTable[] = {
 	),
 	AP_INIT_TAKE12(
 		"PGconn", PGconn_command, NULL, ACCESS_CONF,
-		"a <PGconn> container name"
+		"[a module name and] a <PGconn> container name"
 	),
 	NULL
 };
@@ -719,12 +6701,65 @@ static void PGconn_registerHooks(
 )
 {
 	APR_REGISTER_OPTIONAL_FN(getPGconnContainerByName);
+	APR_REGISTER_OPTIONAL_FN(getPGconnContainerHandle);
+	APR_REGISTER_OPTIONAL_FN(getPGconnContainerByHandle);
 	APR_REGISTER_OPTIONAL_FN(acquirePGconn);
 	APR_REGISTER_OPTIONAL_FN(releasePGconn);
+	APR_REGISTER_OPTIONAL_FN(acquirePGconnWithDeadline);
+	APR_REGISTER_OPTIONAL_FN(acquirePGconnEx);
 	APR_REGISTER_OPTIONAL_FN(measurePGconnAvailability);
+	APR_REGISTER_OPTIONAL_FN(getPGconnStats);
+	APR_REGISTER_OPTIONAL_FN(getPGconnServerStats);
+	APR_REGISTER_OPTIONAL_FN(measurePGconnPercentile);
+	APR_REGISTER_OPTIONAL_FN(getRequestPGconn);
+	APR_REGISTER_OPTIONAL_FN(getRequestPGconnEx);
+	APR_REGISTER_OPTIONAL_FN(getDefaultPGconnContainer);
+
+	/* Register the read-your-writes output filter */
+	ap_register_output_filter(
+		"PGCONN_LSN", PGconn_LSNFilter, NULL, AP_FTYPE_CONTENT_SET
+	);
+
+	/* Register the Server-Timing output filter */
+	ap_register_output_filter(
+		"PGCONN_TIMING", PGconn_timingFilter, NULL,
+		AP_FTYPE_CONTENT_SET
+	);
+
+	/* Register "pre config" handler */
+	ap_hook_pre_config(PGconn_preConfig, NULL, NULL, APR_HOOK_MIDDLE);
+
+	/* Register "post config" handler */
+	ap_hook_post_config(PGconn_postConfig, NULL, NULL, APR_HOOK_MIDDLE);
 
 	/* Register "child init" handler */
 	ap_hook_child_init(PGconn_childInit, NULL, NULL, APR_HOOK_MIDDLE);
+
+	/* Register "child status" handler, to free the statistics slots of
+	   children that died without releasing them */
+	ap_hook_child_status(
+		PGconn_childStatus, NULL, NULL, APR_HOOK_MIDDLE
+	);
+
+	/* Register "insert filter" handler, to re-add the output filters
+	   after an internal redirect */
+	ap_hook_insert_filter(
+		PGconn_insertFilter, NULL, NULL, APR_HOOK_MIDDLE
+	);
+
+	/* Register "log transaction" handler, which must run before any of
+	   the loggers */
+	ap_hook_log_transaction(
+		PGconn_logTransaction, NULL, NULL, APR_HOOK_REALLY_FIRST
+	);
+
+	/* Register the "pgconn-metrics" content handler */
+	ap_hook_handler(PGconn_metricsHandler, NULL, NULL, APR_HOOK_MIDDLE);
+
+	/* Register mod_status handler (if mod_status is loaded) */
+	APR_OPTIONAL_HOOK(
+		ap, status_hook, PGconn_statusHook, NULL, NULL, APR_HOOK_MIDDLE
+	);
 }
 
 
@@ -734,7 +6769,7 @@ static void PGconn_registerHooks(
 module AP_MODULE_DECLARE_DATA pgconn_module = {
 	STANDARD20_MODULE_STUFF,
 	PGconn_dirConfig_create,	/* create per-dir config */
-	NULL,				/* merge per-dir config */
+	PGconn_dirConfig_merge,		/* merge per-dir config */
 	PGconn_serverConfig_create,	/* create per-server config */
 	NULL,				/* merge per-server config */
 	PGconn_commandTable,		/* table of config file commands */
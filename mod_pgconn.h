@@ -25,8 +25,12 @@
 #include "apr_hash.h"
 #include "apr_lib.h"
 #include "apr_optional.h"
+#include "apr_tables.h"
+#include "apr_portable.h"
 #include "apr_reslist.h"
+#include "apr_shm.h"
 #include "apr_strings.h"
+#include "apr_thread_mutex.h"
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
@@ -34,6 +38,7 @@
 
 /* PostgreSQL include files */
 #include "libpq-fe.h"
+#include "libpq-events.h"
 
 
 /* Forward reference for module record */
@@ -46,7 +51,8 @@ typedef enum {
 	PGCONN_ACQUIRED		= 1,
 	PGCONN_RELEASED		= 2,
 	PGCONN_UNAVAILABLE	= 3,
-	PGCONN_BAD		= 4
+	PGCONN_BAD		= 4,
+	PGCONN_TIMEDOUT		= 5
 } ePGconnStatus;
 
 /* Enumerate the Catalog Cache modes of operation */
@@ -57,17 +63,285 @@ typedef enum {
 } eCatalogCache;
 
 
+/* Enumerate the replica load balancing policies */
+typedef enum {
+	POWEROFTWO		= 0,
+	LEASTOUTSTANDING	= 1,
+	ROUNDROBIN		= 2
+} eReplicaBalance;
+
+/* Enumerate the ways that connection tracing can be output */
+typedef enum {
+	TRACEFILES	= 0,	/* A file for each connection */
+	TRACERING	= 1	/* A ring buffer, written to one file */
+} eTraceMode;
+
+/* Enumerate the formats that a trace ring buffer can be written out in */
+typedef enum {
+	TRACETEXT	= 0,	/* As PQtrace() writes it */
+	TRACEBINARY	= 1	/* See pgconn_trace.h */
+} eTraceFormat;
+
+/* Enumerate the kinds of access an acquired connection can be used for */
+typedef enum {
+	PGCONN_READWRITE	= 0,
+	PGCONN_READONLY		= 1
+} ePGconnAccess;
+
+
+/* Latency histograms are log-linear.  Buckets 0 to 3 count values (in
+   microseconds) of 0 to 3, and above that each power of two is split into
+   PGCONN_HISTOGRAM_SUBBUCKETS buckets of equal width, so that a bucket's
+   upper bound is no more than 25% above any value in it.  The last bucket
+   also counts everything above 2^32us */
+#define PGCONN_HISTOGRAM_SUBBUCKETS	4
+#define PGCONN_HISTOGRAM_BUCKETS	124
+
+/* The most sets of pool statistics counters that each child process keeps
+   for a <PGconn> container, so that its threads don't all contend for the
+   same cache lines.  Each thread uses one set (chosen by hashing its ID),
+   and they are summed when read.  Children with fewer threads keep fewer */
+#define PGCONN_STATS_STRIPES	8
+
+
+/* Typedef for a latency histogram that is updated with atomic operations */
+typedef struct tPGconnHistogram {
+	volatile apr_uint64_t m_bucket[PGCONN_HISTOGRAM_BUCKETS];
+} tPGconnHistogram;
+
+
+/* Typedef for a <PGconn> container's pool statistics counters.  These are
+   only ever updated with atomic operations */
+typedef struct tPGconnCounters {
+	volatile apr_uint32_t m_open;		/* Connections open */
+	volatile apr_uint32_t m_inUse;		/* Connections acquired */
+	volatile apr_uint32_t m_waiting;	/* Callers in acquire */
+	volatile apr_uint64_t m_acquires;
+	volatile apr_uint64_t m_timeouts;	/* Gave up waiting (replicas) */
+	volatile apr_uint64_t m_deadlineMisses;	/* Deadline already passed */
+	volatile apr_uint64_t m_connects;
+	volatile apr_uint64_t m_connectFailures;
+	volatile apr_uint64_t m_resets;
+	volatile apr_uint64_t m_evictions;	/* Expired or surplus */
+	volatile apr_uint64_t m_pinReuses;	/* Not counted as acquires */
+	volatile apr_uint64_t m_waitTime;	/* Microseconds */
+	tPGconnHistogram m_waitHistogram;	/* Waiting to acquire */
+	tPGconnHistogram m_holdHistogram;	/* Acquire to release */
+	tPGconnHistogram m_connectHistogram;	/* PQconnectdb() */
+} tPGconnCounters;
+
+
+/* Typedef for a snapshot of a <PGconn> container's pool statistics, as
+   returned by getPGconnStats() */
+typedef struct tPGconnStats {
+	apr_uint32_t m_idle;
+	apr_uint32_t m_inUse;
+	apr_uint32_t m_waiting;
+	apr_uint64_t m_acquires;
+	apr_uint64_t m_timeouts;
+	apr_uint64_t m_deadlineMisses;
+	apr_uint64_t m_connects;
+	apr_uint64_t m_connectFailures;
+	apr_uint64_t m_resets;
+	apr_uint64_t m_evictions;
+	apr_uint64_t m_pinReuses;
+	apr_uint64_t m_waitTime;	/* Microseconds */
+	/* See measurePGconnPercentile() */
+	apr_uint64_t m_waitHistogram[PGCONN_HISTOGRAM_BUCKETS];
+	apr_uint64_t m_holdHistogram[PGCONN_HISTOGRAM_BUCKETS];
+	apr_uint64_t m_connectHistogram[PGCONN_HISTOGRAM_BUCKETS];
+} tPGconnStats;
+
+
+/* Typedef for the statistics shared memory segment.  Each child process
+   claims a slot in it, which holds a set of striped tPGconnCounters for
+   every <PGconn> container that isn't merged into another (see
+   m_statsIndex).  The segment is mapped at the same address in every child,
+   so these pointers are valid everywhere */
+typedef struct tPGconnScoreboard {
+	apr_shm_t* m_shm;
+	int m_numSlots;
+	int m_numContainers;
+	volatile apr_uint32_t* m_pid;	/* [m_numSlots], 0 if free */
+	/* [m_numSlots][m_numContainers][stripes] */
+	tPGconnCounters* m_counters;
+} tPGconnScoreboard;
+
+
+/* Typedef for an OpenMetrics metric family that is output by the
+   "pgconn-metrics" handler, from a tPGconnStats */
+typedef struct tPGconnMetric {
+	const char* m_name;
+	const char* m_help;
+	apr_size_t m_offset;	/* Of the counter, or histogram buckets */
+	apr_size_t m_sumOffset;	/* Of a histogram's sum (or 0) */
+} tPGconnMetric;
+
+
+/* Sizes of a 'TraceMode Ring' ring buffer.  Each slot is 512 bytes */
+#define PGCONN_TRACE_SLOTS	2048	/* Must be a power of two */
+#define PGCONN_TRACE_DATA	492
+
+
+/* Typedef for a slot in a 'TraceMode Ring' ring buffer */
+typedef struct tPGconnTraceSlot {
+	/* == the slot's position + 1 once it has been filled, and == its
+	   position + PGCONN_TRACE_SLOTS once it has been written out */
+	volatile apr_uint32_t m_sequence;
+	int m_backendPID;
+	apr_time_t m_time;
+	apr_uint16_t m_length;
+	apr_uint16_t m_continued;	/* Continues the previous line */
+	char m_data[PGCONN_TRACE_DATA];
+} tPGconnTraceSlot;
+
+
+/* Typedef for a <PGconn> container's 'TraceMode Ring' ring buffer, which
+   any number of connections write to and one thread reads from */
+typedef struct tPGconnTraceRing {
+	volatile apr_uint32_t m_head;	/* Next position to fill */
+	apr_uint32_t m_tail;		/* Next position to write out */
+	volatile apr_uint32_t m_dropped;	/* Writes lost when full */
+	char* m_fileName;
+	char* m_oldFileName;	/* What m_fileName is rotated to */
+	FILE* m_file;
+	apr_off_t m_fileSize;
+	/* Used by 'TraceFormat Binary' */
+	unsigned char* m_block;	/* Records not yet written out */
+	apr_size_t m_blockLength;
+	unsigned char* m_compressed;	/* Only if built with zstd */
+	apr_size_t m_compressedSize;
+	tPGconnTraceSlot m_slot[PGCONN_TRACE_SLOTS];
+} tPGconnTraceRing;
+
+
+/* Typedef for a host (the primary, or a replica) that a <PGconn> container
+   connects to */
+typedef struct tPGconnHost {
+	struct tPGconnContainer* m_PGconnContainer;
+	char* m_connInfo;
+	char* m_hostName;	/* For logging: the ConnInfo's host and port */
+	int m_poolMin;
+	int m_poolMaxSoft;
+	int m_poolMaxHard;
+	apr_int64_t m_poolTTL;	/* Microseconds */
+	apr_reslist_t* m_PGconnPool;
+	apr_pool_t* m_pool;	/* Owns m_PGconnPool */
+	int m_destroying;	/* m_PGconnPool is being destroyed */
+	int m_generation;	/* >0 if created by a reload */
+	volatile apr_uint32_t m_users;	/* Threads using m_PGconnPool */
+	/* Used once replaced (e.g. by a reload), until it has been drained */
+	struct tPGconnHost* m_nextDraining;
+	volatile apr_uint32_t m_retired;
+	/* Used for replica load balancing */
+	volatile apr_uint32_t m_inFlight;	/* Connections held */
+	volatile apr_uint32_t m_latency;	/* EWMA, microseconds */
+	/* Used by the replica monitor */
+	volatile apr_uint32_t m_outOfRotation;
+	volatile apr_uint64_t m_replayLSN;
+	PGconn* m_monitorPGconn;
+	apr_pool_t* m_monitorPool;
+} tPGconnHost;
+
+
+/* Typedef for a query cancel that the held-connection watchdog is sending */
+typedef struct tPGconnCancel {
+	PGcancel* m_PGcancel;
+	struct tPGconnResource* m_resource;	/* NULL once released */
+	int m_backendPID;
+} tPGconnCancel;
+
+
+/* Typedef for a PGconn* resource list entry */
+typedef struct tPGconnResource {
+	PGconn* m_PGconn;
+	tPGconnHost* m_PGconnHost;	/* The resource list it belongs to */
+	/* Details of the current holder, for the held-connection watchdog */
+	struct tPGconnResource* m_nextHeld;
+	struct tPGconnResource* m_prevHeld;
+	int m_held;
+	apr_time_t m_acquireTime;	/* 0 if not in use by a request */
+	apr_time_t m_heldSince;		/* When acquired from the pool */
+	apr_interval_time_t m_waitTime;	/* Waiting to be acquired */
+	apr_os_thread_t m_thread;
+	char m_uri[128];
+	apr_os_sock_t m_clientSocket;	/* -1 if unknown */
+	int m_warned;
+	int m_cancelled;
+	PGcancel* m_PGcancel;	/* Created when the connection is opened */
+	tPGconnCancel* m_cancel;	/* Non-NULL while being cancelled */
+	struct tPGconnPin* m_pin;	/* Non-NULL while pinned */
+	int m_statementTimeoutSet;
+	int m_resetPending;	/* RESET sent on release; reply not yet read */
+	int m_firstResultPending;
+	int m_wrote;	/* May have written during the current checkout */
+	/* Used by 'TraceMode Ring', 'TraceSample' and 'TraceEnv' */
+	FILE* m_traceFile;
+	int m_traceMidLine;
+	int m_traced;	/* Traced for the current checkout only */
+} tPGconnResource;
+
+
 /* Typedef for <PGconn> container structure */
 typedef struct tPGconnContainer {
 	struct tPGconnContainer* m_next;
-	apr_reslist_t* m_PGconnPool;
+	apr_reslist_t* volatile m_PGconnPool;	/* The primary's */
 	char* m_name;
+	server_rec* m_server;	/* The virtual host it's defined in */
+	int m_handle;	/* See getPGconnContainerHandle() */
+	char* m_sharedPool;
+	struct tPGconnContainer* m_shared;	/* NULL if not merged */
 	char* m_connInfo;
+	tPGconnHost* volatile m_primary;	/* Switched on failover */
+	tPGconnHost* m_configured;	/* From the config or the last reload */
+	tPGconnHost* m_standby;	/* NULL if there isn't one */
+	int m_standbyPoolMin;
+	tPGconnHost* m_monitoredPrimary;	/* Checked for failover */
+	int m_primaryFailures;	/* Consecutive checks that found it down */
+	apr_array_header_t* m_replicas;	/* tPGconnHost* */
+	eReplicaBalance m_replicaBalance;
+	volatile apr_uint32_t m_replicaCursor;
+	apr_interval_time_t m_maxReplicaLag;	/* Microseconds */
+	apr_interval_time_t m_replicaCheckInterval;	/* Microseconds */
+	apr_time_t m_nextReplicaCheck;
+	apr_interval_time_t m_readYourWrites;	/* Microseconds */
+	char* m_reloadFile;
+	apr_time_t m_reloadMTime;
+	apr_pool_t* m_reloadPool;
+	apr_pool_t* m_reloadHostPool;	/* Never cleared */
+	tPGconnHost* volatile m_first_draining;
+	int m_poolCreateLazy;
+	apr_thread_mutex_t* m_createMutex;
+	apr_time_t m_createRetry;	/* After a lazy create fails (or 0) */
 	int m_poolMin;
 	int m_poolMaxSoft;
 	int m_poolMaxHard;
 	apr_int64_t m_poolTTL;	/* Microseconds */
 	char* m_traceDir;
+	eTraceMode m_traceMode;
+	int m_traceMaxSize;	/* Megabytes */
+	eTraceFormat m_traceFormat;
+	int m_tracePayload;	/* Bytes */
+	tPGconnTraceRing* m_traceRing;	/* NULL unless 'TraceMode Ring' */
+	int m_traceSample;	/* Percent of checkouts */
+	char* m_traceEnv;
+	volatile apr_uint32_t m_traceCount;	/* Checkouts sampled from */
+	apr_interval_time_t m_keepAlivePin;	/* Microseconds */
+	int m_keepAlivePinMax;
+	volatile apr_uint32_t m_keepAlivePinned;
+	apr_interval_time_t m_holdWarn;		/* Microseconds */
+	int m_holdCancel;
+	int m_cancelOnAbort;
+	int m_propagateTimeout;
+	int m_serverTiming;
+	apr_thread_mutex_t* m_heldMutex;
+	tPGconnResource* m_first_held;
+	/* Points at m_localStats, or this child's shared memory slot, each of
+	   which is an array of striped counters (see PGCONN_STATS_STRIPES).
+	   Both are NULL if the container has been merged into another */
+	tPGconnCounters* m_stats;
+	tPGconnCounters* m_localStats;
+	int m_statsIndex;	/* In each shared memory slot, if not merged */
 	/* Used by mod_pgproc */
 	eCatalogCache m_catalogCache;
 	apr_hash_t* m_catalog;	/* "schema.name" -> tFunctionDetails */
@@ -78,20 +352,74 @@ typedef struct tPGconnContainer {
 typedef struct tPGconnServerConfig {
 	/* Linked list of <PGconn> containers */
 	tPGconnContainer* m_first_PGconnContainer;
+	/* Case-folded name -> tPGconnContainer* */
+	apr_hash_t* m_index;
 } tPGconnServerConfig;
 
 
 /* Typedef for per-directory configuration information */
 typedef struct tPGconnDirConfig {
 	tPGconnContainer* m_defaultPGconnContainer;
+	/* Folded module name -> tPGconnContainer* (NULL if empty) */
+	apr_hash_t* m_moduleDefaults;
 } tPGconnDirConfig;
 
 
+/* Typedef for a connection that is bound to a request */
+typedef struct tPGconnRequestBinding {
+	struct tPGconnRequestBinding* m_next;
+	const tPGconnContainer* m_PGconnContainer;
+	const char* m_name;	/* The container name that was asked for */
+	ePGconnAccess m_access;
+	PGconn* m_PGconn;
+	conn_rec* m_connection;
+	apr_time_t m_boundTime;
+} tPGconnRequestBinding;
+
+
+/* Typedef for per-request configuration information */
+typedef struct tPGconnRequestConfig {
+	/* Linked list of connections bound to this request */
+	tPGconnRequestBinding* m_first_binding;
+	/* Used for the request notes and the Server-Timing header */
+	int m_acquires;
+	int m_pinReuses;	/* Pinned connections taken instead */
+	apr_interval_time_t m_waitTime;	/* Microseconds */
+	int m_serverTiming;	/* 1 once the filter has been added */
+} tPGconnRequestConfig;
+
+
+/* Typedef for a connection that is pinned to a keep-alive connection */
+typedef struct tPGconnPin {
+	struct tPGconnPin* m_next;
+	const tPGconnContainer* m_PGconnContainer;
+	ePGconnAccess m_access;
+	/* NULL when nothing is pinned.  Taken with an atomic exchange, because
+	   the watchdog releases it once it has expired */
+	PGconn* m_PGconn;
+	apr_time_t m_expiry;
+} tPGconnPin;
+
+
+/* Typedef for per-connection configuration information */
+typedef struct tPGconnConnectionConfig {
+	/* Linked list of connections pinned to this client connection */
+	tPGconnPin* m_first_pin;
+} tPGconnConnectionConfig;
+
+
 /* Functions exported by this module */
 APR_DECLARE_OPTIONAL_FN(
 	tPGconnContainer*, getPGconnContainerByName,
 	(const tPGconnServerConfig*, const char*)
 );
+APR_DECLARE_OPTIONAL_FN(
+	int, getPGconnContainerHandle,
+	(const tPGconnServerConfig*, const char*)
+);
+APR_DECLARE_OPTIONAL_FN(
+	tPGconnContainer*, getPGconnContainerByHandle, (int v_handle)
+);
 APR_DECLARE_OPTIONAL_FN(
 	ePGconnStatus, acquirePGconn,
 	(const tPGconnContainer*, PGconn** v_PGconn)
@@ -100,9 +428,41 @@ APR_DECLARE_OPTIONAL_FN(
 	ePGconnStatus, releasePGconn,
 	(const tPGconnContainer*, PGconn** v_PGconn)
 );
+APR_DECLARE_OPTIONAL_FN(
+	ePGconnStatus, acquirePGconnWithDeadline,
+	(const tPGconnContainer*, apr_time_t v_deadline, PGconn** v_PGconn)
+);
+APR_DECLARE_OPTIONAL_FN(
+	ePGconnStatus, acquirePGconnEx,
+	(const tPGconnContainer*, ePGconnAccess, apr_time_t v_deadline,
+		PGconn** v_PGconn)
+);
 APR_DECLARE_OPTIONAL_FN(
 	int, measurePGconnAvailability, (const tPGconnContainer*)
 );
+APR_DECLARE_OPTIONAL_FN(
+	int, getPGconnStats, (const tPGconnContainer*, tPGconnStats*)
+);
+APR_DECLARE_OPTIONAL_FN(
+	int, getPGconnServerStats, (const tPGconnContainer*, tPGconnStats*)
+);
+APR_DECLARE_OPTIONAL_FN(
+	apr_interval_time_t, measurePGconnPercentile,
+	(const apr_uint64_t* v_histogram, double v_quantile)
+);
+APR_DECLARE_OPTIONAL_FN(
+	ePGconnStatus, getRequestPGconn,
+	(request_rec*, const tPGconnContainer*, PGconn** v_PGconn)
+);
+APR_DECLARE_OPTIONAL_FN(
+	ePGconnStatus, getRequestPGconnEx,
+	(request_rec*, const tPGconnContainer*, ePGconnAccess,
+		PGconn** v_PGconn)
+);
+APR_DECLARE_OPTIONAL_FN(
+	tPGconnContainer*, getDefaultPGconnContainer,
+	(const request_rec*, const char* v_moduleName)
+);
 
 /* Functions imported by this module */
 APR_DECLARE_OPTIONAL_FN(
@@ -0,0 +1,227 @@
+/* pgconn-bench - Compares the ways of finding a <PGconn> container
+ * Written by Rob Stradling
+ * Copyright (C) 2003-2020 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "apr_general.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_time.h"
+
+#include "pgconn_index.h"
+
+
+/* Just enough of a <PGconn> container (and of the server config that lists
+   them) for looking them up, without needing httpd or libpq */
+typedef struct tBenchContainer {
+	struct tBenchContainer* m_next;
+	char* m_name;
+	int m_handle;
+} tBenchContainer;
+
+typedef struct tBenchServerConfig {
+	tBenchContainer* m_first_PGconnContainer;
+	apr_hash_t* m_index;	/* Case-folded name -> tBenchContainer* */
+} tBenchServerConfig;
+
+/* Every container, indexed by handle */
+static apr_array_header_t* g_PGconnContainers;
+
+/* Stops the compiler optimizing the lookups away */
+static const tBenchContainer* volatile g_found;
+
+
+/******************************************************************************
+ * getContainerByScan()                                                       *
+ *   Finds a container by walking the list with strcasecmp(), as              *
+ * getPGconnContainerByName() did before the index was added.                 *
+ ******************************************************************************/
+static tBenchContainer* getContainerByScan(
+	const tBenchServerConfig* v_serverConfig,
+	const char* v_connectionName
+)
+{
+	tBenchContainer* t_PGconnContainer;
+
+	for (t_PGconnContainer = v_serverConfig->m_first_PGconnContainer;
+			t_PGconnContainer;
+			t_PGconnContainer = t_PGconnContainer->m_next)
+		if (!strcasecmp(t_PGconnContainer->m_name, v_connectionName))
+			return t_PGconnContainer;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * getContainerByName()                                                       *
+ *   Finds a container in the case-folded index, as                          *
+ * getPGconnContainerByName() in mod_pgconn.c does (with the same code, from  *
+ * pgconn_index.h).                                                           *
+ ******************************************************************************/
+static tBenchContainer* getContainerByName(
+	const tBenchServerConfig* v_serverConfig,
+	const char* v_connectionName
+)
+{
+	apr_size_t t_length = strlen(v_connectionName);
+
+	if (t_length < PGCONN_INDEX_MAX_NAME)
+		return (tBenchContainer*)getPGconnIndexEntry(
+			v_serverConfig->m_index, v_connectionName, t_length
+		);
+
+	return getContainerByScan(v_serverConfig, v_connectionName);
+}
+
+
+/******************************************************************************
+ * getContainerByHandle()                                                     *
+ *   Finds a container by handle, as getPGconnContainerByHandle() in          *
+ * mod_pgconn.c does (with the same code, from pgconn_index.h).               *
+ ******************************************************************************/
+static tBenchContainer* getContainerByHandle(
+	int v_handle
+)
+{
+	return (tBenchContainer*)getPGconnHandleEntry(
+		g_PGconnContainers, v_handle
+	);
+}
+
+
+/******************************************************************************
+ * putResult()                                                                *
+ *   Outputs how long each lookup took, on average.                           *
+ *                                                                            *
+ * IN:	v_method - the lookup method.                                         *
+ * 	v_elapsed - the time taken for all of the lookups.                    *
+ * 	v_lookups - the number of lookups.                                    *
+ ******************************************************************************/
+static void putResult(
+	const char* v_method,
+	apr_interval_time_t v_elapsed,
+	long v_lookups
+)
+{
+	printf(
+		"%-10s %10.2f ns/lookup\n", v_method,
+		(v_elapsed * 1000.0) / v_lookups
+	);
+}
+
+
+/******************************************************************************
+ * main()                                                                     *
+ *   pgconn-bench [containers [lookups]]                                      *
+ *   Creates the given number of containers (500 by default), then times the  *
+ * given number of lookups (1000000 by default) of names spread evenly over   *
+ * them, by list scan, by name and by handle.  The names are looked up in     *
+ * upper case, to include the cost of case-folding.                           *
+ ******************************************************************************/
+int main(
+	int argc,
+	const char* const argv[]
+)
+{
+	tBenchServerConfig t_serverConfig;
+	tBenchContainer** t_PGconnContainer;
+	apr_pool_t* t_pool;
+	char* t_foldedName;
+	const char** t_names;
+	int* t_handles;
+	int t_numContainers = (argc > 1) ? atoi(argv[1]) : 500;
+	long t_lookups = (argc > 2) ? atol(argv[2]) : 1000000;
+	apr_time_t t_start;
+	long i;
+
+	if ((argc > 3) || (t_numContainers < 1) || (t_lookups < 1)) {
+		fprintf(stderr, "Usage: %s [containers [lookups]]\n", argv[0]);
+		return 2;
+	}
+	else if ((apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS)
+			|| (apr_pool_create(&t_pool, NULL) != APR_SUCCESS)) {
+		fprintf(stderr, "%s: apr initialization failed\n", argv[0]);
+		return 1;
+	}
+
+	/* Create the containers, in the same order as PGconn_containerCommand()
+	   does */
+	g_PGconnContainers = apr_array_make(
+		t_pool, t_numContainers, sizeof(tBenchContainer*)
+	);
+	t_serverConfig.m_first_PGconnContainer = NULL;
+	t_serverConfig.m_index = apr_hash_make(t_pool);
+	t_PGconnContainer = &(t_serverConfig.m_first_PGconnContainer);
+	t_names = apr_palloc(t_pool, t_numContainers * sizeof(*t_names));
+	t_handles = apr_palloc(t_pool, t_numContainers * sizeof(*t_handles));
+	for (i = 0; i < t_numContainers; i++) {
+		*t_PGconnContainer = apr_pcalloc(
+			t_pool, sizeof(**t_PGconnContainer)
+		);
+		(*t_PGconnContainer)->m_name = apr_psprintf(
+			t_pool, "container%ld", i
+		);
+		(*t_PGconnContainer)->m_handle = g_PGconnContainers->nelts;
+		APR_ARRAY_PUSH(g_PGconnContainers, tBenchContainer*)
+							= *t_PGconnContainer;
+		t_foldedName = apr_pstrdup(
+			t_pool, (*t_PGconnContainer)->m_name
+		);
+		foldPGconnName(t_foldedName);
+		apr_hash_set(
+			t_serverConfig.m_index, t_foldedName,
+			APR_HASH_KEY_STRING, *t_PGconnContainer
+		);
+		t_names[i] = apr_psprintf(t_pool, "CONTAINER%ld", i);
+		t_handles[i] = getContainerByName(
+			&t_serverConfig, t_names[i]
+		)->m_handle;
+		t_PGconnContainer = &((*t_PGconnContainer)->m_next);
+	}
+
+	printf("%d containers, %ld lookups\n", t_numContainers, t_lookups);
+
+	t_start = apr_time_now();
+	for (i = 0; i < t_lookups; i++)
+		g_found = getContainerByScan(
+			&t_serverConfig, t_names[i % t_numContainers]
+		);
+	putResult("scan", apr_time_now() - t_start, t_lookups);
+
+	t_start = apr_time_now();
+	for (i = 0; i < t_lookups; i++)
+		g_found = getContainerByName(
+			&t_serverConfig, t_names[i % t_numContainers]
+		);
+	putResult("name", apr_time_now() - t_start, t_lookups);
+
+	t_start = apr_time_now();
+	for (i = 0; i < t_lookups; i++)
+		g_found = getContainerByHandle(t_handles[i % t_numContainers]);
+	putResult("handle", apr_time_now() - t_start, t_lookups);
+
+	apr_pool_destroy(t_pool);
+	apr_terminate();
+	return 0;
+}
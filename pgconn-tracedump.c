@@ -0,0 +1,329 @@
+/* pgconn-tracedump - Decodes mod_pgconn's 'TraceFormat Binary' trace files
+ * Written by Rob Stradling
+ * Copyright (C) 2003-2020 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pgconn_trace.h"
+
+/* zstd decompression.  It is only compiled in if PGCONN_ZSTD is defined (see
+   the Makefile) */
+#ifdef PGCONN_ZSTD
+#include <zstd.h>
+#endif
+
+
+/* A block's stored data is never larger than this */
+#define MAX_STORED	(PGCONN_TRACE_BLOCK * 2)
+
+static unsigned char g_stored[MAX_STORED];
+static unsigned char g_raw[PGCONN_TRACE_BLOCK];
+
+
+/******************************************************************************
+ * getTraceMessageName()                                                      *
+ *   Looks up the name of a message.                                          *
+ *                                                                            *
+ * IN:	v_direction - 'F' (frontend) or 'B' (backend).                        *
+ * 	v_type - the message type byte.                                       *
+ *                                                                            *
+ * Returns:	the message name, or...                                       *
+ * 		NULL, if the message is unknown.                              *
+ ******************************************************************************/
+static const char* getTraceMessageName(
+	char v_direction,
+	char v_type
+)
+{
+	const tPGconnTraceMessage* t_message;
+
+	for (t_message = g_traceMessages; t_message->m_name; t_message++)
+		if ((t_message->m_direction == v_direction)
+				&& (t_message->m_type == v_type))
+			return t_message->m_name;
+
+	return NULL;
+}
+
+
+/******************************************************************************
+ * putTime()                                                                  *
+ *   Outputs a record's timestamp, in the same format that PQtrace() uses.    *
+ *                                                                            *
+ * IN:	v_time - microseconds since the epoch.                                *
+ ******************************************************************************/
+static void putTime(
+	uint64_t v_time
+)
+{
+	time_t t_seconds = v_time / 1000000;
+	struct tm t_tm;
+	char t_buffer[32];
+
+	localtime_r(&t_seconds, &t_tm);
+	strftime(t_buffer, sizeof(t_buffer), "%Y-%m-%d %H:%M:%S", &t_tm);
+	printf("%s.%06u", t_buffer, (unsigned)(v_time % 1000000));
+}
+
+
+/******************************************************************************
+ * putJSONString()                                                            *
+ *   Outputs a JSON string.                                                   *
+ *                                                                            *
+ * IN:	v_data - the string's bytes (not NUL-terminated).                     *
+ * 	v_length - the number of bytes.                                       *
+ ******************************************************************************/
+static void putJSONString(
+	const unsigned char* v_data,
+	size_t v_length
+)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < v_length; i++) {
+		if ((v_data[i] == '"') || (v_data[i] == '\\'))
+			printf("\\%c", v_data[i]);
+		else if ((v_data[i] < 0x20) || (v_data[i] >= 0x7F))
+			printf("\\u%04x", v_data[i]);
+		else
+			putchar(v_data[i]);
+	}
+	putchar('"');
+}
+
+
+/******************************************************************************
+ * putRecord()                                                                *
+ *   Outputs a record, either as a line of text that looks like PQtrace()     *
+ * output (preceded by the backend PID), or as a line of JSON.                *
+ *                                                                            *
+ * IN:	v_record - the record.                                                *
+ * 	v_json - 1 for JSON, 0 for text.                                      *
+ ******************************************************************************/
+static void putRecord(
+	const unsigned char* v_record,
+	int v_json
+)
+{
+	uint64_t t_time = getTrace64(v_record);
+	uint32_t t_backendPID = getTrace32(v_record + 8);
+	char t_direction = v_record[12];
+	char t_type = v_record[13];
+	uint32_t t_length = getTrace32(v_record + 14);
+	int t_truncated = v_record[18] & PGCONN_TRACE_TRUNCATED;
+	uint16_t t_payloadLength = getTrace16(v_record + 19);
+	const unsigned char* t_payload = v_record + PGCONN_TRACE_RECORD_HEADER;
+	const char* t_name = t_type
+				? getTraceMessageName(t_direction, t_type)
+				: NULL;
+
+	if (v_json) {
+		printf("{\"time\":\"");
+		putTime(t_time);
+		printf("\",");
+		if (t_direction == '!') {
+			printf("\"dropped\":%" PRIu32 "}\n", t_length);
+			return;
+		}
+		printf(
+			"\"pid\":%" PRIu32 ",\"direction\":\"%c\",",
+			t_backendPID, t_direction
+		);
+		if (t_type) {
+			printf("\"type\":");
+			putJSONString((const unsigned char*)&t_type, 1);
+			printf(",\"message\":");
+			if (t_name)
+				putJSONString(
+					(const unsigned char*)t_name,
+					strlen(t_name)
+				);
+			else
+				printf("null");
+			putchar(',');
+		}
+		printf(
+			"\"length\":%" PRIu32 ",\"payload\":", t_length
+		);
+		putJSONString(t_payload, t_payloadLength);
+		printf(
+			",\"truncated\":%s}\n", t_truncated ? "true" : "false"
+		);
+	}
+	else if (t_direction == '!')
+		printf(
+			"# %" PRIu32 " trace writes dropped"
+			" (ring buffer full)\n", t_length
+		);
+	else {
+		putTime(t_time);
+		printf("\t%" PRIu32 "\t%c", t_backendPID, t_direction);
+		if (t_direction != '?')
+			printf("\t%" PRIu32, t_length);
+		if (t_name)
+			printf("\t%s", t_name);
+		else if (t_type)
+			printf("\tUnknown message: %c", t_type);
+		if (t_payloadLength)
+			printf(t_type ? "\t %.*s" : "\t%.*s",
+				(int)t_payloadLength, (const char*)t_payload);
+		printf("%s\n", t_truncated ? "..." : "");
+	}
+}
+
+
+/******************************************************************************
+ * dumpTraceFile()                                                            *
+ *   Decodes a 'TraceFormat Binary' trace file.                               *
+ *                                                                            *
+ * IN:	v_file - the trace file.                                              *
+ * 	v_fileName - its name, for error messages.                            *
+ * 	v_json - 1 for JSON, 0 for text.                                      *
+ *                                                                            *
+ * Returns:	0 - if the whole file was decoded.                            *
+ * 		1 - if it wasn't.                                             *
+ ******************************************************************************/
+static int dumpTraceFile(
+	FILE* v_file,
+	const char* v_fileName,
+	int v_json
+)
+{
+	unsigned char t_header[PGCONN_TRACE_HEADER];
+	uint32_t t_rawLength;
+	uint32_t t_storedLength;
+	uint32_t t_offset;
+	uint32_t t_recordLength;
+
+	if ((fread(t_header, 1, sizeof(t_header), v_file) != sizeof(t_header))
+			|| memcmp(t_header, PGCONN_TRACE_MAGIC, 4)
+			|| (t_header[4] != PGCONN_TRACE_VERSION)) {
+		fprintf(stderr, "%s: not a binary trace file\n", v_fileName);
+		return 1;
+	}
+
+	while (fread(t_header, 1, PGCONN_TRACE_BLOCK_HEADER, v_file)
+						== PGCONN_TRACE_BLOCK_HEADER) {
+		t_rawLength = getTrace32(t_header);
+		t_storedLength = getTrace32(t_header + 4);
+		if ((t_rawLength > PGCONN_TRACE_BLOCK)
+				|| (t_storedLength > MAX_STORED)) {
+			fprintf(stderr, "%s: corrupt block\n", v_fileName);
+			return 1;
+		}
+		else if (fread(g_stored, 1, t_storedLength, v_file)
+							!= t_storedLength) {
+			/* The writer was probably still writing it */
+			fprintf(stderr, "%s: truncated block\n", v_fileName);
+			return 1;
+		}
+
+		/* Decompress the block, unless it was stored as it is */
+		if (t_storedLength == t_rawLength)
+			memcpy(g_raw, g_stored, t_rawLength);
+		else {
+#ifdef PGCONN_ZSTD
+			size_t t_length = ZSTD_decompress(
+				g_raw, sizeof(g_raw), g_stored, t_storedLength
+			);
+			if (ZSTD_isError(t_length)
+					|| (t_length != t_rawLength)) {
+				fprintf(
+					stderr, "%s: corrupt block\n",
+					v_fileName
+				);
+				return 1;
+			}
+#else
+			fprintf(
+				stderr, "%s: compressed with zstd, but"
+				" pgconn-tracedump was built without zstd\n",
+				v_fileName
+			);
+			return 1;
+#endif
+		}
+
+		for (t_offset = 0; t_offset < t_rawLength;
+						t_offset += t_recordLength) {
+			t_recordLength = PGCONN_TRACE_RECORD_HEADER;
+			if (t_offset + t_recordLength <= t_rawLength)
+				t_recordLength += getTrace16(
+					g_raw + t_offset + 19
+				);
+			if (t_offset + t_recordLength > t_rawLength) {
+				fprintf(
+					stderr, "%s: corrupt record\n",
+					v_fileName
+				);
+				return 1;
+			}
+			putRecord(g_raw + t_offset, v_json);
+		}
+	}
+
+	return 0;
+}
+
+
+/******************************************************************************
+ * main()                                                                     *
+ *   pgconn-tracedump [-j] [file...]                                          *
+ *   Decodes each 'TraceFormat Binary' trace file (or stdin) to text, or to   *
+ * JSON (one object per line) if -j is given.                                 *
+ ******************************************************************************/
+int main(
+	int argc,
+	char* argv[]
+)
+{
+	FILE* t_file;
+	int t_json = 0;
+	int t_status = 0;
+	int i = 1;
+
+	if ((argc > 1) && (!strcmp(argv[1], "-j"))) {
+		t_json = 1;
+		i++;
+	}
+	if ((i < argc) && (argv[i][0] == '-') && argv[i][1]) {
+		fprintf(stderr, "Usage: %s [-j] [file...]\n", argv[0]);
+		return 2;
+	}
+
+	if (i == argc)
+		return dumpTraceFile(stdin, "stdin", t_json);
+
+	for (; i < argc; i++) {
+		if (!strcmp(argv[i], "-"))
+			t_status |= dumpTraceFile(stdin, "stdin", t_json);
+		else if (!(t_file = fopen(argv[i], "rb"))) {
+			perror(argv[i]);
+			t_status = 1;
+		}
+		else {
+			t_status |= dumpTraceFile(t_file, argv[i], t_json);
+			fclose(t_file);
+		}
+	}
+
+	return t_status;
+}
@@ -0,0 +1,79 @@
+/* mod_pgconn - An httpd module for PostgreSQL connection pooling
+ * Written by Rob Stradling
+ * Copyright (C) 2003-2020 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PGCONN_INDEX_H
+#define PGCONN_INDEX_H
+
+#include <string.h>
+
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_tables.h"
+
+
+/* How <PGconn> containers are found, which mod_pgconn uses and pgconn-bench
+   times.  Each server config indexes its containers by case-folded name
+   (container names are case-insensitive), and every container has a handle,
+   which is its position in an array of every container.  Entries are void*,
+   so that pgconn-bench doesn't need httpd or libpq */
+
+/* Names this long (or longer) aren't looked up in the index, and the caller
+   has to search for them instead.  There shouldn't be any */
+#define PGCONN_INDEX_MAX_NAME	256
+
+
+/* Case-folds a name in place, as ap_str_tolower() does */
+static inline void foldPGconnName(
+	char* v_name
+)
+{
+	for (; *v_name; v_name++)
+		*v_name = apr_tolower(*v_name);
+}
+
+/* Looks a name of v_length (< PGCONN_INDEX_MAX_NAME) characters up in a
+   case-folded name index, folding it on the stack.  Returns NULL if it isn't
+   there */
+static inline void* getPGconnIndexEntry(
+	apr_hash_t* v_index,
+	const char* v_name,
+	apr_size_t v_length
+)
+{
+	char t_foldedName[PGCONN_INDEX_MAX_NAME];
+
+	memcpy(t_foldedName, v_name, v_length + 1);
+	foldPGconnName(t_foldedName);
+	return apr_hash_get(v_index, t_foldedName, v_length);
+}
+
+/* Looks a handle up in the array of every container.  Returns NULL if it
+   isn't valid */
+static inline void* getPGconnHandleEntry(
+	const apr_array_header_t* v_containers,
+	int v_handle
+)
+{
+	if ((!v_containers) || (v_handle < 0)
+			|| (v_handle >= v_containers->nelts))
+		return NULL;
+
+	return APR_ARRAY_IDX(v_containers, v_handle, void*);
+}
+
+#endif
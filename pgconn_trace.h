@@ -0,0 +1,167 @@
+/* mod_pgconn - An httpd module for PostgreSQL connection pooling
+ * Written by Rob Stradling
+ * Copyright (C) 2003-2020 Sectigo Limited
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PGCONN_TRACE_H
+#define PGCONN_TRACE_H
+
+#include <stdint.h>
+
+
+/* The 'TraceFormat Binary' trace file format, which mod_pgconn writes and
+   pgconn-tracedump reads.  All integers are little-endian.
+
+   A file starts with a header:
+	"PGCT", version (1 byte), flags (1 byte), 2 reserved bytes.
+
+   Then come any number of blocks:
+	raw length (4 bytes), stored length (4 bytes), stored data.
+   The stored data is the raw data compressed with zstd, unless the two
+   lengths are equal, in which case it is the raw data itself.
+
+   The raw data is a sequence of records:
+	time (8 bytes, microseconds since the epoch), backend PID (4 bytes),
+	direction (1 byte), message type (1 byte), message length (4 bytes),
+	flags (1 byte), payload length (2 bytes), payload.
+   The direction is 'F' (frontend to backend) or 'B' (backend to frontend),
+   or '?' if the line that PQtrace() wrote couldn't be parsed (in which
+   case the payload is that line).  The message type is the protocol's
+   message type byte, or 0 for a message that doesn't have one (in which
+   case the payload starts with the message name).  The payload is the
+   rest of the line that PQtrace() wrote for the message, which is cut
+   short if the record's flags include PGCONN_TRACE_TRUNCATED.
+   A record with direction '!' reports that the ring buffer was full, and
+   its message length is the number of PQtrace() writes that were dropped */
+#define PGCONN_TRACE_MAGIC	"PGCT"
+#define PGCONN_TRACE_VERSION	1
+#define PGCONN_TRACE_HEADER	8
+#define PGCONN_TRACE_BLOCK_HEADER	8
+#define PGCONN_TRACE_RECORD_HEADER	21
+#define PGCONN_TRACE_BLOCK	65536	/* Maximum raw length */
+
+/* File header flags */
+#define PGCONN_TRACE_ZSTD	0x01	/* Blocks may be compressed */
+
+/* Record flags */
+#define PGCONN_TRACE_TRUNCATED	0x01
+
+
+/* Typedef for a PostgreSQL protocol message that PQtrace() names */
+typedef struct tPGconnTraceMessage {
+	char m_direction;
+	char m_type;
+	const char* m_name;
+} tPGconnTraceMessage;
+
+
+/* The messages that PQtrace() names, as of PostgreSQL 14.  Those that don't
+   have a message type byte aren't listed */
+static const tPGconnTraceMessage g_traceMessages[] = {
+	{ 'F', 'B', "Bind" },
+	{ 'F', 'C', "Close" },
+	{ 'F', 'd', "CopyData" },
+	{ 'F', 'c', "CopyDone" },
+	{ 'F', 'f', "CopyFail" },
+	{ 'F', 'D', "Describe" },
+	{ 'F', 'E', "Execute" },
+	{ 'F', 'H', "Flush" },
+	{ 'F', 'F', "FunctionCall" },
+	{ 'F', 'P', "Parse" },
+	{ 'F', 'p', "PasswordMessage" },
+	{ 'F', 'Q', "Query" },
+	{ 'F', 'S', "Sync" },
+	{ 'F', 'X', "Terminate" },
+	{ 'B', 'R', "Authentication" },
+	{ 'B', 'K', "BackendKeyData" },
+	{ 'B', '2', "BindComplete" },
+	{ 'B', '3', "CloseComplete" },
+	{ 'B', 'C', "CommandComplete" },
+	{ 'B', 'd', "CopyData" },
+	{ 'B', 'c', "CopyDone" },
+	{ 'B', 'G', "CopyInResponse" },
+	{ 'B', 'H', "CopyOutResponse" },
+	{ 'B', 'W', "CopyBothResponse" },
+	{ 'B', 'D', "DataRow" },
+	{ 'B', 'I', "EmptyQueryResponse" },
+	{ 'B', 'E', "ErrorResponse" },
+	{ 'B', 'V', "FunctionCallResponse" },
+	{ 'B', 'v', "NegotiateProtocolVersion" },
+	{ 'B', 'n', "NoData" },
+	{ 'B', 'N', "NoticeResponse" },
+	{ 'B', 'A', "NotificationResponse" },
+	{ 'B', 't', "ParameterDescription" },
+	{ 'B', 'S', "ParameterStatus" },
+	{ 'B', '1', "ParseComplete" },
+	{ 'B', 's', "PortalSuspended" },
+	{ 'B', 'Z', "ReadyForQuery" },
+	{ 'B', 'T', "RowDescription" },
+	{ 0, 0, NULL }
+};
+
+
+/* Little-endian integer encoding and decoding */
+static inline void putTrace16(
+	unsigned char* v_buffer,
+	uint16_t v_value
+)
+{
+	v_buffer[0] = v_value & 0xFF;
+	v_buffer[1] = v_value >> 8;
+}
+
+static inline void putTrace32(
+	unsigned char* v_buffer,
+	uint32_t v_value
+)
+{
+	putTrace16(v_buffer, v_value & 0xFFFF);
+	putTrace16(v_buffer + 2, v_value >> 16);
+}
+
+static inline void putTrace64(
+	unsigned char* v_buffer,
+	uint64_t v_value
+)
+{
+	putTrace32(v_buffer, v_value & 0xFFFFFFFF);
+	putTrace32(v_buffer + 4, v_value >> 32);
+}
+
+static inline uint16_t getTrace16(
+	const unsigned char* v_buffer
+)
+{
+	return v_buffer[0] | ((uint16_t)v_buffer[1] << 8);
+}
+
+static inline uint32_t getTrace32(
+	const unsigned char* v_buffer
+)
+{
+	return getTrace16(v_buffer)
+		| ((uint32_t)getTrace16(v_buffer + 2) << 16);
+}
+
+static inline uint64_t getTrace64(
+	const unsigned char* v_buffer
+)
+{
+	return getTrace32(v_buffer)
+		| ((uint64_t)getTrace32(v_buffer + 4) << 32);
+}
+
+#endif